@@ -173,41 +173,43 @@ void Application::MainLoop() {
 	meshDb.Init();
 	shaderDb.Init();
 	m_physEngine.Init(camera, meshDb, shaderDb);
+	if (!m_resumePath.empty() && !m_physEngine.LoadCheckpoint(m_resumePath))
+		std::cout << "ERROR::CHECKPOINT::LOAD_FAILED " << m_resumePath << std::endl;
+	if (m_deterministic)
+		m_physEngine.SetDeterministic(true);
+	if (!m_hashLogPath.empty() && !m_physEngine.LogStateHashes(m_hashLogPath))
+		std::cout << "ERROR::STATE_HASH::OPEN_FAILED " << m_hashLogPath << std::endl;
 
 	// Prepare some time bookkeeping
-	const GLfloat timeStart = (GLfloat)glfwGetTime();
-	GLfloat lastFrameTimeSinceStart = 0.0f;
+	double currentTime = glfwGetTime();
 
-	// Timestep init
-	double t = 0.0;
-	double dt = 1.0f/60.0f;
+	// The physics runs at a fixed timestep on its own thread from now on
+	const double dt = 1.0 / 60.0;
+	m_simulation.Start(m_physEngine, dt);
 
-	double currentTime = (GLfloat)glfwGetTime();
-	double accumulator = 0.0f;
-
-	//float frameAcc = 0.0f;
-	//float frameCounter = 0.0f;
+	double frameAcc = 0.0;
+	int frameCounter = 0;
 
 	while (!glfwWindowShouldClose(m_window))
 	{
-		// Implementing timestep
-		double newTime = (GLfloat)glfwGetTime();
+		double newTime = glfwGetTime();
 		double frameTime = newTime - currentTime;
 		currentTime = newTime;
 
-		accumulator += frameTime;
-
 		// poll input events
 		glfwPollEvents();
 
-		// Handle key state changes in the physics engine and clear them
+		// Hand key state changes to the physics thread and clear them
 		for (const auto& keyEvt : latestKeyStateChanges)
-			m_physEngine.HandleInputKey(keyEvt.keyCode, keyEvt.pressed);
+			m_simulation.PostKey(keyEvt.keyCode, keyEvt.pressed);
 		latestKeyStateChanges.clear();
 
 		// Update camera
 		DoMovement(frameTime);
 
+		// Upload the meshes that finished loading in the background
+		meshDb.ProcessUploads();
+
 		// Clear the colorbuffer
 		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -216,35 +218,59 @@ void Application::MainLoop() {
 		auto projection = glm::perspective(camera.GetZoom(), (GLfloat)m_width / (GLfloat)m_height, 0.1f, 1000.0f);
 		auto view = camera.GetViewMatrix();
 
-		//if(frameAcc >= 1.0f)
-		//{
-		//	std::cout << "FPS " << frameCounter << std::endl;
-		//	frameAcc = 0.0f;
-		//	frameCounter = 0.0f;
-		//}
 
-		while (accumulator >= dt)
+		// Draw the latest published physics state, interpolated to the current time
+		if (const RenderSnapshot* snapshot = m_simulation.LatestSnapshot())
+			m_physEngine.Display(view, projection, *snapshot, m_simulation.InterpolationAlpha(*snapshot));
+
+		// Once a second, show the frame rate and what the culling saved in the title bar
+		frameAcc += frameTime;
+		frameCounter++;
+		if (frameAcc >= 1.0)
 		{
-			// Update the physics
-			m_physEngine.Update(dt, t);
-			//frameAcc += dt;
-			accumulator -= dt;
-			t += dt;
+			const auto& stats = m_physEngine.LastDrawStats();
+			std::string title = "Physics-Based Animation - " + std::to_string(frameCounter) + " FPS, "
+				+ std::to_string(stats.drawn) + " drawn, " + std::to_string(stats.culled) + " culled";
+			if (m_physEngine.Recording())
+				title += ", recording";
+			if (m_physEngine.Deterministic())
+				title += ", deterministic";
+			glfwSetWindowTitle(m_window, title.c_str());
+			frameAcc = 0.0;
+			frameCounter = 0;
 		}
-		// Draw all the objects in the physics engine
-		m_physEngine.Display(view, projection);
-		//frameCounter++;
+
 		// Swap the buffers
 		glfwSwapBuffers(m_window);
 	}
 
+	m_simulation.Stop();
 	glfwTerminate();
 }
 
 
 int main(int argc, const char** argv)
 {
+	// Offline comparison of the Barnes-Hut tree against brute force, no window needed
+	if (argc > 1 && std::string(argv[1]) == "--nbody-benchmark")
+	{
+		BarnesHut::RunBenchmark(argc > 2 ? std::atoi(argv[2]) : 100000);
+		return 0;
+	}
+
 	Application app;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--resume" && i + 1 < argc)
+			app.ResumeFrom(argv[++i]);
+		else if (arg == "--deterministic")
+		{
+			// The hash log is optional
+			bool hasLog = i + 1 < argc && argv[i + 1][0] != '-';
+			app.RunDeterministic(hasLog ? argv[++i] : "");
+		}
+	}
 	app.MainLoop();
 	return 0;
 }
\ No newline at end of file
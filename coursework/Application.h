@@ -1,5 +1,7 @@
 #pragma once
 
+#include <iostream>
+#include <sstream>
 #include <unordered_map>
 
 // GLEW
@@ -8,37 +10,186 @@
 // GLFW
 #include <GLFW/glfw3.h>
 
+#include "AssetLoader.h"
 #include "Mesh.h"
+#include "MeshSimplify.h"
+#include "MeshOptimize.h"
+#include "MeshCache.h"
+#include "ProceduralMesh.h"
 #include "Shader.h"
 #include "PhysicsEngine.h"
+#include "SimulationThread.h"
 
 // A mesh database
 class MeshDb
 {
 public:
-	// Initialise the database with two meshes created in code
+	// Initialise the database with the meshes created in code
 	void Init()
 	{
 		Add("tetra", Mesh(TetrahedronMeshData()));
 		Add("plane", Mesh(PlaneMeshData()));
+		Add("impostor", Mesh(ImpostorQuadMeshData()));
+
+		// Generated at compile time: nothing to parse and no file to read
+		AddStatic("sphere", SPHERE_MESH);
+		AddStatic("cube", CUBE_MESH);
+		AddStatic("cone", CONE_MESH);
+	}
+
+	// Add a mesh generated at compile time, uploading its arrays as they are
+	template<size_t NumVertices, size_t NumIndices>
+	void AddStatic(const std::string& name, const StaticMesh<NumVertices, NumIndices>& mesh)
+	{
+		Mesh md;
+		md.Init(mesh.vertices.data(), NumVertices, mesh.indices.data(), NumIndices);
+		Add(name, md);
 	}
 	
-	// Add a mesh to the database
+	// Add a mesh to the database. Heavy meshes also get a chain of simplified levels of detail, each with half the
+	// triangles of the previous one, in the same format. They are built from the mesh data, so a mesh whose format
+	// doesn't keep it gets none
 	void Add(const std::string& name, Mesh& md)
 	{
 		data[name] = md;
+
+		auto& chain = lods[name];
+		chain = { &data[name] };
+		auto levels = BuildLods(md.Data());
+		for (size_t i = 1; i < levels.size(); i++)
+		{
+			auto& lod = data[LevelName(name, int(i))];
+			lod = Mesh(levels[i], md.Format());
+			chain.push_back(&lod);
+		}
 	}
 	
-	// Fetch a pointer to a mesh given a name, null if not found
+	// Add a mesh from a Wavefront OBJ file, loaded in the background. Get returns the mesh straight away, but it only
+	// draws once ProcessUploads has uploaded it, and its levels of detail appear at the same time.
+	// The first load cooks the mesh (levels of detail included) into a binary file next to the source; later loads map
+	// that file instead, as long as the source is unchanged. Loaded meshes are compact by default.
+	// The built-in scene only uses the meshes made in Init, so nothing in the application calls this
+	void Load(const std::string& name, const std::string& objPath, const MeshFormat& format = MeshFormat::Compact())
+	{
+		// The slot Get hands out, filled in place by the upload
+		data[name];
+		lods[name].clear();
+
+		loader.Enqueue([this, name, objPath, format]() -> AssetLoader::Upload
+			{
+				std::string report;
+				std::shared_ptr<CookedMesh> cooked;
+				auto levels = LoadLevels(objPath, format, report, cooked);
+
+				// Only the GL calls are left for the GL thread. The closure keeps the cooked file mapped until then, as
+				// levels in the default format point into it
+				return [this, name, levels = std::move(levels), report, cooked = std::move(cooked)]()
+				{
+					auto& chain = lods[name];
+					chain.clear();
+					for (size_t i = 0; i < levels.size(); i++)
+					{
+						auto& mesh = data[LevelName(name, int(i))];
+						mesh.Upload(levels[i]);
+						chain.push_back(&mesh);
+					}
+					std::cout << report;
+				};
+			});
+	}
+
+	// Uploads the meshes that finished loading. Called every frame on the GL thread
+	void ProcessUploads() { loader.ProcessUploads(); }
+
+	// Fetch a pointer to a mesh given a name, null if not found. The pointer stays valid; a mesh that is still loading
+	// is not IsReady() and draws nothing
 	const Mesh* Get(const std::string& name) const
 	{
 		auto it = data.find(name);
 		return it != data.end() ? &it->second : nullptr;
 	}
 
+	// Fetch the levels of detail of a mesh, from full detail to coarsest, null if not found. Empty while it is loading
+	const std::vector<const Mesh*>* GetLods(const std::string& name) const
+	{
+		auto it = lods.find(name);
+		return it != lods.end() ? &it->second : nullptr;
+	}
+
 private:
+	// Name a level of detail is stored under
+	static std::string LevelName(const std::string& name, int level)
+	{
+		return level == 0 ? name : name + "#lod" + std::to_string(level);
+	}
+
+	// The mesh itself followed by its simplified levels of detail
+	static std::vector<MeshData> BuildLods(const MeshData& meshData)
+	{
+		std::vector<MeshData> levels = { meshData };
+		while (int(levels.size()) < MAX_LOD_LEVELS)
+		{
+			int faces = int(levels.back().positions.faces.size());
+			if (faces / 2 < MIN_LOD_FACES)
+				break;
+			auto simplified = SimplifyMesh(levels.back(), faces / 2);
+			// Stop once the simplifier can't remove much more without folding the surface
+			if (simplified.positions.faces.size() > size_t(faces) * 3 / 4)
+				break;
+			levels.push_back(std::move(simplified));
+		}
+		return levels;
+	}
+
+	// Reads, cooks and packs every level of a mesh. Runs on a loader thread, so it touches nothing in the database.
+	// A cooked file is handed back mapped in cooked: levels in the default format are uploaded straight from its pages
+	static std::vector<PackedMesh> LoadLevels(const std::string& objPath, const MeshFormat& format, std::string& report,
+		std::shared_ptr<CookedMesh>& cooked)
+	{
+		std::vector<PackedMesh> levels;
+		auto mapped = std::make_shared<CookedMesh>();
+		if (mapped->Open(objPath))
+		{
+			for (int i = 0; i < mapped->LevelCount(); i++)
+			{
+				const auto& level = mapped->GetLevel(i);
+				levels.push_back(Mesh::Wrap(level.vertices, level.numVertices, level.indices, level.numIndices, format));
+			}
+			cooked = std::move(mapped);
+			return levels;
+		}
+
+		// A missing or invalid file comes back empty, and is left uncooked so it isn't cached either
+		MeshData meshData = MeshDataFromWavefrontObj(objPath.c_str());
+		if (meshData.positions.faces.empty())
+			return levels;
+
+		std::vector<GpuMeshData> cookedLevels;
+		std::ostringstream out;
+		for (const auto& level : BuildLods(meshData))
+		{
+			MeshOptimizeStats stats;
+			const auto& gpu = cookedLevels.emplace_back(CookMeshData(level, &stats));
+			levels.push_back(Mesh::Pack(gpu.vertices.data(), gpu.vertices.size(), gpu.indices.data(), gpu.indices.size(), format));
+			out << "Cooked " << objPath << " level " << cookedLevels.size() - 1 << ": " << stats.verticesBefore << " -> "
+				<< stats.verticesAfter << " vertices, ACMR " << stats.acmrBefore << " -> " << stats.acmrAfter << std::endl;
+		}
+		CookedMesh::Write(objPath, cookedLevels);
+		report = out.str();
+		return levels;
+	}
+
+	// Meshes with fewer triangles than this are not simplified further
+	static const int MIN_LOD_FACES = 64;
+	static const int MAX_LOD_LEVELS = 6;
+
 	// Store the names->meshes as a hash map
 	std::unordered_map<std::string, Mesh> data;
+	// Levels of detail per name. They point into data, whose elements never move
+	std::unordered_map<std::string, std::vector<const Mesh*>> lods;
+
+	// Both maps are only touched on the GL thread; the loader threads hand their results over through the upload queue
+	AssetLoader loader;
 };
 
 // A shader database
@@ -49,6 +200,8 @@ public:
 	void Init()
 	{
 		Add("default", CreateDefaultShader());
+		Add("instanced", CreateInstancedShader());
+		Add("impostor", CreateImpostorShader());
 	}
 
 	// Add a shader to the database
@@ -76,6 +229,16 @@ public:
 	// Execute the main loop. We never return from here
 	void MainLoop();
 
+	// Starts the simulation from a checkpoint instead of the initial scene
+	void ResumeFrom(const std::string& checkpointPath) { m_resumePath = checkpointPath; }
+
+	// Steps the simulation in deterministic mode, and if hashLogPath isn't empty writes the state hash of every step to it
+	void RunDeterministic(const std::string& hashLogPath)
+	{
+		m_deterministic = true;
+		m_hashLogPath = hashLogPath;
+	}
+
 private:
 
 	// Initialise window-specific code, e.g. OpenGL 
@@ -94,8 +257,15 @@ private:
 	// the physics engine object
 	PhysicsEngine m_physEngine;
 
+	// runs m_physEngine on its own thread
+	SimulationThread m_simulation;
+
 	// the two databases
 	MeshDb meshDb;
 	ShaderDb shaderDb;
+
+	std::string m_resumePath;
+	bool m_deterministic = false;
+	std::string m_hashLogPath;
 };
 
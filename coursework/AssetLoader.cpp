@@ -0,0 +1,88 @@
+#include "AssetLoader.h"
+
+#include <chrono>
+
+#include "Parallel.h"
+
+AssetLoader::~AssetLoader()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+void AssetLoader::Enqueue(Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(std::move(job));
+		m_pending++;
+
+		// Threads are started as jobs arrive, up to one per core
+		if (int(m_threads.size()) < WorkerCount())
+			m_threads.emplace_back(&AssetLoader::WorkerLoop, this);
+	}
+	m_wake.notify_one();
+}
+
+void AssetLoader::WorkerLoop()
+{
+	for (;;)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+			if (m_stopping)
+				return;
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+
+		Upload upload = job();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (upload)
+			m_uploads.push_back(std::move(upload));
+		else
+			m_pending--;
+	}
+}
+
+int AssetLoader::ProcessUploads(double budgetSeconds)
+{
+	auto start = std::chrono::steady_clock::now();
+	int count = 0;
+	for (;;)
+	{
+		Upload upload;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_uploads.empty())
+				break;
+			upload = std::move(m_uploads.front());
+			m_uploads.pop_front();
+		}
+
+		upload();
+		count++;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending--;
+		}
+
+		if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > budgetSeconds)
+			break;
+	}
+	return count;
+}
+
+bool AssetLoader::Busy() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending > 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Loads assets in the background. Jobs run on a pool of loader threads and return the part of the work that needs the
+// GL context (creating buffers and uploading to them). That part is queued and run on the GL thread by ProcessUploads,
+// so reading, parsing and cooking never hold up a frame, and independent assets load in parallel.
+class AssetLoader
+{
+public:
+	// Work for the GL thread, returned by a job. May be empty if there is nothing to upload
+	using Upload = std::function<void()>;
+	using Job = std::function<Upload()>;
+
+	// Waits for the jobs that are running; the ones not started yet are dropped
+	~AssetLoader();
+
+	// Queues a job for the loader threads
+	void Enqueue(Job job);
+
+	// Runs finished jobs' uploads on the calling thread, which must own the GL context. Stops once the time budget is
+	// spent, so a burst of finished loads is spread over a few frames. Returns the number of uploads run
+	int ProcessUploads(double budgetSeconds = 0.004);
+
+	// True until every queued job has run and its upload has been processed
+	bool Busy() const;
+
+private:
+	void WorkerLoop();
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::deque<Job> m_jobs;
+	std::deque<Upload> m_uploads;
+	int m_pending = 0;		// Jobs queued or running, and uploads not processed yet
+	bool m_stopping = false;
+	std::vector<std::thread> m_threads;
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Uniform grid over a box, used as a cell-linked list for neighbour searches.
+// Items are bucketed by cell with a counting sort, so the items of one cell end up contiguous in memory.
+class CellGrid
+{
+public:
+	void Init(const glm::vec3& minCorner, const glm::vec3& maxCorner, float cellSize)
+	{
+		m_min = minCorner;
+		m_cellSize = cellSize;
+		m_invCellSize = 1.0f / cellSize;
+		m_dims = glm::max(glm::ivec3(glm::ceil((maxCorner - minCorner) * m_invCellSize)), glm::ivec3(1));
+		m_cellStart.assign(NumCells() + 1, 0);
+	}
+
+	// Cell coordinates of a point, clamped to the grid
+	glm::ivec3 CellCoord(const glm::vec3& p) const
+	{
+		glm::ivec3 c = glm::ivec3(glm::floor((p - m_min) * m_invCellSize));
+		return glm::clamp(c, glm::ivec3(0), m_dims - 1);
+	}
+
+	int CellIndex(const glm::ivec3& c) const
+	{
+		return (c.z * m_dims.y + c.y) * m_dims.x + c.x;
+	}
+
+	// Buckets the items given the cell index of each one. On return, order lists the item indices sorted by cell
+	void Build(const std::vector<int>& cellOfItem, std::vector<int>& order)
+	{
+		std::fill(m_cellStart.begin(), m_cellStart.end(), 0);
+		for (int cell : cellOfItem)
+			m_cellStart[cell + 1]++;
+		for (int i = 0; i < NumCells(); i++)
+			m_cellStart[i + 1] += m_cellStart[i];
+
+		order.resize(cellOfItem.size());
+		m_fill.assign(m_cellStart.begin(), m_cellStart.end() - 1);
+		for (int i = 0; i < int(cellOfItem.size()); i++)
+			order[m_fill[cellOfItem[i]]++] = i;
+	}
+
+	// Range of sorted items [CellStart, CellEnd) that lie in a cell
+	int CellStart(int cell) const { return m_cellStart[cell]; }
+	int CellEnd(int cell) const { return m_cellStart[cell + 1]; }
+
+	int NumCells() const { return m_dims.x * m_dims.y * m_dims.z; }
+	const glm::ivec3& Dims() const { return m_dims; }
+	float CellSize() const { return m_cellSize; }
+
+private:
+	glm::vec3 m_min = glm::vec3(0.0f);
+	float m_cellSize = 1.0f;
+	float m_invCellSize = 1.0f;
+	glm::ivec3 m_dims = glm::ivec3(1);
+	std::vector<int> m_cellStart;
+	std::vector<int> m_fill;
+};
@@ -0,0 +1,102 @@
+#include "Checkpoint.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+namespace
+{
+	const char CHECKPOINT_MAGIC[4] = { 'P', 'B', 'C', 'P' };
+	// Bump when anything written to a checkpoint changes
+	const uint32_t CHECKPOINT_VERSION = 5;
+	// Arrays start on this boundary
+	const size_t CHECKPOINT_ALIGNMENT = 64;
+
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t size;		// Of the whole file, to catch truncated copies
+	};
+}
+
+CheckpointWriter::CheckpointWriter()
+{
+	// The header is filled in by Save, once the size is known
+	m_bytes.resize(sizeof(FileHeader));
+}
+
+size_t CheckpointWriter::Grow(size_t size)
+{
+	size_t offset = m_bytes.size();
+	// Doubling keeps the appends amortised constant time even for the largest arrays
+	if (offset + size > m_bytes.capacity())
+		m_bytes.reserve(std::max(offset + size, 2 * m_bytes.capacity()));
+	m_bytes.resize(offset + size);
+	return offset;
+}
+
+size_t CheckpointWriter::Padding() const
+{
+	return (CHECKPOINT_ALIGNMENT - m_bytes.size() % CHECKPOINT_ALIGNMENT) % CHECKPOINT_ALIGNMENT;
+}
+
+bool CheckpointWriter::Save(const std::string& path)
+{
+	FileHeader header;
+	std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.size = m_bytes.size();
+	std::memcpy(m_bytes.data(), &header, sizeof(header));
+
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.write(m_bytes.data(), std::streamsize(m_bytes.size())))
+			return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(tempPath, path, error);
+	return !error;
+}
+
+bool CheckpointReader::Open(const std::string& path)
+{
+	m_ok = false;
+	m_size = 0;
+	m_cursor = 0;
+	if (!m_file.Open(path) || m_file.Size() < sizeof(FileHeader))
+		return false;
+
+	FileHeader header;
+	std::memcpy(&header, m_file.Data(), sizeof(header));
+	if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0
+		|| header.version != CHECKPOINT_VERSION
+		|| header.size != m_file.Size())
+	{
+		m_file.Close();
+		return false;
+	}
+
+	m_size = m_file.Size();
+	m_cursor = sizeof(FileHeader);
+	m_ok = true;
+	return true;
+}
+
+const char* CheckpointReader::Take(size_t size)
+{
+	if (!m_ok || size > m_size - m_cursor)
+	{
+		m_ok = false;
+		return nullptr;
+	}
+	const char* data = m_file.Data() + m_cursor;
+	m_cursor += size;
+	return data;
+}
+
+size_t CheckpointReader::Padding() const
+{
+	return (CHECKPOINT_ALIGNMENT - m_cursor % CHECKPOINT_ALIGNMENT) % CHECKPOINT_ALIGNMENT;
+}
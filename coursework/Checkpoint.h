@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "MappedFile.h"
+
+// Checkpoint files hold the complete state of the simulation, so a long run can be resumed after a crash or
+// preemption and carry on exactly as if it had never stopped. The parts of the engine append their state to a
+// CheckpointWriter as plain values and whole arrays, and read it back from a CheckpointReader in the same order.
+// The writer lays the whole file out in memory and saves it in one write; the reader maps the file and hands out
+// pointers straight into the mapped pages, so restoring costs no more than copying the state into place.
+
+class CheckpointWriter
+{
+public:
+	CheckpointWriter();
+
+	template<typename T>
+	void Write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be written");
+		size_t offset = Grow(sizeof(T));
+		std::memcpy(m_bytes.data() + offset, &value, sizeof(T));
+	}
+
+	// Bools and enums go out as a uint8_t and a uint32_t, for ReadBool and ReadEnum to check
+	void WriteBool(bool value) { Write(uint8_t(value)); }
+
+	template<typename E>
+	void WriteEnum(E value)
+	{
+		static_assert(std::is_enum<E>::value, "Only enums can be written as enums");
+		Write(uint32_t(value));
+	}
+
+	// Appends room for count values, aligned so they can be used in place when mapped, and returns it to be filled
+	// (e.g. in parallel). The pointer is valid until the next write
+	template<typename T>
+	T* AppendArray(size_t count)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be written");
+		Write(uint64_t(count));
+		Grow(Padding());
+		size_t offset = Grow(count * sizeof(T));
+		return reinterpret_cast<T*>(m_bytes.data() + offset);
+	}
+
+	template<typename T>
+	void WriteVector(const std::vector<T>& values)
+	{
+		T* out = AppendArray<T>(values.size());
+		if (!values.empty())
+			std::memcpy(out, values.data(), values.size() * sizeof(T));
+	}
+
+	// Writes the header and everything appended so far to path, in one write to a temporary file that is then
+	// renamed, so a crash while saving leaves the previous checkpoint intact
+	bool Save(const std::string& path);
+
+private:
+	size_t Grow(size_t size);
+	size_t Padding() const;
+
+	std::vector<char> m_bytes;
+};
+
+class CheckpointReader
+{
+public:
+	// Maps the file and checks its header. False if it is missing, isn't a checkpoint, is another version, or is
+	// shorter than its header says
+	bool Open(const std::string& path);
+
+	template<typename T>
+	bool Read(T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only plain values can be read");
+		const char* data = Take(sizeof(T));
+		if (data)
+			std::memcpy(&value, data, sizeof(T));
+		return data != nullptr;
+	}
+
+	// A bool must be 0 or 1 and an enum at most last: a damaged file may hold anything, and copying such bytes into a
+	// bool is undefined. False, like a read past the end, otherwise
+	bool ReadBool(bool& value)
+	{
+		uint8_t stored = 0;
+		if (!Read(stored) || stored > 1)
+		{
+			m_ok = false;
+			return false;
+		}
+		value = stored != 0;
+		return true;
+	}
+
+	template<typename E>
+	bool ReadEnum(E& value, E last)
+	{
+		static_assert(std::is_enum<E>::value, "Only enums can be read as enums");
+		uint32_t stored = 0;
+		if (!Read(stored) || stored > uint32_t(last))
+		{
+			m_ok = false;
+			return false;
+		}
+		value = E(stored);
+		return true;
+	}
+
+	// Array written by AppendArray, read in place from the mapped file. nullptr if it runs past the end
+	template<typename T>
+	const T* ReadArray(size_t& count)
+	{
+		uint64_t stored = 0;
+		if (!Read(stored) || !Take(Padding()) || stored > (m_size - m_cursor) / sizeof(T))
+		{
+			m_ok = false;
+			return nullptr;
+		}
+		count = size_t(stored);
+		return reinterpret_cast<const T*>(Take(count * sizeof(T)));
+	}
+
+	template<typename T>
+	bool ReadVector(std::vector<T>& values)
+	{
+		size_t count = 0;
+		const T* data = ReadArray<T>(count);
+		if (!data)
+			return false;
+		values.assign(data, data + count);
+		return true;
+	}
+
+	// False once a read has run past the end, so a sequence of reads can be checked once at the end
+	bool Ok() const { return m_ok; }
+
+private:
+	const char* Take(size_t size);
+	size_t Padding() const;
+
+	MappedFile m_file;
+	size_t m_size = 0;
+	size_t m_cursor = 0;
+	bool m_ok = false;
+};
@@ -0,0 +1,149 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	// Shortest copy worth encoding: a sequence costs at least 3 bytes
+	const size_t MIN_MATCH = 4;
+	// Offsets are stored in 16 bits
+	const size_t MAX_OFFSET = 65535;
+	// The match finder remembers the last position of each of 2^HASH_BITS hashes of 4 bytes
+	const int HASH_BITS = 14;
+	// Matches stop this far from the end, so the last bytes are always literals
+	const size_t END_LITERALS = 5;
+
+	uint32_t Read32(const uint8_t* p)
+	{
+		uint32_t value;
+		std::memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	uint32_t Hash(uint32_t value)
+	{
+		return (value * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	// Lengths that don't fit in their 4 bits continue in bytes of 255, ended by a byte below 255
+	void WriteLength(std::vector<uint8_t>& out, size_t length)
+	{
+		while (length >= 255)
+		{
+			out.push_back(255);
+			length -= 255;
+		}
+		out.push_back(uint8_t(length));
+	}
+
+	// A token (literal count and match length, 4 bits each), the literals, then the match's offset. The last sequence of
+	// a block has no match, which the decoder knows from reaching the end of the input
+	void WriteSequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t numLiterals, size_t offset, size_t matchLength)
+	{
+		size_t matchCode = matchLength != 0 ? matchLength - MIN_MATCH : 0;
+		out.push_back(uint8_t((std::min<size_t>(numLiterals, 15) << 4) | std::min<size_t>(matchCode, 15)));
+		if (numLiterals >= 15)
+			WriteLength(out, numLiterals - 15);
+		out.insert(out.end(), literals, literals + numLiterals);
+
+		if (matchLength == 0)
+			return;
+		out.push_back(uint8_t(offset & 0xff));
+		out.push_back(uint8_t(offset >> 8));
+		if (matchCode >= 15)
+			WriteLength(out, matchCode - 15);
+	}
+
+	bool ReadLength(const uint8_t*& in, const uint8_t* end, size_t& length)
+	{
+		uint8_t byte;
+		do
+		{
+			if (in == end)
+				return false;
+			byte = *in++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+}
+
+void LzCompress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+	// Positions are stored plus one, so 0 means empty
+	std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+
+	size_t anchor = 0;
+	if (size > END_LITERALS + MIN_MATCH)
+	{
+		size_t limit = size - END_LITERALS;
+		size_t i = 0;
+		while (i + MIN_MATCH <= limit)
+		{
+			uint32_t value = Read32(data + i);
+			uint32_t& entry = table[Hash(value)];
+			size_t candidate = entry;
+			entry = uint32_t(i + 1);
+
+			if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET || Read32(data + candidate - 1) != value)
+			{
+				// Step faster through data that doesn't compress
+				i += 1 + ((i - anchor) >> 6);
+				continue;
+			}
+
+			size_t match = candidate - 1;
+			size_t length = MIN_MATCH;
+			while (i + length < limit && data[match + length] == data[i + length])
+				length++;
+
+			WriteSequence(out, data + anchor, i - anchor, i - match, length);
+			i += length;
+			anchor = i;
+		}
+	}
+	WriteSequence(out, data + anchor, size - anchor, 0, 0);
+}
+
+bool LzDecompress(const uint8_t* data, size_t size, uint8_t* out, size_t outSize)
+{
+	const uint8_t* in = data;
+	const uint8_t* end = data + size;
+	size_t written = 0;
+
+	while (in < end)
+	{
+		uint8_t token = *in++;
+
+		size_t numLiterals = token >> 4;
+		if (numLiterals == 15 && !ReadLength(in, end, numLiterals))
+			return false;
+		if (size_t(end - in) < numLiterals || outSize - written < numLiterals)
+			return false;
+		std::memcpy(out + written, in, numLiterals);
+		in += numLiterals;
+		written += numLiterals;
+
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return false;
+		size_t offset = size_t(in[0]) | (size_t(in[1]) << 8);
+		in += 2;
+		size_t length = token & 15;
+		if (length == 15 && !ReadLength(in, end, length))
+			return false;
+		length += MIN_MATCH;
+		if (offset == 0 || offset > written || outSize - written < length)
+			return false;
+
+		// Byte by byte: the copy may overlap its own output, which is how runs are encoded
+		const uint8_t* from = out + written - offset;
+		for (size_t k = 0; k < length; k++)
+			out[written + k] = from[k];
+		written += length;
+	}
+	return written == outSize;
+}
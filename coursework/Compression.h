@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Byte-oriented LZ77 compression in the style of LZ4: the input becomes a series of literal runs, each followed by a
+// copy of at least 4 earlier bytes from up to 64 KiB back. There is no entropy coding, so it is not the smallest
+// format, but both directions run at memory speed, and data with many repeated or zero bytes (e.g. deltas) shrinks a lot
+
+// Appends the compressed form of data to out
+void LzCompress(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+// Decompresses into out, which must hold exactly the original size. False if the input is damaged
+bool LzDecompress(const uint8_t* data, size_t size, uint8_t* out, size_t outSize);
@@ -0,0 +1,347 @@
+#include "Constraints.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#include "Checkpoint.h"
+#include "Parallel.h"
+#include "PhysicsObject.h"
+#include "StateHash.h"
+
+using namespace glm;
+
+const vec3 XPBD_GRAVITY = vec3(0.0f, -9.81f, 0.0f);
+
+// Constraints that could not get one of the 64 colours are projected on a single thread
+const int SERIAL_COLOUR = 64;
+
+int ConstraintSolver::AddNode(const vec3& position, float mass)
+{
+	m_position.push_back(position);
+	m_previous.push_back(position);
+	m_velocity.push_back(vec3(0.0f));
+	m_invMass.push_back(mass > 0.0f ? 1.0f / mass : 0.0f);
+	m_coloured = false;
+	return int(m_position.size()) - 1;
+}
+
+void ConstraintSolver::AddDistanceConstraint(int a, int b, float compliance)
+{
+	m_constraints.push_back({ a, b, distance(m_position[a], m_position[b]), compliance, 0.0f });
+	m_coloured = false;
+}
+
+void ConstraintSolver::AddBendingConstraint(int a, int b, int c, float compliance)
+{
+	// Node b is only there to document which joint is being stiffened: the constraint acts on its two neighbours
+	(void)b;
+	AddDistanceConstraint(a, c, compliance);
+}
+
+void ConstraintSolver::AddRope(const vec3& start, const vec3& end, int links, float mass, float compliance, float bendingCompliance, bool pinStart)
+{
+	if (links < 1)
+		return;
+
+	float nodeMass = mass / (links + 1);
+	int first = Count();
+	for (int i = 0; i <= links; i++)
+	{
+		float t = float(i) / links;
+		AddNode(mix(start, end, t), (pinStart && i == 0) ? 0.0f : nodeMass);
+	}
+
+	for (int i = 0; i < links; i++)
+		AddDistanceConstraint(first + i, first + i + 1, compliance);
+	for (int i = 0; i + 1 < links; i++)
+		AddBendingConstraint(first + i, first + i + 1, first + i + 2, bendingCompliance);
+
+	m_nodeRadius = std::min(m_nodeRadius, 0.5f * distance(start, end) / links);
+}
+
+// Greedy graph colouring: no two constraints of the same colour share a node, so a colour can be solved in parallel
+void ConstraintSolver::ColourConstraints()
+{
+	int numNodes = Count();
+	int numConstraints = int(m_constraints.size());
+
+	std::vector<uint64_t> usedColours(numNodes, 0);
+	std::vector<int> colour(numConstraints);
+	for (int i = 0; i < numConstraints; i++)
+	{
+		const auto& c = m_constraints[i];
+		uint64_t used = usedColours[c.a] | usedColours[c.b];
+		int free = SERIAL_COLOUR;
+		for (int k = 0; k < SERIAL_COLOUR; k++)
+		{
+			if ((used & (uint64_t(1) << k)) == 0)
+			{
+				free = k;
+				break;
+			}
+		}
+		colour[i] = free;
+		if (free < SERIAL_COLOUR)
+		{
+			usedColours[c.a] |= uint64_t(1) << free;
+			usedColours[c.b] |= uint64_t(1) << free;
+		}
+	}
+
+	// Counting sort of the constraints by colour
+	m_colourStart.assign(SERIAL_COLOUR + 2, 0);
+	for (int c : colour)
+		m_colourStart[c + 1]++;
+	for (int k = 0; k <= SERIAL_COLOUR; k++)
+		m_colourStart[k + 1] += m_colourStart[k];
+
+	std::vector<Constraint> sorted(numConstraints);
+	std::vector<int> fill(m_colourStart.begin(), m_colourStart.end() - 1);
+	for (int i = 0; i < numConstraints; i++)
+		sorted[fill[colour[i]]++] = m_constraints[i];
+	m_constraints.swap(sorted);
+
+	// Constraint slots of each node, used to gather the Jacobi corrections
+	m_nodeOffsets.assign(numNodes + 1, 0);
+	for (const auto& c : m_constraints)
+	{
+		m_nodeOffsets[c.a + 1]++;
+		m_nodeOffsets[c.b + 1]++;
+	}
+	for (int i = 0; i < numNodes; i++)
+		m_nodeOffsets[i + 1] += m_nodeOffsets[i];
+
+	m_nodeConstraints.resize(numConstraints * 2);
+	std::vector<int> nodeFill(m_nodeOffsets.begin(), m_nodeOffsets.end() - 1);
+	for (int i = 0; i < numConstraints; i++)
+	{
+		m_nodeConstraints[nodeFill[m_constraints[i].a]++] = i * 2;
+		m_nodeConstraints[nodeFill[m_constraints[i].b]++] = i * 2 + 1;
+	}
+
+	m_coloured = true;
+}
+
+float ConstraintSolver::ConstraintDelta(const Constraint& c, float dt, vec3& direction) const
+{
+	vec3 delta = m_position[c.a] - m_position[c.b];
+	float len = length(delta);
+	float w = m_invMass[c.a] + m_invMass[c.b];
+	if (len < 1e-6f || w == 0.0f)
+		return 0.0f;
+
+	direction = delta / len;
+	float alpha = c.compliance / (dt * dt);
+	return (-(len - c.restLength) - alpha * c.lambda) / (w + alpha);
+}
+
+void ConstraintSolver::SolveGaussSeidel(float dt)
+{
+	auto project = [&](int i)
+	{
+		auto& c = m_constraints[i];
+		vec3 direction;
+		float dLambda = ConstraintDelta(c, dt, direction);
+		c.lambda += dLambda;
+		m_position[c.a] += m_invMass[c.a] * dLambda * direction;
+		m_position[c.b] -= m_invMass[c.b] * dLambda * direction;
+	};
+
+	for (int k = 0; k < SERIAL_COLOUR; k++)
+	{
+		int begin = m_colourStart[k];
+		ParallelFor(m_colourStart[k + 1] - begin, [&](int i) { project(begin + i); }, 1024);
+	}
+	for (int i = m_colourStart[SERIAL_COLOUR]; i < m_colourStart[SERIAL_COLOUR + 1]; i++)
+		project(i);
+}
+
+void ConstraintSolver::SolveJacobi(float dt)
+{
+	int numConstraints = int(m_constraints.size());
+	m_corrections.resize(numConstraints * 2);
+
+	ParallelFor(numConstraints, [&](int i)
+		{
+			auto& c = m_constraints[i];
+			vec3 direction(0.0f);
+			float dLambda = ConstraintDelta(c, dt, direction);
+			c.lambda += dLambda;
+			m_corrections[i * 2] = m_invMass[c.a] * dLambda * direction;
+			m_corrections[i * 2 + 1] = -m_invMass[c.b] * dLambda * direction;
+		}, 1024);
+
+	// Average the corrections of each node's constraints
+	ParallelFor(Count(), [&](int n)
+		{
+			int begin = m_nodeOffsets[n], end = m_nodeOffsets[n + 1];
+			if (begin == end)
+				return;
+			vec3 sum(0.0f);
+			for (int k = begin; k < end; k++)
+				sum += m_corrections[m_nodeConstraints[k]];
+			m_position[n] += m_jacobiRelaxation * sum / float(end - begin);
+		}, 1024);
+}
+
+// Collects the node/sphere pairs that may touch during the step, using a grid over the nodes
+void ConstraintSolver::FindSphereContacts(const std::vector<Particle>& spheres, float deltaTime)
+{
+	m_contacts.clear();
+
+	if (m_grid.NumCells() <= 1)
+		m_grid.Init(m_boxCentre - vec3(m_boxHalfExtent), m_boxCentre + vec3(m_boxHalfExtent), 1.0f);
+
+	m_nodeCell.resize(Count());
+	ParallelFor(Count(), [&](int i) { m_nodeCell[i] = m_grid.CellIndex(m_grid.CellCoord(m_position[i])); });
+	m_grid.Build(m_nodeCell, m_nodeOrder);
+
+	for (int s = 0; s < int(spheres.size()); s++)
+	{
+		const auto& sphere = spheres[s];
+		// Margin covers how far a sphere can travel in one step
+		float reach = sphere.Scale().x + m_nodeRadius + length(sphere.Velocity()) * deltaTime;
+		float reach2 = reach * reach;
+		ivec3 lo = m_grid.CellCoord(sphere.Position() - vec3(reach));
+		ivec3 hi = m_grid.CellCoord(sphere.Position() + vec3(reach));
+		for (int z = lo.z; z <= hi.z; z++)
+			for (int y = lo.y; y <= hi.y; y++)
+			{
+				int end = m_grid.CellEnd(m_grid.CellIndex(ivec3(hi.x, y, z)));
+				for (int k = m_grid.CellStart(m_grid.CellIndex(ivec3(lo.x, y, z))); k < end; k++)
+				{
+					int node = m_nodeOrder[k];
+					vec3 d = m_position[node] - sphere.Position();
+					if (dot(d, d) <= reach2)
+						m_contacts.push_back({ node, s });
+				}
+			}
+	}
+}
+
+// Contacts are few and may share a sphere, so they are projected on one thread
+void ConstraintSolver::SolveContacts(const std::vector<Particle>& spheres)
+{
+	for (const auto& contact : m_contacts)
+	{
+		const auto& sphere = spheres[contact.sphere];
+		vec3 spherePos = sphere.Position() + m_sphereOffset[contact.sphere];
+		vec3 delta = m_position[contact.node] - spherePos;
+		float dist = length(delta);
+		float C = dist - (sphere.Scale().x + m_nodeRadius);
+		if (C >= 0.0f || dist < 1e-6f)
+			continue;
+
+		vec3 normal = delta / dist;
+		float wNode = m_invMass[contact.node];
+		float wSphere = 1.0f / sphere.Mass();
+		float dLambda = -C / (wNode + wSphere);
+		m_position[contact.node] += wNode * dLambda * normal;
+		m_sphereOffset[contact.sphere] -= wSphere * dLambda * normal;
+	}
+}
+
+void ConstraintSolver::ClampToBox()
+{
+	vec3 lo = m_boxCentre - vec3(m_boxHalfExtent - m_nodeRadius);
+	vec3 hi = m_boxCentre + vec3(m_boxHalfExtent - m_nodeRadius);
+	ParallelFor(Count(), [&](int i) { m_position[i] = clamp(m_position[i], lo, hi); }, 1024);
+}
+
+void ConstraintSolver::Step(float deltaTime, std::vector<Particle>& spheres)
+{
+	if (Count() == 0)
+		return;
+
+	if (!m_coloured)
+		ColourConstraints();
+
+	FindSphereContacts(spheres, deltaTime);
+	m_sphereOffset.assign(spheres.size(), vec3(0.0f));
+
+	int substeps = std::max(1, m_substeps);
+	float dt = deltaTime / substeps;
+	for (int step = 0; step < substeps; step++)
+	{
+		// Predict positions
+		ParallelFor(Count(), [&](int i)
+			{
+				m_previous[i] = m_position[i];
+				if (m_invMass[i] == 0.0f)
+					return;
+				m_velocity[i] += XPBD_GRAVITY * dt;
+				m_position[i] += m_velocity[i] * dt;
+			}, 1024);
+
+		// One iteration per substep, so the multipliers start from zero every substep
+		for (auto& c : m_constraints)
+			c.lambda = 0.0f;
+
+		if (m_method == Method::GaussSeidel)
+			SolveGaussSeidel(dt);
+		else
+			SolveJacobi(dt);
+
+		SolveContacts(spheres);
+		ClampToBox();
+
+		// Derive velocities from the corrected positions
+		ParallelFor(Count(), [&](int i) { m_velocity[i] = (m_position[i] - m_previous[i]) / dt; }, 1024);
+	}
+
+	// The spheres were pushed by the nodes: move them and give them the matching velocity
+	for (int s = 0; s < int(spheres.size()); s++)
+	{
+		const vec3& offset = m_sphereOffset[s];
+		if (offset == vec3(0.0f))
+			continue;
+		spheres[s].SetPosition(spheres[s].Position() + offset);
+		spheres[s].SetVelocity(spheres[s].Velocity() + offset / deltaTime);
+	}
+}
+
+void ConstraintSolver::SaveState(CheckpointWriter& out) const
+{
+	out.WriteEnum(m_method);
+	out.Write(m_substeps);
+	out.Write(m_jacobiRelaxation);
+	out.Write(m_nodeRadius);
+	out.Write(m_boxCentre);
+	out.Write(m_boxHalfExtent);
+
+	out.WriteVector(m_position);
+	out.WriteVector(m_previous);
+	out.WriteVector(m_velocity);
+	out.WriteVector(m_invMass);
+
+	out.WriteBool(m_coloured);
+	out.WriteVector(m_constraints);
+	out.WriteVector(m_colourStart);
+	out.WriteVector(m_nodeOffsets);
+	out.WriteVector(m_nodeConstraints);
+}
+
+bool ConstraintSolver::LoadState(CheckpointReader& in)
+{
+	return in.ReadEnum(m_method, Method::Jacobi)
+		&& in.Read(m_substeps)
+		&& in.Read(m_jacobiRelaxation)
+		&& in.Read(m_nodeRadius)
+		&& in.Read(m_boxCentre)
+		&& in.Read(m_boxHalfExtent)
+		&& in.ReadVector(m_position)
+		&& in.ReadVector(m_previous)
+		&& in.ReadVector(m_velocity)
+		&& in.ReadVector(m_invMass)
+		&& in.ReadBool(m_coloured)
+		&& in.ReadVector(m_constraints)
+		&& in.ReadVector(m_colourStart)
+		&& in.ReadVector(m_nodeOffsets)
+		&& in.ReadVector(m_nodeConstraints);
+}
+
+void ConstraintSolver::HashState(StateHash& hash) const
+{
+	hash.Add(m_position);
+	hash.Add(m_velocity);
+}
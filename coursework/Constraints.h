@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "CellGrid.h"
+
+class Particle;
+class CheckpointWriter;
+class CheckpointReader;
+class StateHash;
+
+// Extended position-based dynamics (XPBD) solver for ropes and chains.
+// Nodes are point masses joined by compliant distance constraints; bending is resisted by a second distance constraint
+// that skips one node. Nodes also collide with the engine's spheres through contact constraints.
+// Constraints are graph coloured once, so all constraints of one colour can be projected in parallel (Gauss-Seidel);
+// the Jacobi method instead averages the corrections of every constraint and is kept as a fallback.
+class ConstraintSolver
+{
+public:
+	enum class Method
+	{
+		GaussSeidel,	// Parallel within a colour, sequential across colours
+		Jacobi			// Fully parallel, converges slower
+	};
+
+	// Adds a node and returns its index. A mass of 0 pins the node in place
+	int AddNode(const glm::vec3& position, float mass);
+
+	// Keeps two nodes at their current distance. Compliance is the inverse stiffness (0 = rigid)
+	void AddDistanceConstraint(int a, int b, float compliance);
+
+	// Resists bending at node b by keeping a and c at their current distance
+	void AddBendingConstraint(int a, int b, int c, float compliance);
+
+	// Creates a rope of the given number of links from start to end, optionally pinned at the start
+	void AddRope(const glm::vec3& start, const glm::vec3& end, int links, float mass, float compliance, float bendingCompliance, bool pinStart);
+
+	// Advances the nodes by deltaTime using the given number of substeps, and exchanges contacts with the spheres
+	void Step(float deltaTime, std::vector<Particle>& spheres);
+
+	void SetMethod(Method method) { m_method = method; }
+	Method GetMethod() const { return m_method; }
+	void SetSubsteps(int substeps) { m_substeps = substeps; }
+	void SetBox(const glm::vec3& centre, float halfExtent) { m_boxCentre = centre; m_boxHalfExtent = halfExtent; }
+
+	int Count() const { return int(m_position.size()); }
+	const glm::vec3& Position(int i) const { return m_position[i]; }
+	float NodeRadius() const { return m_nodeRadius; }
+
+	// Settings, nodes and constraints, for checkpoints. The constraints are kept in their coloured order, since
+	// colouring them again could order them differently and change the results
+	void SaveState(CheckpointWriter& out) const;
+	bool LoadState(CheckpointReader& in);
+	// Adds the nodes' positions and velocities to a hash of the simulation state
+	void HashState(StateHash& hash) const;
+
+private:
+	struct Constraint
+	{
+		int a, b;
+		float restLength;
+		float compliance;
+		float lambda;
+	};
+
+	struct Contact
+	{
+		int node;
+		int sphere;
+	};
+
+	void ColourConstraints();
+	void FindSphereContacts(const std::vector<Particle>& spheres, float deltaTime);
+	void SolveGaussSeidel(float dt);
+	void SolveJacobi(float dt);
+	void SolveContacts(const std::vector<Particle>& spheres);
+	void ClampToBox();
+
+	// Position correction of one constraint, returned as the lambda increment along the constraint direction
+	float ConstraintDelta(const Constraint& c, float dt, glm::vec3& direction) const;
+
+	Method m_method = Method::GaussSeidel;
+	int m_substeps = 20;
+	float m_jacobiRelaxation = 1.5f;
+	float m_nodeRadius = 0.25f;
+	glm::vec3 m_boxCentre = glm::vec3(0.0f);
+	float m_boxHalfExtent = 30.0f;
+
+	// Node state
+	std::vector<glm::vec3> m_position;
+	std::vector<glm::vec3> m_previous;
+	std::vector<glm::vec3> m_velocity;
+	std::vector<float> m_invMass;
+
+	// Constraints, sorted by colour once coloured
+	std::vector<Constraint> m_constraints;
+	std::vector<int> m_colourStart;
+	bool m_coloured = true;
+
+	// Jacobi scratch: per-constraint corrections and per-node constraint lists
+	std::vector<glm::vec3> m_corrections;
+	std::vector<int> m_nodeOffsets;
+	std::vector<int> m_nodeConstraints;
+
+	// Contacts against the spheres, found once per step
+	CellGrid m_grid;
+	std::vector<int> m_nodeCell;
+	std::vector<int> m_nodeOrder;
+	std::vector<Contact> m_contacts;
+	std::vector<glm::vec3> m_sphereOffset;
+};
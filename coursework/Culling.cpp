@@ -0,0 +1,106 @@
+#include "Culling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.h"
+
+using namespace glm;
+
+void FrustumCuller::SetViewProjection(const mat4& viewProjection)
+{
+	// glm is column-major: row i of the matrix is (m[0][i], m[1][i], m[2][i], m[3][i])
+	const mat4& m = viewProjection;
+	vec4 rows[4];
+	for (int i = 0; i < 4; i++)
+		rows[i] = vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+
+	// Left, right, bottom, top, near, far. A point is inside when dot(plane, (p, 1)) >= 0 for all six
+	for (int axis = 0; axis < 3; axis++)
+	{
+		m_planes[2 * axis] = rows[3] + rows[axis];
+		m_planes[2 * axis + 1] = rows[3] - rows[axis];
+	}
+	for (auto& plane : m_planes)
+		plane /= length(vec3(plane));
+}
+
+uint8_t FrustumCuller::CullBlock(const SphereInstance* spheres, const SphereInstance* previous, int first, int count, int previousCount) const
+{
+	// Structure of arrays for the block. Lanes past the end are set up to fail every plane
+	float x[BLOCK_SIZE], y[BLOCK_SIZE], z[BLOCK_SIZE], r[BLOCK_SIZE];
+	for (int k = 0; k < BLOCK_SIZE; k++)
+	{
+		int i = first + k;
+		if (i < count)
+		{
+			const vec4& s = spheres[i].positionRadius;
+			x[k] = s.x; y[k] = s.y; z[k] = s.z; r[k] = s.w;
+			if (i < previousCount)
+			{
+				vec3 moved = vec3(s) - vec3(previous[i].positionRadius);
+				r[k] += std::sqrt(dot(moved, moved));
+			}
+		}
+		else
+		{
+			x[k] = y[k] = z[k] = 0.0f;
+			r[k] = -INFINITY;
+		}
+	}
+
+	// Branch-free over the lanes: a sphere is outside if it is entirely behind any plane
+	float inside[BLOCK_SIZE];
+	for (int k = 0; k < BLOCK_SIZE; k++)
+		inside[k] = 1.0f;
+	for (const auto& plane : m_planes)
+		for (int k = 0; k < BLOCK_SIZE; k++)
+		{
+			float distance = plane.x * x[k] + plane.y * y[k] + plane.z * z[k] + plane.w;
+			inside[k] = distance >= -r[k] ? inside[k] : 0.0f;
+		}
+
+	uint8_t mask = 0;
+	for (int k = 0; k < BLOCK_SIZE; k++)
+		mask |= uint8_t(inside[k] != 0.0f) << k;
+	return mask;
+}
+
+int FrustumCuller::Cull(const std::vector<SphereInstance>& spheres, const std::vector<SphereInstance>* previous, std::vector<int>& visible)
+{
+	int count = int(spheres.size());
+	int numBlocks = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const SphereInstance* prev = previous != nullptr ? previous->data() : nullptr;
+	int previousCount = previous != nullptr ? int(previous->size()) : 0;
+
+	// Visibility of every block
+	m_masks.resize(numBlocks);
+	ParallelFor(numBlocks, [&](int b)
+		{
+			m_masks[b] = CullBlock(spheres.data(), prev, b * BLOCK_SIZE, count, previousCount);
+		}, 256);
+
+	// Where each block's visible spheres start in the compacted list. One add per block, so serial is fine
+	m_offsets.resize(numBlocks + 1);
+	m_offsets[0] = 0;
+	for (int b = 0; b < numBlocks; b++)
+	{
+		uint8_t mask = m_masks[b];
+		int bits = 0;
+		for (; mask != 0; mask &= mask - 1)
+			bits++;
+		m_offsets[b + 1] = m_offsets[b] + bits;
+	}
+
+	int numVisible = m_offsets[numBlocks];
+	visible.resize(numVisible);
+	ParallelFor(numBlocks, [&](int b)
+		{
+			int out = m_offsets[b];
+			for (int k = 0; k < BLOCK_SIZE; k++)
+				if (m_masks[b] & (1 << k))
+					visible[out++] = b * BLOCK_SIZE + k;
+		}, 256);
+
+	return numVisible;
+}
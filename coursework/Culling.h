@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "InstancedRenderer.h"
+
+// CPU view frustum culling of sphere instances.
+// The six planes come from the projection * view matrix. Spheres are tested in blocks of 8: each block is first
+// gathered into one small array per component, so the plane tests run as fixed-length loops the compiler turns into
+// 8-wide SIMD, and produce an 8-bit visibility mask. The masks are then compacted into a list of visible indices
+// with a prefix sum, all passes running in parallel for large counts.
+class FrustumCuller
+{
+public:
+	static const int BLOCK_SIZE = 8;
+
+	// Extracts the planes of the frustum (Gribb & Hartmann), normalised so plane distances are in world units
+	void SetViewProjection(const glm::mat4& viewProjection);
+
+	// Fills visible with the indices of the spheres that intersect the frustum, in increasing order, and returns
+	// their count. If previous is given, each sphere's radius is grown by the distance it moved since then, so any
+	// blend between the two states is covered too
+	int Cull(const std::vector<SphereInstance>& spheres, const std::vector<SphereInstance>* previous, std::vector<int>& visible);
+
+private:
+	// Visibility mask of the spheres [first, first + 8), bit k set if sphere first + k is visible
+	uint8_t CullBlock(const SphereInstance* spheres, const SphereInstance* previous, int first, int count, int previousCount) const;
+
+	glm::vec4 m_planes[6];
+
+	std::vector<uint8_t> m_masks;
+	std::vector<int> m_offsets;
+};
@@ -0,0 +1,195 @@
+#include "Emitter.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Checkpoint.h"
+#include "Parallel.h"
+#include "Random.h"
+#include "StateHash.h"
+
+using namespace glm;
+
+namespace
+{
+	// Point uniformly inside the unit ball from three uniform numbers: a uniform direction, and a radius whose cube is
+	// uniform since the volume grows with r^3. No rejection, so every sphere uses the same draws
+	vec3 InUnitBall(const vec3& u)
+	{
+		float z = 2.0f * u.x - 1.0f;
+		float ring = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		float angle = 6.28318531f * u.y;
+		return std::cbrt(u.z) * vec3(ring * std::cos(angle), ring * std::sin(angle), z);
+	}
+}
+
+void EmitterSystem::Add(const EmitterSettings& settings)
+{
+	Emitter emitter;
+	emitter.settings = settings;
+	emitter.settings.normal = normalize(settings.normal);
+	m_emitters.push_back(std::move(emitter));
+}
+
+void EmitterSystem::Stop()
+{
+	for (auto& emitter : m_emitters)
+		emitter.stopped = true;
+}
+
+int EmitterSystem::Emitting() const
+{
+	return int(std::count_if(m_emitters.begin(), m_emitters.end(), [](const Emitter& e) { return !e.stopped; }));
+}
+
+void EmitterSystem::Expire(Emitter& emitter, ParticlePool& pool)
+{
+	while (emitter.liveBegin < emitter.live.size() && emitter.live[emitter.liveBegin].expiry <= m_time)
+	{
+		// Fails harmlessly if the sphere was already removed some other way
+		pool.Remove(emitter.live[emitter.liveBegin].handle);
+		emitter.liveBegin++;
+	}
+
+	// The expired entries are dropped once they are half the queue, which keeps the removal amortised O(1)
+	// without reallocating
+	if (emitter.liveBegin > emitter.live.size() / 2)
+	{
+		emitter.live.erase(emitter.live.begin(), emitter.live.begin() + emitter.liveBegin);
+		emitter.liveBegin = 0;
+	}
+}
+
+vec3 EmitterSystem::SamplePosition(const EmitterSettings& settings, const vec4& u) const
+{
+	switch (settings.shape)
+	{
+	case EmitterShape::Box:
+		return settings.position + (vec3(u) * 2.0f - 1.0f) * settings.halfExtents;
+	case EmitterShape::Disc:
+	{
+		// Orthonormal basis of the disc's plane
+		const vec3& n = settings.normal;
+		vec3 a = normalize(std::abs(n.x) < 0.9f ? cross(n, vec3(1.0f, 0.0f, 0.0f)) : cross(n, vec3(0.0f, 1.0f, 0.0f)));
+		vec3 b = cross(n, a);
+		// The square root spreads the points evenly over the area instead of bunching them in the middle
+		float r = settings.discRadius * std::sqrt(u.x);
+		float angle = 6.28318531f * u.y;
+		return settings.position + r * (std::cos(angle) * a + std::sin(angle) * b);
+	}
+	default:
+		return settings.position;
+	}
+}
+
+vec3 EmitterSystem::SampleVelocity(const EmitterSettings& settings, const vec4& u) const
+{
+	return settings.velocity + settings.velocitySpread * InUnitBall(vec3(u));
+}
+
+int EmitterSystem::Step(float deltaTime, uint64_t step, ParticlePool& pool, const Philox& random, const Particle& prototype)
+{
+	m_time += deltaTime;
+	m_spawned.clear();
+
+	for (auto& emitter : m_emitters)
+	{
+		Expire(emitter, pool);
+		if (emitter.stopped)
+			continue;
+
+		const EmitterSettings& settings = emitter.settings;
+		emitter.pending += double(settings.rate) * deltaTime;
+		int count = int(emitter.pending);
+		if (count <= 0)
+			continue;
+		emitter.pending -= count;
+
+		// One batch for the whole step: the pool makes room once and the spheres are filled in place
+		size_t first = m_spawned.size();
+		m_spawned.resize(first + count);
+		Particle* spheres = pool.AddBatch(count, prototype, &m_spawned[first]);
+
+		m_ids.resize(count);
+		for (int i = 0; i < count; i++)
+			m_ids[i] = spheres[i].Id();
+		m_positionBits.resize(count);
+		m_velocityBits.resize(count);
+		random.Generate(m_ids.data(), count, step, RandomPurpose::SpawnPosition, 0, m_positionBits.data());
+		random.Generate(m_ids.data(), count, step, RandomPurpose::SpawnVelocity, 0, m_velocityBits.data());
+
+		ParallelFor(count, [&](int i)
+			{
+				Particle& p = spheres[i];
+				p.SetScale(vec3(settings.radius));
+				p.SetMass(settings.mass);
+				p.SetColor(settings.color);
+				// Spread over the step as if emitted continuously, so a stream comes out instead of one burst per step
+				float age = deltaTime * (float(i) + 0.5f) / float(count);
+				vec3 velocity = SampleVelocity(settings, Philox::ToUniform(m_velocityBits[i]));
+				p.SetPosition(SamplePosition(settings, Philox::ToUniform(m_positionBits[i])) + velocity * age);
+				p.SetVelocity(velocity);
+			}, 1024);
+
+		if (settings.lifetime > 0.0f)
+		{
+			double expiry = m_time + settings.lifetime;
+			for (int i = 0; i < count; i++)
+				emitter.live.push_back({ m_spawned[first + i], expiry });
+		}
+	}
+
+	m_emitters.erase(std::remove_if(m_emitters.begin(), m_emitters.end(),
+		[](const Emitter& e) { return e.stopped && e.liveBegin == e.live.size(); }), m_emitters.end());
+	return int(m_spawned.size());
+}
+
+void EmitterSystem::SaveState(CheckpointWriter& out) const
+{
+	out.Write(m_time);
+	out.Write(uint64_t(m_emitters.size()));
+	for (const auto& emitter : m_emitters)
+	{
+		out.Write(emitter.settings);
+		out.Write(emitter.pending);
+		out.WriteBool(emitter.stopped);
+		Live* live = out.AppendArray<Live>(emitter.live.size() - emitter.liveBegin);
+		std::copy(emitter.live.begin() + emitter.liveBegin, emitter.live.end(), live);
+	}
+}
+
+bool EmitterSystem::LoadState(CheckpointReader& in)
+{
+	uint64_t count = 0;
+	if (!in.Read(m_time) || !in.Read(count))
+		return false;
+
+	m_emitters.clear();
+	for (uint64_t e = 0; e < count; e++)
+	{
+		Emitter emitter;
+		if (!in.Read(emitter.settings) || !in.Read(emitter.pending) || !in.ReadBool(emitter.stopped) || !in.ReadVector(emitter.live)
+			|| uint32_t(emitter.settings.shape) > uint32_t(EmitterShape::Disc))
+			return false;
+		m_emitters.push_back(std::move(emitter));
+	}
+	return true;
+}
+
+void EmitterSystem::HashState(StateHash& hash) const
+{
+	hash.Add(m_time);
+	hash.Add(uint64_t(m_emitters.size()));
+	for (const auto& emitter : m_emitters)
+	{
+		hash.Add(emitter.pending);
+		hash.Add(uint64_t(emitter.stopped));
+		hash.Add(uint64_t(emitter.live.size() - emitter.liveBegin));
+		for (size_t i = emitter.liveBegin; i < emitter.live.size(); i++)
+		{
+			const Live& live = emitter.live[i];
+			hash.Add(uint64_t(live.handle.slot) << 32 | live.handle.generation);
+			hash.Add(live.expiry);
+		}
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "ParticlePool.h"
+
+class Philox;
+class CheckpointWriter;
+class CheckpointReader;
+class StateHash;
+
+// Where an emitter places its spheres
+enum class EmitterShape
+{
+	Point,	// All at the position
+	Box,	// Uniformly inside the box position +- halfExtents
+	Disc	// Uniformly on the disc of discRadius around position, facing normal
+};
+
+// Parameters of one emitter. Velocities are the mean velocity plus a uniformly random vector of length up to
+// velocitySpread, so a spread of zero gives a jet and a large spread a spray
+struct EmitterSettings
+{
+	EmitterShape shape = EmitterShape::Point;
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::vec3 halfExtents = glm::vec3(1.0f);		// Box only
+	glm::vec3 normal = glm::vec3(0.0f, 1.0f, 0.0f);	// Disc only
+	float discRadius = 1.0f;						// Disc only
+	float rate = 1000.0f;							// Spheres per second
+	glm::vec3 velocity = glm::vec3(0.0f);			// Mean velocity, in m/s
+	float velocitySpread = 0.0f;					// In m/s
+	float lifetime = 5.0f;							// In s; the spheres live forever if zero or less
+	float radius = 0.5f;
+	float mass = 0.5f;
+	glm::vec4 color = glm::vec4(1.0f);
+};
+
+// Sources and sinks of short-lived spheres. Every step the spheres whose lifetime is over are removed, then each
+// emitter adds the spheres due in that step as one batch in the pool: one reserve, then the new spheres are filled in
+// place. All of an emitter's spheres live equally long, so they die in the order they were born, and each emitter only
+// has to look at the front of its queue.
+class EmitterSystem
+{
+public:
+	void Add(const EmitterSettings& settings);
+	// Stops all emitters. Their spheres still expire, and each emitter is dropped once its last sphere has
+	void Stop();
+	// Number of emitters still emitting
+	int Emitting() const;
+	// True once every emitter has been stopped and all their spheres have expired
+	bool Idle() const { return m_emitters.empty(); }
+
+	// Removes the expired spheres and emits this step's. prototype gives the mesh, shader and restitution of the new
+	// spheres. Their random positions and velocities are drawn from random for their ids and step, so they are filled
+	// in parallel and come out the same on any number of threads. Returns the number of spheres added, whose handles
+	// are in Spawned()
+	int Step(float deltaTime, uint64_t step, ParticlePool& pool, const Philox& random, const Particle& prototype);
+	const std::vector<ParticleHandle>& Spawned() const { return m_spawned; }
+
+	// Emitters, emission clocks and the spheres waiting to expire, for checkpoints
+	void SaveState(CheckpointWriter& out) const;
+	bool LoadState(CheckpointReader& in);
+	void HashState(StateHash& hash) const;
+
+private:
+	struct Live
+	{
+		ParticleHandle handle;
+		double expiry;
+	};
+
+	struct Emitter
+	{
+		EmitterSettings settings;
+		double pending = 0.0;		// Fraction of a sphere carried over to the next step
+		std::vector<Live> live;		// In order of expiry, from liveBegin on
+		size_t liveBegin = 0;
+		bool stopped = false;
+	};
+
+	void Expire(Emitter& emitter, ParticlePool& pool);
+	glm::vec3 SamplePosition(const EmitterSettings& settings, const glm::vec4& u) const;
+	glm::vec3 SampleVelocity(const EmitterSettings& settings, const glm::vec4& u) const;
+
+	std::vector<Emitter> m_emitters;
+	std::vector<ParticleHandle> m_spawned;
+	// Ids and random bits of one batch
+	std::vector<uint32_t> m_ids;
+	std::vector<glm::uvec4> m_positionBits;
+	std::vector<glm::uvec4> m_velocityBits;
+	double m_time = 0.0;
+};
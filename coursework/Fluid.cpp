@@ -0,0 +1,293 @@
+#include "Fluid.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+#include "Checkpoint.h"
+#include "Parallel.h"
+#include "PhysicsObject.h"
+#include "StateHash.h"
+
+using namespace glm;
+
+const float FLUID_GRAVITY = -9.81f;
+const float TAIT_EXPONENT = 7.0f;
+
+void FluidSolver::Init(const vec3& boxCentre, float boxHalfExtent, const FluidSettings& settings)
+{
+	m_settings = settings;
+	m_boxCentre = boxCentre;
+	m_boxHalfExtent = boxHalfExtent;
+
+	// Smoothing length of two particle spacings gives roughly 30 neighbours per particle
+	m_h = 2.0f * settings.particleSpacing;
+	m_mass = settings.restDensity * settings.particleSpacing * settings.particleSpacing * settings.particleSpacing;
+	m_pressureStiffness = settings.restDensity * settings.speedOfSound * settings.speedOfSound / TAIT_EXPONENT;
+
+	// Kernel normalisation constants (Muller et al. 2003)
+	float h3 = m_h * m_h * m_h;
+	float h6 = h3 * h3;
+	m_poly6 = 315.0f / (64.0f * pi<float>() * h6 * h3);
+	m_spikyGrad = 45.0f / (pi<float>() * h6);
+	m_viscLaplacian = 45.0f / (pi<float>() * h6);
+
+	m_grid.Init(boxCentre - vec3(boxHalfExtent), boxCentre + vec3(boxHalfExtent), m_h);
+}
+
+void FluidSolver::AddBlock(const vec3& minCorner, const vec3& maxCorner, const vec3& velocity)
+{
+	float s = m_settings.particleSpacing;
+	for (float z = minCorner.z; z <= maxCorner.z; z += s)
+		for (float y = minCorner.y; y <= maxCorner.y; y += s)
+			for (float x = minCorner.x; x <= maxCorner.x; x += s)
+			{
+				m_id.push_back(int(m_id.size()));
+				m_posX.push_back(x); m_posY.push_back(y); m_posZ.push_back(z);
+				m_velX.push_back(velocity.x); m_velY.push_back(velocity.y); m_velZ.push_back(velocity.z);
+			}
+
+	size_t n = m_posX.size();
+	m_accX.resize(n); m_accY.resize(n); m_accZ.resize(n);
+	m_density.resize(n); m_pressure.resize(n);
+}
+
+// Reorders every particle array by grid cell, so neighbours are close in memory and each cell is a contiguous range
+void FluidSolver::SortByCell()
+{
+	int n = Count();
+	m_cellOfParticle.resize(n);
+	ParallelFor(n, [&](int i)
+		{
+			m_cellOfParticle[i] = m_grid.CellIndex(m_grid.CellCoord(vec3(m_posX[i], m_posY[i], m_posZ[i])));
+		});
+
+	m_grid.Build(m_cellOfParticle, m_order);
+
+	m_scratch.resize(n);
+	for (auto* arr : { &m_posX, &m_posY, &m_posZ, &m_velX, &m_velY, &m_velZ })
+	{
+		auto& values = *arr;
+		ParallelFor(n, [&](int i) { m_scratch[i] = values[m_order[i]]; }, 4096);
+		values.swap(m_scratch);
+	}
+
+	m_idScratch.resize(n);
+	ParallelFor(n, [&](int i) { m_idScratch[i] = m_id[m_order[i]]; }, 4096);
+	m_id.swap(m_idScratch);
+}
+
+void FluidSolver::ComputeDensityPressure()
+{
+	const float h2 = m_h * m_h;
+	const ivec3 dims = m_grid.Dims();
+
+	ParallelFor(Count(), [&](int i)
+		{
+			const float xi = m_posX[i], yi = m_posY[i], zi = m_posZ[i];
+			ivec3 c = m_grid.CellCoord(vec3(xi, yi, zi));
+
+			float sum = 0.0f;
+			for (int z = std::max(c.z - 1, 0); z <= std::min(c.z + 1, dims.z - 1); z++)
+				for (int y = std::max(c.y - 1, 0); y <= std::min(c.y + 1, dims.y - 1); y++)
+				{
+					// The three cells along x are adjacent in the sorted arrays, so they form one contiguous range
+					int rowStart = m_grid.CellIndex(ivec3(std::max(c.x - 1, 0), y, z));
+					int rowEnd = m_grid.CellIndex(ivec3(std::min(c.x + 1, dims.x - 1), y, z));
+					int end = m_grid.CellEnd(rowEnd);
+					for (int j = m_grid.CellStart(rowStart); j < end; j++)
+					{
+						float dx = xi - m_posX[j], dy = yi - m_posY[j], dz = zi - m_posZ[j];
+						float r2 = dx * dx + dy * dy + dz * dz;
+						float d = std::max(h2 - r2, 0.0f);
+						sum += d * d * d;
+					}
+				}
+
+			float density = m_mass * m_poly6 * sum;
+			m_density[i] = density;
+
+			// Tait equation of state, clamped so the fluid never pulls itself together
+			float ratio = density / m_settings.restDensity;
+			float ratio7 = ratio * ratio * ratio * ratio * ratio * ratio * ratio;
+			m_pressure[i] = std::max(m_pressureStiffness * (ratio7 - 1.0f), 0.0f);
+		});
+}
+
+void FluidSolver::ComputeForces()
+{
+	const float h = m_h;
+	const ivec3 dims = m_grid.Dims();
+	const float nu = m_settings.viscosity;
+
+	ParallelFor(Count(), [&](int i)
+		{
+			const float xi = m_posX[i], yi = m_posY[i], zi = m_posZ[i];
+			const float vxi = m_velX[i], vyi = m_velY[i], vzi = m_velZ[i];
+			const float pTermI = m_pressure[i] / (m_density[i] * m_density[i]);
+			ivec3 c = m_grid.CellCoord(vec3(xi, yi, zi));
+
+			float ax = 0.0f, ay = 0.0f, az = 0.0f;
+			for (int z = std::max(c.z - 1, 0); z <= std::min(c.z + 1, dims.z - 1); z++)
+				for (int y = std::max(c.y - 1, 0); y <= std::min(c.y + 1, dims.y - 1); y++)
+				{
+					int rowStart = m_grid.CellIndex(ivec3(std::max(c.x - 1, 0), y, z));
+					int rowEnd = m_grid.CellIndex(ivec3(std::min(c.x + 1, dims.x - 1), y, z));
+					int end = m_grid.CellEnd(rowEnd);
+					for (int j = m_grid.CellStart(rowStart); j < end; j++)
+					{
+						float dx = xi - m_posX[j], dy = yi - m_posY[j], dz = zi - m_posZ[j];
+						float r2 = dx * dx + dy * dy + dz * dz;
+						float r = std::sqrt(r2);
+
+						// Branchless: pairs outside the support (and the particle itself) get a zero weight
+						float inside = (r < h && r2 > 0.0f) ? 1.0f : 0.0f;
+						float hr = std::max(h - r, 0.0f);
+						float invR = inside / std::max(r, 1e-6f);
+
+						// Symmetric pressure term with the spiky kernel gradient
+						float pressure = m_mass * (pTermI + m_pressure[j] / (m_density[j] * m_density[j])) * m_spikyGrad * hr * hr * invR;
+						// Viscosity with the viscosity kernel laplacian
+						float visc = inside * nu * m_mass / m_density[j] * m_viscLaplacian * hr;
+
+						ax += pressure * dx + visc * (m_velX[j] - vxi);
+						ay += pressure * dy + visc * (m_velY[j] - vyi);
+						az += pressure * dz + visc * (m_velZ[j] - vzi);
+					}
+				}
+
+			m_accX[i] = ax;
+			m_accY[i] = ay + FLUID_GRAVITY;
+			m_accZ[i] = az;
+		});
+}
+
+// Two-way coupling: spheres push the fluid away and receive the opposite force.
+// Each sphere scans the fluid cells it overlaps; the reactions on the fluid are few (only particles touching a
+// sphere) and are added afterwards on a single thread, so no two threads write to the same particle.
+void FluidSolver::CoupleWithSpheres(std::vector<Particle>& spheres, float dt)
+{
+	int numSpheres = int(spheres.size());
+	std::vector<std::vector<std::pair<int, vec3>>> reactions(numSpheres);
+	std::vector<vec3> sphereForces(numSpheres, vec3(0.0f));
+	const float surface = 0.5f * m_settings.particleSpacing;
+
+	ParallelFor(numSpheres, [&](int s)
+		{
+			const Particle& sphere = spheres[s];
+			float radius = sphere.Scale().x;
+			float reach = radius + surface;
+			ivec3 lo = m_grid.CellCoord(sphere.Position() - vec3(reach));
+			ivec3 hi = m_grid.CellCoord(sphere.Position() + vec3(reach));
+
+			vec3 force(0.0f);
+			for (int z = lo.z; z <= hi.z; z++)
+				for (int y = lo.y; y <= hi.y; y++)
+				{
+					int end = m_grid.CellEnd(m_grid.CellIndex(ivec3(hi.x, y, z)));
+					for (int j = m_grid.CellStart(m_grid.CellIndex(ivec3(lo.x, y, z))); j < end; j++)
+					{
+						vec3 delta = vec3(m_posX[j], m_posY[j], m_posZ[j]) - sphere.Position();
+						float distance = length(delta);
+						float penetration = reach - distance;
+						if (penetration <= 0.0f || distance == 0.0f)
+							continue;
+
+						vec3 normal = delta / distance;
+						float normalVel = dot(vec3(m_velX[j], m_velY[j], m_velZ[j]) - sphere.Velocity(), normal);
+						float accel = std::max(m_settings.boundaryStiffness * penetration - m_settings.boundaryDamping * normalVel, 0.0f);
+
+						reactions[s].emplace_back(j, accel * normal);
+						force -= m_mass * accel * normal;
+					}
+				}
+			sphereForces[s] = force;
+		}, 4);
+
+	for (int s = 0; s < numSpheres; s++)
+	{
+		for (const auto& reaction : reactions[s])
+		{
+			m_accX[reaction.first] += reaction.second.x;
+			m_accY[reaction.first] += reaction.second.y;
+			m_accZ[reaction.first] += reaction.second.z;
+		}
+		spheres[s].SetVelocity(spheres[s].Velocity() + sphereForces[s] / spheres[s].Mass() * dt);
+	}
+}
+
+void FluidSolver::Integrate(float dt)
+{
+	const vec3 lo = m_boxCentre - vec3(m_boxHalfExtent);
+	const vec3 hi = m_boxCentre + vec3(m_boxHalfExtent);
+	const float wallDamping = 0.5f;
+
+	ParallelFor(Count(), [&](int i)
+		{
+			m_velX[i] += m_accX[i] * dt;
+			m_velY[i] += m_accY[i] * dt;
+			m_velZ[i] += m_accZ[i] * dt;
+			m_posX[i] += m_velX[i] * dt;
+			m_posY[i] += m_velY[i] * dt;
+			m_posZ[i] += m_velZ[i] * dt;
+
+			// Keep the fluid inside the invisible walls
+			float* pos[3] = { &m_posX[i], &m_posY[i], &m_posZ[i] };
+			float* vel[3] = { &m_velX[i], &m_velY[i], &m_velZ[i] };
+			for (int c = 0; c < 3; c++)
+			{
+				if (*pos[c] < lo[c]) { *pos[c] = lo[c]; *vel[c] = std::abs(*vel[c]) * wallDamping; }
+				if (*pos[c] > hi[c]) { *pos[c] = hi[c]; *vel[c] = -std::abs(*vel[c]) * wallDamping; }
+			}
+		}, 1024);
+}
+
+void FluidSolver::Step(float deltaTime, std::vector<Particle>& spheres)
+{
+	if (Count() == 0)
+		return;
+
+	int substeps = std::max(1, m_settings.substeps);
+	float dt = deltaTime / substeps;
+	for (int step = 0; step < substeps; step++)
+	{
+		SortByCell();
+		ComputeDensityPressure();
+		ComputeForces();
+		CoupleWithSpheres(spheres, dt);
+		Integrate(dt);
+	}
+}
+
+void FluidSolver::SaveState(CheckpointWriter& out) const
+{
+	out.Write(m_settings);
+	out.Write(m_boxCentre);
+	out.Write(m_boxHalfExtent);
+	for (const auto* column : { &m_posX, &m_posY, &m_posZ, &m_velX, &m_velY, &m_velZ, &m_accX, &m_accY, &m_accZ, &m_density, &m_pressure })
+		out.WriteVector(*column);
+	out.WriteVector(m_id);
+}
+
+bool FluidSolver::LoadState(CheckpointReader& in)
+{
+	FluidSettings settings;
+	vec3 boxCentre;
+	float boxHalfExtent;
+	if (!in.Read(settings) || !in.Read(boxCentre) || !in.Read(boxHalfExtent))
+		return false;
+	Init(boxCentre, boxHalfExtent, settings);
+
+	for (auto* column : { &m_posX, &m_posY, &m_posZ, &m_velX, &m_velY, &m_velZ, &m_accX, &m_accY, &m_accZ, &m_density, &m_pressure })
+		if (!in.ReadVector(*column))
+			return false;
+	return in.ReadVector(m_id);
+}
+
+void FluidSolver::HashState(StateHash& hash) const
+{
+	for (const auto* column : { &m_posX, &m_posY, &m_posZ, &m_velX, &m_velY, &m_velZ })
+		hash.Add(*column);
+	hash.Add(m_id);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "CellGrid.h"
+
+class Particle;
+class CheckpointWriter;
+class CheckpointReader;
+class StateHash;
+
+// Parameters of the weakly compressible fluid
+struct FluidSettings
+{
+	float particleSpacing = 0.5f;		// Rest distance between fluid particles, in m
+	float restDensity = 1000.0f;		// In kg/m^3
+	float speedOfSound = 50.0f;			// Controls compressibility: higher is stiffer but needs smaller steps
+	float viscosity = 0.05f;			// Kinematic viscosity
+	float boundaryStiffness = 2000.0f;	// Repulsion between fluid and the rigid spheres
+	float boundaryDamping = 20.0f;
+	int substeps = 4;					// Number of fluid substeps per simulation step
+};
+
+// Smoothed-particle hydrodynamics solver (weakly compressible, Tait equation of state).
+// Fluid particles are stored as separate arrays per component so that the kernel loops over a cell vectorise.
+// Every step the particles are reordered by grid cell, neighbours are found through the cell-linked list, and the
+// density, force and integration passes run in parallel. The fluid is two-way coupled with the engine's spheres.
+class FluidSolver
+{
+public:
+	void Init(const glm::vec3& boxCentre, float boxHalfExtent, const FluidSettings& settings = FluidSettings());
+
+	// Fills an axis-aligned block with fluid particles at rest spacing
+	void AddBlock(const glm::vec3& minCorner, const glm::vec3& maxCorner, const glm::vec3& velocity = glm::vec3(0.0f));
+
+	// Advances the fluid by deltaTime and exchanges forces with the spheres
+	void Step(float deltaTime, std::vector<Particle>& spheres);
+
+	int Count() const { return int(m_posX.size()); }
+	glm::vec3 Position(int i) const { return glm::vec3(m_posX[i], m_posY[i], m_posZ[i]); }
+	// Particles are reordered every substep; the id of a particle stays the same
+	int Id(int i) const { return m_id[i]; }
+	const FluidSettings& Settings() const { return m_settings; }
+
+	// Settings, box and particles, for checkpoints. Loading re-derives the constants as Init does
+	void SaveState(CheckpointWriter& out) const;
+	bool LoadState(CheckpointReader& in);
+	// Adds the particles' positions, velocities and ids to a hash of the simulation state
+	void HashState(StateHash& hash) const;
+
+private:
+	void SortByCell();
+	void ComputeDensityPressure();
+	void ComputeForces();
+	void CoupleWithSpheres(std::vector<Particle>& spheres, float dt);
+	void Integrate(float dt);
+
+	FluidSettings m_settings;
+	glm::vec3 m_boxCentre = glm::vec3(0.0f);
+	float m_boxHalfExtent = 30.0f;
+
+	// Derived constants
+	float m_h = 1.0f;				// Smoothing length
+	float m_mass = 1.0f;			// Mass of one fluid particle
+	float m_pressureStiffness = 1.0f;
+	float m_poly6 = 0.0f;
+	float m_spikyGrad = 0.0f;
+	float m_viscLaplacian = 0.0f;
+
+	// Particle state, one array per component
+	std::vector<float> m_posX, m_posY, m_posZ;
+	std::vector<float> m_velX, m_velY, m_velZ;
+	std::vector<float> m_accX, m_accY, m_accZ;
+	std::vector<float> m_density, m_pressure;
+	std::vector<int> m_id;
+
+	CellGrid m_grid;
+	std::vector<int> m_cellOfParticle;
+	std::vector<int> m_order;
+	std::vector<float> m_scratch;
+	std::vector<int> m_idScratch;
+};
@@ -17,16 +17,9 @@ void Force::Drag(Particle& p)
 	// Each particle has the same area (using the Symp for getting the scale value)
 	float area = glm::pi<float>() * p.Scale().x * p.Scale().x;
 
-	// AeroForce calculation. Null checking the velocity so that It doesn't return NaN
-	vec3 aeroForce = vec3(0.0f);
-
-	if (glm::length(p.Velocity()) != 0.0f)
-	{
-		aeroForce = 0.5f * AIR_DENSITY *
-			(glm::length(p.Velocity()) * glm::length(p.Velocity())) *
-			DRAG_COEFF * area *
-			(-glm::normalize(p.Velocity()));
-	}
+	// AeroForce calculation. |v|^2 * -v/|v| is -|v| * v, which needs a single length and is already zero at rest
+	float speed = glm::length(p.Velocity());
+	vec3 aeroForce = 0.5f * AIR_DENSITY * speed * DRAG_COEFF * area * -p.Velocity();
 
 	p.ApplyForce(aeroForce);
 }
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cmath>
+#include <tuple>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include "Parallel.h"
+#include "PhysicsObject.h"
+#include "Random.h"
+
+// Force terms that can be combined in a ForceSet. Each one returns the force it applies to a particle, given the particle
+// and its index in the particle array.
+namespace ForceTerm
+{
+	// Constant pull, proportional to the mass
+	struct Gravity
+	{
+		glm::vec3 acceleration = glm::vec3(0.0f, -9.81f, 0.0f);
+
+		glm::vec3 operator()(const Particle& p, int) const
+		{
+			return acceleration * p.Mass();
+		}
+	};
+
+	// Per-particle acceleration computed beforehand, e.g. the Barnes-Hut mutual gravity
+	struct AccelerationField
+	{
+		const std::vector<glm::vec3>* accelerations = nullptr;
+
+		glm::vec3 operator()(const Particle& p, int index) const
+		{
+			return (*accelerations)[index] * p.Mass();
+		}
+	};
+
+	// Aerodynamic drag of a sphere moving through still air: F = -1/2 rho |v|^2 Cd A v/|v|
+	struct QuadraticDrag
+	{
+		float airDensity = 1.225f;
+		float dragCoefficient = 0.47f;
+
+		glm::vec3 operator()(const Particle& p, int) const
+		{
+			return Drag(p.Velocity(), p.Scale().x);
+		}
+
+		glm::vec3 Drag(const glm::vec3& relativeVelocity, float radius) const
+		{
+			float area = glm::pi<float>() * radius * radius;
+			// |v|^2 * v/|v| = |v| * v, so one square root is enough and zero velocity needs no special case
+			float speed = std::sqrt(glm::dot(relativeVelocity, relativeVelocity));
+			return -0.5f * airDensity * dragCoefficient * area * speed * relativeVelocity;
+		}
+	};
+
+	// Quadratic drag relative to moving air
+	struct Wind
+	{
+		glm::vec3 velocity = glm::vec3(0.0f);
+		QuadraticDrag drag;
+
+		glm::vec3 operator()(const Particle& p, int) const
+		{
+			// The still-air part is left to QuadraticDrag; this adds the difference due to the air moving
+			return drag.Drag(p.Velocity() - velocity, p.Scale().x) - drag.Drag(p.Velocity(), p.Scale().x);
+		}
+	};
+
+	// Langevin thermostat, i.e. Brownian motion: friction -gamma m v plus a random kick per step of standard deviation
+	// sqrt(2 gamma m kT / dt) per axis, which keeps the spheres jiggling at temperature kT (fluctuation-dissipation).
+	// The kicks are drawn for the sphere's id and the step, so they don't depend on which thread evaluates them
+	struct Langevin
+	{
+		float damping = 0.0f;			// gamma, in 1/s. Zero turns the term off
+		float temperature = 0.0f;		// kT, in J
+		float dt = 1.0f / 60.0f;		// Length of the (sub)step the kicks are for
+		Philox random;
+		uint64_t step = 0;
+		uint32_t substep = 0;
+
+		glm::vec3 operator()(const Particle& p, int) const
+		{
+			if (damping <= 0.0f)
+				return glm::vec3(0.0f);
+			glm::vec3 kick = glm::vec3(Philox::ToNormal(random(RandomCounter(uint32_t(p.Id()), step, RandomPurpose::Brownian, substep))));
+			float m = p.Mass();
+			return -damping * m * p.Velocity() + std::sqrt(2.0f * damping * m * temperature / dt) * kick;
+		}
+	};
+}
+
+// A set of force terms fixed at compile time, e.g. ForceSet<ForceTerm::Gravity, ForceTerm::QuadraticDrag, ForceTerm::Wind>.
+// The terms are summed inline (no virtual calls) and fused with the integration, so each particle is read and written
+// once per step and no force is stored in between.
+template<typename... Terms>
+class ForceSet
+{
+public:
+	ForceSet() = default;
+	explicit ForceSet(const Terms&... terms) : m_terms(terms...) {}
+
+	// Access to one term's parameters, e.g. forces.Get<ForceTerm::Wind>().velocity
+	template<typename Term>
+	Term& Get() { return std::get<Term>(m_terms); }
+
+	// Total force acting on a particle
+	glm::vec3 Sum(const Particle& p, int index) const
+	{
+		return std::apply([&](const auto&... term) { return (glm::vec3(0.0f) + ... + term(p, index)); }, m_terms);
+	}
+
+	// Sums the forces, integrates with symplectic Euler and calls postStep(particle) in one pass over the particles
+	template<typename PostStep>
+	void Integrate(std::vector<Particle>& particles, float dt, const PostStep& postStep) const
+	{
+		ParallelFor(int(particles.size()), [&](int i)
+			{
+				Particle& p = particles[i];
+				glm::vec3 acceleration = Sum(p, i) / p.Mass();
+				glm::vec3 velocity = p.Velocity() + acceleration * dt;
+				p.SetVelocity(velocity);
+				p.SetPosition(p.Position() + velocity * dt);
+				postStep(p);
+			});
+	}
+
+private:
+	std::tuple<Terms...> m_terms;
+};
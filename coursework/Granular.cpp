@@ -0,0 +1,233 @@
+#include "Granular.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+#include "Checkpoint.h"
+#include "Parallel.h"
+#include "PhysicsObject.h"
+#include "StateHash.h"
+
+using namespace glm;
+
+// Packs the two particle ids into one key, smallest id first so the key doesn't depend on the sort order
+uint64_t GranularSolver::ContactKey(int id1, int id2)
+{
+	uint32_t a = uint32_t(std::min(id1, id2));
+	uint32_t b = uint32_t(std::max(id1, id2));
+	return (uint64_t(a) << 32) | b;
+}
+
+// Tangential spring of an existing contact, or zero if the contact is new
+vec3 GranularSolver::FindHistory(uint64_t key) const
+{
+	auto it = std::lower_bound(m_history.begin(), m_history.end(), key,
+		[](const ContactHistory& h, uint64_t k) { return h.key < k; });
+	if (it != m_history.end() && it->key == key)
+		return it->tangentialSpring;
+	return vec3(0.0f);
+}
+
+GranularSolver::ContactResult GranularSolver::EvaluateContact(const Particle& p1, const Particle& p2, const vec3& tangentialSpring, float dt) const
+{
+	ContactResult result;
+
+	float r1 = p1.Scale().x;
+	float r2 = p2.Scale().x;
+	vec3 delta = p2.Position() - p1.Position();
+	float distance = length(delta);
+	float overlap = r1 + r2 - distance;
+	if (overlap <= 0.0f || distance == 0.0f)
+		return result;
+
+	result.touching = true;
+
+	// Normal pointing from p1 to p2
+	vec3 normal = delta / distance;
+
+	// Effective radius, mass and moduli of the contact
+	const auto& mat = m_material;
+	float effRadius = r1 * r2 / (r1 + r2);
+	float effMass = p1.Mass() * p2.Mass() / (p1.Mass() + p2.Mass());
+	float effYoung = mat.youngsModulus / (2.0f * (1.0f - mat.poissonRatio * mat.poissonRatio));
+	float shearModulus = mat.youngsModulus / (2.0f * (1.0f + mat.poissonRatio));
+	float effShear = shearModulus / (2.0f * (2.0f - mat.poissonRatio));
+
+	// Damping ratio derived from the coefficient of restitution
+	float logE = std::log(mat.restitution);
+	float beta = -logE / std::sqrt(logE * logE + pi<float>() * pi<float>());
+	const float dampingScale = 2.0f * std::sqrt(5.0f / 6.0f);
+
+	float contactRadius = std::sqrt(effRadius * overlap);
+	float normalStiffness = 2.0f * effYoung * contactRadius;
+	float tangentialStiffness = 8.0f * effShear * contactRadius;
+
+	const vec3& w1 = m_angularVelocity[p1.Id()];
+	const vec3& w2 = m_angularVelocity[p2.Id()];
+
+	// Relative velocity of p2's contact point with respect to p1's
+	vec3 relVel = p2.Velocity() - p1.Velocity() - cross(r1 * w1 + r2 * w2, normal);
+	float normalVel = dot(relVel, normal);
+	vec3 tangentialVel = relVel - normalVel * normal;
+
+	// Normal force: Hertz spring plus damping, never attractive
+	float normalForce = (4.0f / 3.0f) * effYoung * contactRadius * overlap
+		- dampingScale * beta * std::sqrt(normalStiffness * effMass) * normalVel;
+	normalForce = std::max(normalForce, 0.0f);
+
+	// Tangential force: Mindlin spring on the accumulated tangential displacement, rotated into the current tangent plane
+	vec3 spring = tangentialSpring - dot(tangentialSpring, normal) * normal;
+	spring += tangentialVel * dt;
+	vec3 tangentialForce = tangentialStiffness * spring
+		+ dampingScale * beta * std::sqrt(tangentialStiffness * effMass) * tangentialVel;
+
+	// Coulomb limit: the grains slide, and the spring is shortened to match the sliding force
+	float maxFriction = mat.friction * normalForce;
+	float tangentialMag = length(tangentialForce);
+	if (tangentialMag > maxFriction)
+	{
+		tangentialForce *= maxFriction / tangentialMag;
+		spring = tangentialStiffness > 0.0f ? tangentialForce / tangentialStiffness : vec3(0.0f);
+	}
+
+	result.force = -normalForce * normal + tangentialForce;
+	result.tangentialSpring = spring;
+	result.torque1 = cross(r1 * normal, tangentialForce);
+	result.torque2 = cross(r2 * normal, tangentialForce);
+
+	// Rolling resistance opposes the relative spin of the two grains
+	vec3 relSpin = w1 - w2;
+	float relSpinMag = length(relSpin);
+	if (relSpinMag > 0.0f)
+	{
+		vec3 rollingTorque = -mat.rollingFriction * normalForce * effRadius * relSpin / relSpinMag;
+		result.torque1 += rollingTorque;
+		result.torque2 -= rollingTorque;
+	}
+
+	return result;
+}
+
+void GranularSolver::ApplyContactForces(std::vector<Particle>& particles, const std::vector<std::pair<int, int>>& pairs, float dt)
+{
+	int numParticles = int(particles.size());
+	int numPairs = int(pairs.size());
+
+	// Spin and torque are stored by id, so make room for any newly spawned particle
+	int maxId = -1;
+	for (const auto& p : particles)
+		maxId = std::max(maxId, p.Id());
+	if (int(m_angularVelocity.size()) <= maxId)
+		m_angularVelocity.resize(maxId + 1, vec3(0.0f));
+	m_torque.assign(m_angularVelocity.size(), vec3(0.0f));
+
+	// 1. Evaluate every contact independently
+	m_results.resize(numPairs);
+	ParallelFor(numPairs, [&](int i)
+		{
+			const Particle& p1 = particles[pairs[i].first];
+			const Particle& p2 = particles[pairs[i].second];
+			m_results[i] = EvaluateContact(p1, p2, FindHistory(ContactKey(p1.Id(), p2.Id())), dt);
+		});
+
+	// 2. Keep the tangential springs of the contacts that are still touching
+	m_history.clear();
+	for (int i = 0; i < numPairs; i++)
+	{
+		if (m_results[i].touching)
+		{
+			const auto& pair = pairs[i];
+			m_history.push_back({ ContactKey(particles[pair.first].Id(), particles[pair.second].Id()), m_results[i].tangentialSpring });
+		}
+	}
+	std::sort(m_history.begin(), m_history.end(), [](const ContactHistory& a, const ContactHistory& b) { return a.key < b.key; });
+
+	// 3. Build the list of contacts of each particle (counting sort on the particle index)
+	m_contactOffsets.assign(numParticles + 1, 0);
+	for (const auto& pair : pairs)
+	{
+		m_contactOffsets[pair.first + 1]++;
+		m_contactOffsets[pair.second + 1]++;
+	}
+	for (int i = 0; i < numParticles; i++)
+		m_contactOffsets[i + 1] += m_contactOffsets[i];
+
+	m_contactList.resize(numPairs * 2);
+	std::vector<int> fill(m_contactOffsets.begin(), m_contactOffsets.end() - 1);
+	for (int i = 0; i < numPairs; i++)
+	{
+		// Even entries mean "first particle of the pair", odd ones "second particle"
+		m_contactList[fill[pairs[i].first]++] = i * 2;
+		m_contactList[fill[pairs[i].second]++] = i * 2 + 1;
+	}
+
+	// 4. Each particle gathers its own contacts, so no two threads write to the same particle
+	ParallelFor(numParticles, [&](int p)
+		{
+			vec3 force(0.0f);
+			vec3 torque(0.0f);
+			for (int c = m_contactOffsets[p]; c < m_contactOffsets[p + 1]; c++)
+			{
+				const auto& result = m_results[m_contactList[c] / 2];
+				bool isFirst = (m_contactList[c] & 1) == 0;
+				force += isFirst ? result.force : -result.force;
+				torque += isFirst ? result.torque1 : result.torque2;
+			}
+			particles[p].ApplyForce(force);
+			m_torque[particles[p].Id()] = torque;
+		});
+}
+
+void GranularSolver::IntegrateRotation(const std::vector<Particle>& particles, float dt)
+{
+	ParallelFor(int(particles.size()), [&](int i)
+		{
+			const auto& p = particles[i];
+			// Solid sphere moment of inertia
+			float inertia = 0.4f * p.Mass() * p.Scale().x * p.Scale().x;
+			m_angularVelocity[p.Id()] += m_torque[p.Id()] / inertia * dt;
+		});
+}
+
+void GranularSolver::Reset()
+{
+	m_history.clear();
+	m_angularVelocity.clear();
+	m_torque.clear();
+}
+
+void GranularSolver::ResetParticle(int id)
+{
+	if (id < int(m_angularVelocity.size()))
+		m_angularVelocity[id] = vec3(0.0f);
+}
+
+void GranularSolver::SaveState(CheckpointWriter& out) const
+{
+	out.Write(m_material);
+	out.WriteVector(m_history);
+	out.WriteVector(m_angularVelocity);
+	out.WriteVector(m_torque);
+}
+
+bool GranularSolver::LoadState(CheckpointReader& in)
+{
+	return in.Read(m_material)
+		&& in.ReadVector(m_history)
+		&& in.ReadVector(m_angularVelocity)
+		&& in.ReadVector(m_torque);
+}
+
+void GranularSolver::HashState(StateHash& hash) const
+{
+	// Member by member: the history entries have padding, whose bytes are undefined
+	hash.Add(uint64_t(m_history.size()));
+	for (const auto& contact : m_history)
+	{
+		hash.Add(contact.key);
+		hash.Add(contact.tangentialSpring);
+	}
+	hash.Add(m_angularVelocity);
+}
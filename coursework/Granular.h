@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+class Particle;
+class CheckpointWriter;
+class CheckpointReader;
+class StateHash;
+
+// Material properties of the grains, shared by every particle in the granular (DEM) mode
+struct GranularMaterial
+{
+	float youngsModulus = 2.0e5f;		// Stiffness, in Pa. Kept soft so a 60Hz frame only needs a few substeps
+	float poissonRatio = 0.3f;
+	float restitution = 0.5f;			// Coefficient of restitution used to derive the contact damping
+	float friction = 0.5f;				// Coulomb sliding friction coefficient
+	float rollingFriction = 0.05f;		// Rolling resistance coefficient
+	int substeps = 8;					// Number of DEM substeps per simulation step
+};
+
+// Discrete element method solver using the Hertz-Mindlin soft contact model.
+// Each pair of touching spheres is treated as a non-linear spring-damper in the normal direction and a history-dependent
+// spring-damper in the tangential direction, capped by Coulomb friction. Grains also carry an angular velocity so friction
+// and rolling resistance can spin them.
+class GranularSolver
+{
+public:
+	void SetMaterial(const GranularMaterial& material) { m_material = material; }
+	const GranularMaterial& Material() const { return m_material; }
+
+	// Computes the contact forces for the broadphase pairs and adds them to the particles through ApplyForce.
+	// Pairs index into the particles array. Contacts are evaluated in parallel, then each particle gathers its own contacts,
+	// so nothing is written by two threads and no atomics are needed.
+	void ApplyContactForces(std::vector<Particle>& particles, const std::vector<std::pair<int, int>>& pairs, float dt);
+
+	// Advances the grain spins with the torques computed by the last ApplyContactForces call
+	void IntegrateRotation(const std::vector<Particle>& particles, float dt);
+
+	// Number of pairs that were actually touching in the last step
+	size_t ActiveContacts() const { return m_history.size(); }
+
+	// Forgets all contact history and spin, e.g. when switching back from the impulse mode
+	void Reset();
+	// Clears the spin kept for a particle id, when the id is given to a new particle
+	void ResetParticle(int id);
+
+	// Material, contact history and spins, for checkpoints
+	void SaveState(CheckpointWriter& out) const;
+	bool LoadState(CheckpointReader& in);
+	// Adds the contact history and spins to a hash of the simulation state
+	void HashState(StateHash& hash) const;
+
+private:
+	// Per-pair result of the contact evaluation
+	struct ContactResult
+	{
+		glm::vec3 force = glm::vec3(0.0f);		// Force acting on the first particle; the second gets the opposite
+		glm::vec3 torque1 = glm::vec3(0.0f);
+		glm::vec3 torque2 = glm::vec3(0.0f);
+		glm::vec3 tangentialSpring = glm::vec3(0.0f);
+		bool touching = false;
+	};
+
+	// Tangential spring elongation of a contact, kept while the two grains stay in contact
+	struct ContactHistory
+	{
+		uint64_t key;
+		glm::vec3 tangentialSpring;
+	};
+
+	static uint64_t ContactKey(int id1, int id2);
+	glm::vec3 FindHistory(uint64_t key) const;
+	ContactResult EvaluateContact(const Particle& p1, const Particle& p2, const glm::vec3& tangentialSpring, float dt) const;
+
+	GranularMaterial m_material;
+
+	// Sorted by key, so lookups can run in parallel with a binary search
+	std::vector<ContactHistory> m_history;
+
+	// Scratch buffers reused between steps
+	std::vector<ContactResult> m_results;
+	std::vector<int> m_contactOffsets;
+	std::vector<int> m_contactList;
+
+	// Indexed by particle id, which survives the per-step sort
+	std::vector<glm::vec3> m_angularVelocity;
+	std::vector<glm::vec3> m_torque;
+};
@@ -0,0 +1,134 @@
+#include "InstancedRenderer.h"
+
+#include <algorithm>
+
+#include "Mesh.h"
+#include "Shader.h"
+
+void InstanceStream::Allocate(int capacity)
+{
+	Release();
+
+	m_capacity = capacity;
+	m_persistent = GLEW_ARB_buffer_storage != GL_FALSE;
+	GLsizeiptr bytes = GLsizeiptr(sizeof(SphereInstance)) * capacity * NUM_SEGMENTS;
+
+	glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+	if (m_persistent)
+	{
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+		m_mapped = static_cast<SphereInstance*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags));
+		if (m_mapped == nullptr)
+		{
+			// Storage is immutable, so fall back with a fresh buffer
+			glDeleteBuffers(1, &m_buffer);
+			glGenBuffers(1, &m_buffer);
+			m_persistent = false;
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void InstanceStream::Release()
+{
+	for (int s = 0; s < NUM_SEGMENTS; s++)
+		WaitForSegment(s);
+
+	if (m_buffer != 0)
+	{
+		if (m_mapped != nullptr)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &m_buffer);
+	}
+	m_buffer = 0;
+	m_mapped = nullptr;
+}
+
+void InstanceStream::WaitForSegment(int segment)
+{
+	GLsync& fence = m_fences[segment];
+	if (fence == nullptr)
+		return;
+
+	// Flush on the first wait so the fence is guaranteed to signal
+	GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+	while (glClientWaitSync(fence, flags, 1000000) == GL_TIMEOUT_EXPIRED)
+		flags = 0;
+	glDeleteSync(fence);
+	fence = nullptr;
+}
+
+SphereInstance* InstanceStream::Begin(int count)
+{
+	if (count > m_capacity || m_buffer == 0)
+		Allocate(std::max(count, std::max(1024, m_capacity * 2)));
+
+	m_segment = (m_segment + 1) % NUM_SEGMENTS;
+	m_count = count;
+
+	if (!m_persistent)
+	{
+		m_staging.resize(count);
+		return m_staging.data();
+	}
+
+	WaitForSegment(m_segment);
+	return m_mapped + size_t(m_segment) * m_capacity;
+}
+
+void InstanceStream::End(const Mesh& mesh)
+{
+	if (m_persistent)
+	{
+		mesh.SetInstanceBuffer(m_buffer, GLintptr(sizeof(SphereInstance)) * m_segment * m_capacity);
+		return;
+	}
+
+	// Orphan the previous contents so the driver doesn't wait for last frame's draw to finish
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(SphereInstance) * m_count, m_staging.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	mesh.SetInstanceBuffer(m_buffer);
+}
+
+void InstanceStream::Fence()
+{
+	if (m_persistent)
+		m_fences[m_segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+SphereInstance* InstancedRenderer::Map(const Mesh* mesh, int count)
+{
+	auto it = std::find_if(m_batches.begin(), m_batches.end(), [mesh](const Batch& b) { return b.mesh == mesh; });
+	if (it == m_batches.end())
+	{
+		m_batches.emplace_back();
+		it = m_batches.end() - 1;
+		it->mesh = mesh;
+	}
+
+	it->count = count;
+	return it->stream.Begin(count);
+}
+
+void InstancedRenderer::Draw()
+{
+	m_shader->Use();
+
+	for (auto& batch : m_batches)
+	{
+		if (batch.count == 0)
+			continue;
+
+		batch.stream.End(*batch.mesh);
+		batch.mesh->DrawInstanced(GLsizei(batch.count));
+		batch.stream.Fence();
+		batch.count = 0;
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+class Mesh;
+class Shader;
+
+// Per-instance data, read by the instanced shader as two vec4 vertex attributes
+struct SphereInstance
+{
+	glm::vec4 positionRadius;
+	glm::vec4 color;
+};
+
+// Instance buffer split in three segments, so the CPU fills one while the GPU still reads the other two.
+// With ARB_buffer_storage the buffer is persistently and coherently mapped: instances are written straight into GPU
+// visible memory, and a fence per segment replaces the implicit synchronisation of glBufferData.
+// Without it, instances go to a CPU array that is uploaded with an orphaning glBufferData.
+class InstanceStream
+{
+public:
+	// Returns room for count instances in the next segment, waiting for the GPU to be done with it if needed
+	SphereInstance* Begin(int count);
+
+	// Points the mesh's instance attributes at the segment written since Begin
+	void End(const Mesh& mesh);
+
+	// Marks the segment as in use by the draw calls issued since End
+	void Fence();
+
+	bool IsPersistent() const { return m_persistent; }
+
+private:
+	static const int NUM_SEGMENTS = 3;
+
+	void Allocate(int capacity);
+	void Release();
+	void WaitForSegment(int segment);
+
+	GLuint m_buffer = 0;
+	bool m_persistent = false;
+	int m_capacity = 0;				// Instances per segment
+	int m_segment = 0;				// Segment being written this frame
+	SphereInstance* m_mapped = nullptr;
+	GLsync m_fences[NUM_SEGMENTS] = { nullptr, nullptr, nullptr };
+
+	// Fallback path
+	std::vector<SphereInstance> m_staging;
+	int m_count = 0;
+};
+
+// Batches uniformly scaled objects per mesh and draws each mesh with a single instanced draw call
+class InstancedRenderer
+{
+public:
+	void Init(const Shader* shader) { m_shader = shader; }
+
+	// Storage for count instances of a mesh this frame. The caller fills it (possibly from several threads)
+	// before calling Draw
+	SphereInstance* Map(const Mesh* mesh, int count);
+
+	// Issues one draw call per mesh mapped this frame. The camera is read from the per-frame uniform block
+	void Draw();
+
+private:
+	struct Batch
+	{
+		const Mesh* mesh = nullptr;
+		InstanceStream stream;
+		int count = 0;
+	};
+
+	const Shader* m_shader = nullptr;
+
+	// Only a handful of meshes, so a linear search beats a map
+	std::vector<Batch> m_batches;
+};
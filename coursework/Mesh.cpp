@@ -1,7 +1,12 @@
 #include "Mesh.h"
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <tiny_obj_loader.h>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#include <glm/gtc/packing.hpp>
+
+#include "MeshOptimize.h"
 
 MeshData TetrahedronMeshData()
 {
@@ -30,6 +35,20 @@ MeshData PlaneMeshData()
 	return smd;
 }
 
+// Unit quad in the xy plane, corners at +-1. Impostor shaders place and size it per instance
+MeshData ImpostorQuadMeshData()
+{
+	MeshData smd;
+	smd.positions.data = {
+		glm::vec3(-1.0f,-1.0f,0.0f),
+		glm::vec3(1.0f,-1.0f,0.0f),
+		glm::vec3(1.0f,1.0f,0.0f),
+		glm::vec3(-1.0f,1.0f,0.0f)
+	};
+	smd.positions.faces = { {0,1,2}, {2,3,0} }; // 2 triangles
+	return smd;
+}
+
 std::vector<std::string> split(const std::string& text, char delimiter)
 {
 	std::vector<std::string> tokens;
@@ -47,34 +66,19 @@ std::vector<std::string> split(const std::string& text, char delimiter)
 
 MeshData MeshDataFromWavefrontObj(const char * filename)
 {
+	// Vertices are (position, normal) pairs shared by the faces, so PrepareMesh doesn't need to duplicate any
+	OBJModel obj(filename);
+	auto model = obj.ToIndexedModel();
+
 	MeshData smd;
-	using namespace tinyobj;
-	attrib_t attrib;
-	std::vector<shape_t> shapes;
-	std::vector<material_t> materials;
-	std::string err;
-
-	auto ok = LoadObj(&attrib, &shapes, &materials, &err, filename);
-	if (!ok)
-		printf("TinyObjLoader ERROR for file %s: %s\n", filename, err.c_str());
-	else
+	smd.positions.data = std::move(model.positions);
+	smd.positions.faces.resize(model.indices.size() / 3);
+	for (size_t i = 0; i < smd.positions.faces.size(); ++i)
+		smd.positions.faces[i] = glm::ivec3(model.indices[i * 3], model.indices[i * 3 + 1], model.indices[i * 3 + 2]);
+	if (obj.hasNormals)
 	{
-		smd.positions.data.resize(attrib.vertices.size() / 3);
-		for (size_t i = 0; i < smd.positions.data.size(); ++i)
-			smd.positions.data[i] = glm::vec3(attrib.vertices[i * 3], attrib.vertices[i * 3 + 1], attrib.vertices[i * 3 + 2]);
-		smd.normals.data.resize(attrib.normals.size() / 3);
-		for (size_t i = 0; i < smd.normals.data.size(); ++i)
-			smd.normals.data[i] = glm::vec3(attrib.normals[i * 3], attrib.normals[i * 3 + 1], attrib.normals[i * 3 + 2]);
-		for (const auto& shape : shapes)
-		{
-			const auto& indices = shape.mesh.indices;
-			for ( size_t mi = 0; mi < indices.size(); mi += 3)
-			{
-				smd.positions.faces.emplace_back(indices[mi].vertex_index, indices[mi + 1].vertex_index, indices[mi + 2].vertex_index);
-				if(!smd.normals.data.empty())
-					smd.normals.faces.emplace_back(indices[mi].normal_index, indices[mi + 1].normal_index, indices[mi + 2].normal_index);
-			}
-		}
+		smd.normals.data = std::move(model.normals);
+		smd.normals.faces = smd.positions.faces;
 	}
 	return smd;
 }
@@ -122,42 +126,233 @@ MeshData PrepareMesh(const MeshData& md_in)
 	return md_out;
 }
 
-void Mesh::Init(const MeshData& meshData_in)
+GpuMeshData CookMeshData(const MeshData& meshData_in, MeshOptimizeStats* stats)
 {
-	m_meshData = meshData_in; // Store the original
 	auto meshData = PrepareMesh(meshData_in); // convert for ease of visualisation
 
+	// After PrepareMesh, positions and normals correspond 1:1 and share the face indices
+	GpuMeshData gpu;
+	gpu.vertices.resize(meshData.positions.data.size());
+	for (size_t i = 0; i < gpu.vertices.size(); ++i)
+		gpu.vertices[i] = { meshData.positions.data[i], meshData.normals.data[i] };
+	gpu.indices.reserve(meshData.positions.faces.size() * 3);
+	for (const auto& face : meshData.positions.faces)
+		for (int j = 0; j < 3; ++j)
+			gpu.indices.push_back(uint32_t(face[j]));
+	OptimizeMesh(gpu, stats);
+	return gpu;
+}
+
+// Maps a unit vector onto the octahedron |x|+|y|+|z| = 1 and unfolds the lower half over the upper one, giving two
+// coordinates in [-1,1] (Meyer et al. 2010). The vertex shaders undo this
+static glm::vec2 OctahedralEncode(const glm::vec3& n)
+{
+	glm::vec3 p = n / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+	if (p.z >= 0.0f)
+		return glm::vec2(p.x, p.y);
+	return glm::vec2((1.0f - std::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f), (1.0f - std::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+}
+
+// Mesh data sharing the indices of GPU-ready vertices
+static MeshData MeshDataFromVertices(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices)
+{
+	MeshData md;
+	md.positions.data.resize(numVertices);
+	md.normals.data.resize(numVertices);
+	for (size_t i = 0; i < numVertices; ++i)
+	{
+		md.positions.data[i] = vertices[i].position;
+		md.normals.data[i] = vertices[i].normal;
+	}
+	md.positions.faces.resize(numIndices / 3);
+	for (size_t i = 0; i < md.positions.faces.size(); ++i)
+		md.positions.faces[i] = glm::ivec3(indices[i * 3], indices[i * 3 + 1], indices[i * 3 + 2]);
+	md.normals.faces = md.positions.faces;
+	return md;
+}
+
+// Bytes a position and a normal take in a vertex of the format. Each is a multiple of 4
+static size_t PositionSize(const MeshFormat& format)
+{
+	return format.halfPositions ? sizeof(uint64_t) : sizeof(glm::vec3); // 3 halves and padding
+}
+
+static size_t NormalSize(const MeshFormat& format)
+{
+	return format.octahedralNormals ? sizeof(uint32_t) : sizeof(glm::vec3);
+}
+
+PackedMesh Mesh::Pack(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices, const MeshFormat& format)
+{
+	PackedMesh packed;
+	packed.format = format;
+	if (format.keepData)
+		packed.data = std::make_shared<const MeshData>(MeshDataFromVertices(vertices, numVertices, indices, numIndices));
+
+	// vertex data, position and normal interleaved
+	const size_t positionSize = PositionSize(format);
+	const size_t stride = positionSize + NormalSize(format);
+	packed.vertices.resize(stride * numVertices);
+	for (size_t i = 0; i < numVertices; ++i)
+	{
+		uint8_t* out = &packed.vertices[i * stride];
+		if (format.halfPositions)
+		{
+			uint64_t halves = glm::packHalf4x16(glm::vec4(vertices[i].position, 0.0f));
+			std::memcpy(out, &halves, sizeof(halves));
+		}
+		else
+			std::memcpy(out, &vertices[i].position, sizeof(glm::vec3));
+		if (format.octahedralNormals)
+		{
+			uint32_t octahedral = glm::packSnorm2x16(OctahedralEncode(vertices[i].normal));
+			std::memcpy(out + positionSize, &octahedral, sizeof(octahedral));
+		}
+		else
+			std::memcpy(out + positionSize, &vertices[i].normal, sizeof(glm::vec3));
+	}
+
+	// index data, halved when the vertices fit in 16 bits
+	packed.indexCount = GLsizei(numIndices);
+	if (numVertices <= 0x10000)
+	{
+		packed.indexType = GL_UNSIGNED_SHORT;
+		packed.indices.resize(sizeof(uint16_t) * numIndices);
+		uint16_t* out = reinterpret_cast<uint16_t*>(packed.indices.data());
+		for (size_t i = 0; i < numIndices; ++i)
+			out[i] = uint16_t(indices[i]);
+	}
+	else
+	{
+		packed.indexType = GL_UNSIGNED_INT;
+		packed.indices.resize(sizeof(uint32_t) * numIndices);
+		std::memcpy(packed.indices.data(), indices, packed.indices.size());
+	}
+	return packed;
+}
+
+PackedMesh Mesh::Wrap(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices, const MeshFormat& format)
+{
+	if (format.halfPositions || format.octahedralNormals)
+		return Pack(vertices, numVertices, indices, numIndices, format);
+
+	// MeshVertex is already the default layout, and 32-bit indices are always valid
+	PackedMesh packed;
+	packed.format = format;
+	if (format.keepData)
+		packed.data = std::make_shared<const MeshData>(MeshDataFromVertices(vertices, numVertices, indices, numIndices));
+	packed.externalVertices = vertices;
+	packed.externalVertexBytes = numVertices * sizeof(MeshVertex);
+	packed.externalIndices = indices;
+	packed.externalIndexBytes = numIndices * sizeof(uint32_t);
+	packed.indexCount = GLsizei(numIndices);
+	packed.indexType = GL_UNSIGNED_INT;
+	return packed;
+}
+
+PackedMesh Mesh::Pack(const MeshData& meshData_in, const MeshFormat& format)
+{
+	auto gpu = CookMeshData(meshData_in);
+	MeshFormat packFormat = format;
+	packFormat.keepData = false; // The original is kept rather than the cooked form
+	auto packed = Pack(gpu.vertices.data(), gpu.vertices.size(), gpu.indices.data(), gpu.indices.size(), packFormat);
+	packed.format = format;
+	if (format.keepData)
+		packed.data = std::make_shared<const MeshData>(meshData_in); // Store the original
+	return packed;
+}
+
+void Mesh::Init(const MeshData& meshData_in, const MeshFormat& format)
+{
+	Upload(Pack(meshData_in, format));
+}
+
+void Mesh::Init(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices, const MeshFormat& format)
+{
+	Upload(Pack(vertices, numVertices, indices, numIndices, format));
+}
+
+void Mesh::Upload(const PackedMesh& packed)
+{
+	m_format = packed.format;
+	m_meshData = packed.data;
+	m_indexCount = packed.indexCount;
+	m_indexType = packed.indexType;
+
 	glGenVertexArrays(1, &m_vao);
 	glBindVertexArray(m_vao);
 
 	glGenBuffers(NUM_BUFFERS, m_buffers);
 
-	// vertex data
-	glBindBuffer(GL_ARRAY_BUFFER, m_buffers[POSITION_VB]);
-	const int numComponents = 3; // A vertex has x,y,z coordinates
-	auto bytesTotal = sizeof (glm::vec3) * meshData.positions.data.size();
-	glBufferData(GL_ARRAY_BUFFER, bytesTotal, &meshData.positions.data[0].x, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(POSITION_VB);
-	glVertexAttribPointer(POSITION_VB, numComponents, GL_FLOAT, GL_FALSE, 0, 0);
-
-	// normal data
-	glBindBuffer(GL_ARRAY_BUFFER, m_buffers[NORMAL_VB]);
-	glBufferData(GL_ARRAY_BUFFER, bytesTotal, &meshData.normals.data[0].x, GL_STATIC_DRAW);
-	glEnableVertexAttribArray(NORMAL_VB);
-	glVertexAttribPointer(NORMAL_VB, numComponents, GL_FLOAT, GL_FALSE, 0, 0);
-
-	// index data
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffers[VERTEX_VB]);
+	if (packed.externalVertices)
+		glBufferData(GL_ARRAY_BUFFER, packed.externalVertexBytes, packed.externalVertices, GL_STATIC_DRAW);
+	else
+		glBufferData(GL_ARRAY_BUFFER, packed.vertices.size(), packed.vertices.data(), GL_STATIC_DRAW);
+	const size_t positionSize = PositionSize(m_format);
+	const GLsizei stride = GLsizei(positionSize + NormalSize(m_format));
+	glEnableVertexAttribArray(POSITION_ATTRIB);
+	glVertexAttribPointer(POSITION_ATTRIB, 3, m_format.halfPositions ? GL_HALF_FLOAT : GL_FLOAT, GL_FALSE, stride, (void*)0);
+	if (m_format.octahedralNormals)
+	{
+		glEnableVertexAttribArray(OCTAHEDRAL_NORMAL_ATTRIB);
+		glVertexAttribPointer(OCTAHEDRAL_NORMAL_ATTRIB, 2, GL_SHORT, GL_TRUE, stride, (void*)positionSize);
+	}
+	else
+	{
+		glEnableVertexAttribArray(NORMAL_ATTRIB);
+		glVertexAttribPointer(NORMAL_ATTRIB, 3, GL_FLOAT, GL_FALSE, stride, (void*)positionSize);
+	}
+
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[IB]);
-	bytesTotal = sizeof(glm::ivec3) * meshData.positions.faces.size();
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, bytesTotal, &meshData.positions.faces[0], GL_STATIC_DRAW);
+	if (packed.externalIndices)
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, packed.externalIndexBytes, packed.externalIndices, GL_STATIC_DRAW);
+	else
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, packed.indices.size(), packed.indices.data(), GL_STATIC_DRAW);
 
 	glBindVertexArray(0);
 }
 
+const MeshData& Mesh::Data() const
+{
+	static const MeshData empty;
+	return m_meshData ? *m_meshData : empty;
+}
+
 // The actual draw call. We expect a shader to be bound and set-up accordingly
 void Mesh::DrawVertexArray() const
 {
+	if (!IsReady())
+		return;
+	glBindVertexArray(m_vao);
+	glDrawElements(GL_TRIANGLES, m_indexCount, m_indexType, (void*)0);
+	glBindVertexArray(0);
+}
+
+void Mesh::SetInstanceBuffer(GLuint buffer, GLintptr offset) const
+{
+	if (!IsReady())
+		return;
+	glBindVertexArray(m_vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	// Two vec4 per instance, advancing once per instance rather than per vertex
+	const GLsizei stride = sizeof(glm::vec4) * 2;
+	glEnableVertexAttribArray(INSTANCE_POSITION_ATTRIB);
+	glVertexAttribPointer(INSTANCE_POSITION_ATTRIB, 4, GL_FLOAT, GL_FALSE, stride, (void*)offset);
+	glVertexAttribDivisor(INSTANCE_POSITION_ATTRIB, 1);
+	glEnableVertexAttribArray(INSTANCE_COLOR_ATTRIB);
+	glVertexAttribPointer(INSTANCE_COLOR_ATTRIB, 4, GL_FLOAT, GL_FALSE, stride, (void*)(offset + sizeof(glm::vec4)));
+	glVertexAttribDivisor(INSTANCE_COLOR_ATTRIB, 1);
+
+	glBindVertexArray(0);
+}
+
+void Mesh::DrawInstanced(GLsizei count) const
+{
+	if (!IsReady())
+		return;
 	glBindVertexArray(m_vao);
-	glDrawElements(GL_TRIANGLES, GLsizei(m_meshData.positions.faces.size()*3), GL_UNSIGNED_INT, (void*)0);
+	glDrawElementsInstanced(GL_TRIANGLES, m_indexCount, m_indexType, (void*)0, count);
 	glBindVertexArray(0);
 }
\ No newline at end of file
@@ -6,9 +6,11 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
-#include "OBJloader.h"
+#include "OBJLoader.h"
 
 // Simple mesh data specification, used to initialise a mesh
 struct MeshDataStream
@@ -25,11 +27,59 @@ struct MeshData
 	MeshDataStream normals;
 };
 
+// One vertex as the GPU reads it: position and normal interleaved
+struct MeshVertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+};
+
+// GPU-ready form of a mesh: every vertex has its own normal, and a flat triangle index list
+struct GpuMeshData
+{
+	std::vector<MeshVertex> vertices;
+	std::vector<uint32_t> indices;
+};
+
 MeshData MeshDataFromWavefrontObj(const char* filename);
 MeshData TetrahedronMeshData();
 MeshData PlaneMeshData();
+MeshData ImpostorQuadMeshData();
+
+struct MeshOptimizeStats;
+
+// Converts mesh data to what Mesh uploads, generating normals if there are none, and optimises it for drawing
+GpuMeshData CookMeshData(const MeshData& meshData, MeshOptimizeStats* stats = nullptr);
 
 
+// How a mesh is stored once uploaded
+struct MeshFormat
+{
+	bool halfPositions = false;		// Positions as 16-bit floats: 8 bytes instead of 12, precise enough for models of about unit size
+	bool octahedralNormals = false;	// Normals folded onto an octahedron and stored as two 16-bit integers: 4 bytes instead of 12
+	bool keepData = true;			// Keep the mesh data on the CPU after upload, e.g. for collision
+
+	// Smallest vertices (12 bytes instead of 24) and no CPU copy
+	static MeshFormat Compact() { return { true, true, false }; }
+};
+
+// Vertex and index buffers laid out for a format, ready to upload. Building one doesn't need the GL context, so it can
+// be done on a loader thread
+struct PackedMesh
+{
+	MeshFormat format;
+	std::vector<uint8_t> vertices;
+	std::vector<uint8_t> indices;
+	// Uploaded instead of the vectors when set, by Wrap: memory owned elsewhere, which must outlive the Upload
+	const void* externalVertices = nullptr;
+	size_t externalVertexBytes = 0;
+	const void* externalIndices = nullptr;
+	size_t externalIndexBytes = 0;
+	GLsizei indexCount = 0;
+	GLenum indexType = GL_UNSIGNED_INT;
+	std::shared_ptr<const MeshData> data;	// CPU copy, if the format keeps it
+};
+
 // Mesh class, with OpenGL-specific data
 class Mesh
 {
@@ -39,27 +89,76 @@ public:
 	Mesh() {}
 
 	// Mesh initialised with data
-	Mesh(const MeshData& meshData) { Init(meshData);  }
+	Mesh(const MeshData& meshData, const MeshFormat& format = MeshFormat()) { Init(meshData, format);  }
 
-	// Initialise the mesh given some vertices
-	void Init(const MeshData& meshData);
+	// Initialise the mesh given some vertices. The vertex buffer is interleaved in the given format
+	void Init(const MeshData& meshData, const MeshFormat& format = MeshFormat());
+
+	// Initialise the mesh straight from GPU-ready data, e.g. a memory-mapped cooked mesh. If the format keeps the data,
+	// Data() is rebuilt from these vertices
+	void Init(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices,
+		const MeshFormat& format = MeshFormat());
+
+	// Cooks and packs mesh data, or packs GPU-ready data, without touching OpenGL
+	static PackedMesh Pack(const MeshData& meshData, const MeshFormat& format = MeshFormat());
+	static PackedMesh Pack(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices,
+		const MeshFormat& format = MeshFormat());
+
+	// Like Pack, but in the default layout (full floats, no conversion needed) the buffers point at the given arrays
+	// instead of copying them, e.g. at the pages of a mapped cooked mesh. The arrays must then outlive the Upload
+	static PackedMesh Wrap(const MeshVertex* vertices, size_t numVertices, const uint32_t* indices, size_t numIndices,
+		const MeshFormat& format = MeshFormat());
+
+	// Creates the vertex array and buffers from packed data, on the GL thread. Init is Pack followed by Upload
+	void Upload(const PackedMesh& packed);
+
+	// False until the mesh is uploaded. Meshes that aren't ready draw nothing
+	bool IsReady() const { return m_vao != 0; }
 
 	// The actual draw call. We expect a shader to be bound and set-up accordingly
 	void DrawVertexArray() const;
 
-	const MeshData& Data() const { return m_meshData; }
+	// Attaches a per-instance buffer of (vec4 position/radius, vec4 color) to the vertex array, starting at a byte offset
+	void SetInstanceBuffer(GLuint buffer, GLintptr offset = 0) const;
+
+	// Draws count instances of the mesh in one call, reading the buffer given to SetInstanceBuffer
+	void DrawInstanced(GLsizei count) const;
+
+	// Attribute locations of the per-instance data
+	enum {
+		INSTANCE_POSITION_ATTRIB = 2,
+		INSTANCE_COLOR_ATTRIB = 3
+	};
+
+	// CPU copy of the mesh, empty if the format didn't keep it or it was released
+	const MeshData& Data() const;
+	// The same data, for users that hold on to it (e.g. collision shapes). Copies of a mesh share it rather than copy it
+	std::shared_ptr<const MeshData> SharedData() const { return m_meshData; }
+	// Frees the CPU copy once nothing else needs it; the GPU buffers stay
+	void ReleaseData() { m_meshData.reset(); }
+
+	const MeshFormat& Format() const { return m_format; }
 
 private:
 	enum {
-		POSITION_VB=0, // position vertex buffer
-		NORMAL_VB, // normal vertex buffer
+		VERTEX_VB=0, // interleaved position/normal vertex buffer
 		IB, // index buffer
 		NUM_BUFFERS
 	};
 
+	// Attribute locations of the vertex data. Octahedral normals have their own location after the instance data, so
+	// shaders can tell which one the mesh provides: the other reads as zero
+	enum {
+		POSITION_ATTRIB = 0,
+		NORMAL_ATTRIB = 1,
+		OCTAHEDRAL_NORMAL_ATTRIB = 4
+	};
+
 	GLuint m_vao=0; // vertex array object
 	GLuint m_buffers[NUM_BUFFERS] = {0,0}; // Buffer IDs. Initialise it to zeroes (==invalid buffer IDs)
+	GLsizei m_indexCount = 0;
+	GLenum m_indexType = GL_UNSIGNED_INT; // 16-bit when every vertex can be addressed with it
 
-	MeshData m_meshData;
+	MeshFormat m_format;
+	std::shared_ptr<const MeshData> m_meshData;
 };
-
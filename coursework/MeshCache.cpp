@@ -0,0 +1,161 @@
+#include "MeshCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace
+{
+	const char COOKED_MAGIC[4] = { 'P', 'B', 'A', 'M' };
+	// Bump when the layout of the file or of MeshVertex changes, or when cooking produces different data
+	const uint32_t COOKED_VERSION = 2;
+	// Vertex and index arrays start on this boundary
+	const size_t COOKED_ALIGNMENT = 16;
+
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		int64_t sourceTime;		// Modification time of the source, in file clock ticks
+		uint64_t sourceSize;
+		uint32_t levelCount;
+		uint32_t vertexSize;	// sizeof(MeshVertex) when written
+	};
+
+	struct LevelHeader
+	{
+		uint64_t vertexOffset;	// From the start of the file
+		uint64_t numVertices;
+		uint64_t indexOffset;
+		uint64_t numIndices;
+	};
+
+	std::string CookedPath(const std::string& sourcePath)
+	{
+		return sourcePath + ".cooked";
+	}
+
+	// Modification time and size of the source, false if it doesn't exist
+	bool SourceStamp(const std::string& sourcePath, int64_t& time, uint64_t& size)
+	{
+		std::error_code error;
+		auto writeTime = std::filesystem::last_write_time(sourcePath, error);
+		if (error)
+			return false;
+		auto fileSize = std::filesystem::file_size(sourcePath, error);
+		if (error)
+			return false;
+		time = int64_t(writeTime.time_since_epoch().count());
+		size = uint64_t(fileSize);
+		return true;
+	}
+
+	// True if count elements from offset on lie inside the file and are aligned, without overflowing on garbage counts
+	bool InFile(uint64_t offset, uint64_t count, size_t elementSize, size_t fileSize)
+	{
+		return offset % COOKED_ALIGNMENT == 0 && offset <= fileSize && count <= (fileSize - offset) / elementSize;
+	}
+
+	size_t Align(size_t offset)
+	{
+		return (offset + COOKED_ALIGNMENT - 1) / COOKED_ALIGNMENT * COOKED_ALIGNMENT;
+	}
+}
+
+bool CookedMesh::Open(const std::string& sourcePath)
+{
+	m_levels.clear();
+
+	int64_t time;
+	uint64_t size;
+	if (!SourceStamp(sourcePath, time, size) || !m_file.Open(CookedPath(sourcePath)))
+		return false;
+
+	const char* data = m_file.Data();
+	size_t fileSize = m_file.Size();
+	if (fileSize < sizeof(FileHeader))
+		return false;
+
+	FileHeader header;
+	std::memcpy(&header, data, sizeof(header));
+	bool valid = std::memcmp(header.magic, COOKED_MAGIC, sizeof(COOKED_MAGIC)) == 0
+		&& header.version == COOKED_VERSION
+		&& header.vertexSize == sizeof(MeshVertex)
+		&& header.sourceTime == time
+		&& header.sourceSize == size
+		&& sizeof(FileHeader) + header.levelCount * sizeof(LevelHeader) <= fileSize;
+	if (!valid)
+	{
+		m_file.Close();
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header.levelCount; i++)
+	{
+		LevelHeader level;
+		std::memcpy(&level, data + sizeof(FileHeader) + i * sizeof(LevelHeader), sizeof(level));
+		// Reject anything pointing outside the file, e.g. after a truncated copy
+		bool inFile = InFile(level.vertexOffset, level.numVertices, sizeof(MeshVertex), fileSize)
+			&& InFile(level.indexOffset, level.numIndices, sizeof(uint32_t), fileSize);
+		// and triangles that aren't whole or use vertices that don't exist, which would go straight to the draw call.
+		// This reads every index once, a small price next to uploading them
+		const uint32_t* indices = reinterpret_cast<const uint32_t*>(data + level.indexOffset);
+		if (!inFile || level.numIndices % 3 != 0
+			|| std::any_of(indices, indices + level.numIndices, [&level](uint32_t i) { return i >= level.numVertices; }))
+		{
+			m_levels.clear();
+			m_file.Close();
+			return false;
+		}
+		m_levels.push_back({ reinterpret_cast<const MeshVertex*>(data + level.vertexOffset), size_t(level.numVertices),
+			indices, size_t(level.numIndices) });
+	}
+	if (m_levels.empty())
+		m_file.Close();
+	return !m_levels.empty();
+}
+
+bool CookedMesh::Write(const std::string& sourcePath, const std::vector<GpuMeshData>& levels)
+{
+	FileHeader header;
+	std::memcpy(header.magic, COOKED_MAGIC, sizeof(COOKED_MAGIC));
+	header.version = COOKED_VERSION;
+	header.levelCount = uint32_t(levels.size());
+	header.vertexSize = uint32_t(sizeof(MeshVertex));
+	if (!SourceStamp(sourcePath, header.sourceTime, header.sourceSize))
+		return false;
+
+	// Lay the whole file out in memory first
+	std::vector<LevelHeader> levelHeaders(levels.size());
+	size_t offset = sizeof(FileHeader) + levels.size() * sizeof(LevelHeader);
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		auto& level = levelHeaders[i];
+		level.vertexOffset = Align(offset);
+		level.numVertices = levels[i].vertices.size();
+		level.indexOffset = Align(level.vertexOffset + level.numVertices * sizeof(MeshVertex));
+		level.numIndices = levels[i].indices.size();
+		offset = level.indexOffset + level.numIndices * sizeof(uint32_t);
+	}
+
+	std::vector<char> bytes(offset, 0);
+	std::memcpy(bytes.data(), &header, sizeof(header));
+	std::memcpy(bytes.data() + sizeof(header), levelHeaders.data(), levelHeaders.size() * sizeof(LevelHeader));
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		std::memcpy(bytes.data() + levelHeaders[i].vertexOffset, levels[i].vertices.data(), levels[i].vertices.size() * sizeof(MeshVertex));
+		std::memcpy(bytes.data() + levelHeaders[i].indexOffset, levels[i].indices.data(), levels[i].indices.size() * sizeof(uint32_t));
+	}
+
+	std::string path = CookedPath(sourcePath);
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.write(bytes.data(), std::streamsize(bytes.size())))
+			return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(tempPath, path, error);
+	return !error;
+}
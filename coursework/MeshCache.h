@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "MappedFile.h"
+#include "Mesh.h"
+
+// Cooked mesh files: every level of detail of a mesh in its GPU-ready form (interleaved vertices, 32-bit indices),
+// written next to the source as <source>.cooked on first load. The header records the source's modification time
+// and size, so editing the source invalidates the cooked file. Loading maps the file and uploads straight from the
+// mapped pages: no parsing, no normal generation and no intermediate copies.
+class CookedMesh
+{
+public:
+	// One level of detail, pointing into the mapped file
+	struct Level
+	{
+		const MeshVertex* vertices;
+		size_t numVertices;
+		const uint32_t* indices;
+		size_t numIndices;
+	};
+
+	// Maps the cooked file of sourcePath. False if there is none, or it is stale or damaged
+	bool Open(const std::string& sourcePath);
+
+	int LevelCount() const { return int(m_levels.size()); }
+	const Level& GetLevel(int i) const { return m_levels[i]; }
+
+	// Writes the cooked file of sourcePath with the given levels, in one write to a temporary file that is then
+	// renamed, so a crash never leaves a half-written cooked file behind
+	static bool Write(const std::string& sourcePath, const std::vector<GpuMeshData>& levels);
+
+private:
+	MappedFile m_file;
+	std::vector<Level> m_levels;
+};
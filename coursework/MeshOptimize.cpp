@@ -0,0 +1,378 @@
+#include "MeshOptimize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+using namespace glm;
+
+namespace
+{
+	const uint32_t NO_VERTEX = ~0u;
+
+	// Forsyth's scoring, tuned for an LRU cache of 32 entries
+	const int FORSYTH_CACHE_SIZE = 32;
+	const int MAX_VALENCE = 32;					// Valence scores are flat above this many remaining triangles
+	const float CACHE_DECAY_POWER = 1.5f;
+	const float LAST_TRIANGLE_SCORE = 0.75f;	// Vertices of the triangle just drawn; lower than the next ones, so strips don't run backwards
+	const float VALENCE_BOOST_SCALE = 2.0f;		// Favours vertices with few triangles left, so no lone triangles are left behind
+	const float VALENCE_BOOST_POWER = 0.5f;
+
+	// Size of the FIFO cache the miss ratio is measured with, and used to find the triangle clusters
+	const int FIFO_CACHE_SIZE = 32;
+	// A cluster may cost this much more in cache misses than the run it was cut from
+	const float OVERDRAW_THRESHOLD = 1.05f;
+
+	// Post-transform cache model: a vertex stays cached until FIFO size misses have happened after its own
+	class FifoCache
+	{
+	public:
+		FifoCache(size_t numVertices, int size) : m_stamps(numVertices, 0), m_time(size + 1), m_size(size) {}
+
+		// Number of vertices of the triangle that had to be transformed
+		int Triangle(const uint32_t* corners)
+		{
+			int misses = 0;
+			for (int j = 0; j < 3; j++)
+			{
+				uint32_t v = corners[j];
+				if (m_time - m_stamps[v] > uint32_t(m_size))
+				{
+					m_stamps[v] = m_time++;
+					misses++;
+				}
+			}
+			return misses;
+		}
+
+		// Empties the cache
+		void Flush() { m_time += m_size + 1; }
+
+	private:
+		std::vector<uint32_t> m_stamps;	// Time of each vertex's last miss
+		uint32_t m_time;				// Number of misses so far
+		int m_size;
+	};
+
+	struct ScoreTables
+	{
+		float cache[FORSYTH_CACHE_SIZE];
+		float valence[MAX_VALENCE];
+
+		ScoreTables()
+		{
+			for (int i = 0; i < FORSYTH_CACHE_SIZE; i++)
+				cache[i] = i < 3 ? LAST_TRIANGLE_SCORE
+					: std::pow(1.0f - float(i - 3) / float(FORSYTH_CACHE_SIZE - 3), CACHE_DECAY_POWER);
+			valence[0] = 0.0f;
+			for (int i = 1; i < MAX_VALENCE; i++)
+				valence[i] = VALENCE_BOOST_SCALE * std::pow(float(i), -VALENCE_BOOST_POWER);
+		}
+
+		float VertexScore(int cachePosition, uint32_t remaining) const
+		{
+			if (remaining == 0)
+				return -1.0f;	// Nothing left to draw with this vertex
+			float score = cachePosition < 0 ? 0.0f : cache[cachePosition];
+			return score + valence[std::min(remaining, uint32_t(MAX_VALENCE - 1))];
+		}
+	};
+
+	uint32_t HashVertex(const MeshVertex& v)
+	{
+		uint32_t bits[6];
+		std::memcpy(bits, &v, sizeof(bits));
+		uint32_t h = 2166136261u;
+		for (uint32_t b : bits)
+			h = (h ^ b) * 16777619u;
+		return h ^ (h >> 15);
+	}
+
+	// Merges vertices whose position and normal are bit-for-bit identical
+	void WeldVertices(GpuMeshData& mesh)
+	{
+		size_t numVertices = mesh.vertices.size();
+		size_t tableSize = 1;
+		while (tableSize < numVertices * 2)
+			tableSize <<= 1;
+		const size_t mask = tableSize - 1;
+
+		// Open addressing: each slot holds the index of a welded vertex
+		std::vector<uint32_t> table(tableSize, NO_VERTEX);
+		std::vector<uint32_t> remap(numVertices);
+		std::vector<MeshVertex> welded;
+		welded.reserve(numVertices);
+		for (size_t i = 0; i < numVertices; i++)
+		{
+			const MeshVertex& v = mesh.vertices[i];
+			size_t slot = HashVertex(v) & mask;
+			while (table[slot] != NO_VERTEX && std::memcmp(&welded[table[slot]], &v, sizeof(MeshVertex)) != 0)
+				slot = (slot + 1) & mask;
+			if (table[slot] == NO_VERTEX)
+			{
+				table[slot] = uint32_t(welded.size());
+				welded.push_back(v);
+			}
+			remap[i] = table[slot];
+		}
+
+		for (auto& index : mesh.indices)
+			index = remap[index];
+		mesh.vertices.swap(welded);
+	}
+
+	// Forsyth, "Linear-speed vertex cache optimisation" (2006). Triangles are emitted greedily: each vertex is scored by
+	// its position in a simulated LRU cache and by how many triangles still use it, and the next triangle is the best
+	// scoring one among those touching the cache. Only those triangles are rescored, so the whole pass is linear
+	void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t numVertices)
+	{
+		static const ScoreTables tables;
+		const size_t numTriangles = indices.size() / 3;
+
+		// Triangles of each vertex, as ranges of one array. The first live[v] of a range are the ones not drawn yet
+		std::vector<uint32_t> live(numVertices, 0);
+		for (uint32_t v : indices)
+			live[v]++;
+		std::vector<uint32_t> offsets(numVertices + 1, 0);
+		std::partial_sum(live.begin(), live.end(), offsets.begin() + 1);
+		std::vector<uint32_t> adjacency(indices.size());
+		{
+			std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+			for (size_t i = 0; i < indices.size(); i++)
+				adjacency[cursor[indices[i]]++] = uint32_t(i / 3);
+		}
+
+		std::vector<float> vertexScore(numVertices);
+		for (size_t v = 0; v < numVertices; v++)
+			vertexScore[v] = tables.VertexScore(-1, live[v]);
+		std::vector<float> triangleScore(numTriangles);
+		for (size_t t = 0; t < numTriangles; t++)
+			triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+
+		std::vector<char> emitted(numTriangles, 0);
+		std::vector<uint32_t> result;
+		result.reserve(indices.size());
+
+		uint32_t cache[FORSYTH_CACHE_SIZE + 3];
+		uint32_t newCache[FORSYTH_CACHE_SIZE + 3];
+		int cacheCount = 0;
+		size_t nextInOrder = 0;
+		int64_t best = std::max_element(triangleScore.begin(), triangleScore.end()) - triangleScore.begin();
+
+		while (result.size() < indices.size())
+		{
+			// Nothing in the cache has triangles left: carry on from the first triangle not drawn yet
+			if (best < 0)
+			{
+				while (emitted[nextInOrder])
+					nextInOrder++;
+				best = int64_t(nextInOrder);
+			}
+
+			const uint32_t* corners = &indices[best * 3];
+			emitted[best] = 1;
+			result.insert(result.end(), corners, corners + 3);
+
+			int newCount = 0;
+			for (int j = 0; j < 3; j++)
+			{
+				uint32_t v = corners[j];
+
+				// Take the triangle out of the vertex's live range
+				uint32_t* begin = &adjacency[offsets[v]];
+				uint32_t* last = begin + live[v] - 1;
+				*std::find(begin, last, uint32_t(best)) = *last;
+				*last = uint32_t(best);
+				live[v]--;
+
+				// The triangle's vertices go to the front of the cache
+				if (std::find(newCache, newCache + newCount, v) == newCache + newCount)
+					newCache[newCount++] = v;
+			}
+			for (int i = 0; i < cacheCount; i++)
+				if (std::find(corners, corners + 3, cache[i]) == corners + 3)
+					newCache[newCount++] = cache[i];
+
+			// Rescore everything that was in the cache, including what just fell out of it
+			for (int i = 0; i < newCount; i++)
+			{
+				uint32_t v = newCache[i];
+				float score = tables.VertexScore(i < FORSYTH_CACHE_SIZE ? i : -1, live[v]);
+				float delta = score - vertexScore[v];
+				vertexScore[v] = score;
+				for (uint32_t k = 0; k < live[v]; k++)
+					triangleScore[adjacency[offsets[v] + k]] += delta;
+			}
+
+			cacheCount = std::min(newCount, FORSYTH_CACHE_SIZE);
+			std::copy(newCache, newCache + cacheCount, cache);
+
+			// The best triangle is one of those using a cached vertex
+			best = -1;
+			float bestScore = -1.0f;
+			for (int i = 0; i < cacheCount; i++)
+			{
+				uint32_t v = cache[i];
+				for (uint32_t k = 0; k < live[v]; k++)
+				{
+					uint32_t t = adjacency[offsets[v] + k];
+					if (triangleScore[t] > bestScore)
+					{
+						bestScore = triangleScore[t];
+						best = t;
+					}
+				}
+			}
+		}
+
+		indices.swap(result);
+	}
+
+	// Sander, Nehab & Barczak, "Fast triangle reordering for vertex locality and reduced overdraw" (2007).
+	// The cache-ordered triangles are cut into clusters where the cache starts over anyway, and where a run has reached
+	// nearly the miss ratio of its whole cluster. The clusters facing away from the centre of the mesh are drawn first:
+	// they are the likeliest to hide the others
+	void OptimizeOverdraw(std::vector<uint32_t>& indices, const std::vector<MeshVertex>& vertices)
+	{
+		const uint32_t numTriangles = uint32_t(indices.size() / 3);
+		FifoCache cache(vertices.size(), FIFO_CACHE_SIZE);
+
+		// Hard boundaries: triangles where all three vertices miss
+		std::vector<uint32_t> hard;
+		for (uint32_t t = 0; t < numTriangles; t++)
+		{
+			int misses = cache.Triangle(&indices[t * 3]);
+			if (t == 0 || misses == 3)
+				hard.push_back(t);
+		}
+		hard.push_back(numTriangles);
+
+		// Soft boundaries: split each hard cluster as soon as a run is within the threshold of the cluster's miss ratio
+		std::vector<uint32_t> clusters;
+		for (size_t c = 0; c + 1 < hard.size(); c++)
+		{
+			uint32_t start = hard[c], end = hard[c + 1];
+			cache.Flush();
+			int clusterMisses = 0;
+			for (uint32_t t = start; t < end; t++)
+				clusterMisses += cache.Triangle(&indices[t * 3]);
+			float threshold = OVERDRAW_THRESHOLD * float(clusterMisses) / float(end - start);
+
+			cache.Flush();
+			clusters.push_back(start);
+			int misses = 0, faces = 0;
+			for (uint32_t t = start; t < end; t++)
+			{
+				misses += cache.Triangle(&indices[t * 3]);
+				faces++;
+				if (t + 1 < end && float(misses) <= threshold * float(faces))
+				{
+					clusters.push_back(t + 1);
+					cache.Flush();
+					misses = faces = 0;
+				}
+			}
+		}
+		clusters.push_back(numTriangles);
+		const size_t numClusters = clusters.size() - 1;
+
+		vec3 meshCentre(0.0f);
+		for (const auto& v : vertices)
+			meshCentre += v.position;
+		meshCentre /= float(std::max<size_t>(vertices.size(), 1));
+
+		// Sort key: how far the cluster lies along its own (area weighted) normal, from the centre of the mesh
+		std::vector<float> keys(numClusters);
+		for (size_t c = 0; c < numClusters; c++)
+		{
+			vec3 centroid(0.0f), normal(0.0f);
+			float area = 0.0f;
+			for (uint32_t t = clusters[c]; t < clusters[c + 1]; t++)
+			{
+				const vec3& a = vertices[indices[t * 3]].position;
+				const vec3& b = vertices[indices[t * 3 + 1]].position;
+				const vec3& d = vertices[indices[t * 3 + 2]].position;
+				vec3 n = cross(b - a, d - a);
+				float triangleArea = length(n);
+				centroid += (a + b + d) * (triangleArea / 3.0f);
+				normal += n;
+				area += triangleArea;
+			}
+			float normalLength = length(normal);
+			if (area > 0.0f && normalLength > 0.0f)
+				keys[c] = dot(centroid / area - meshCentre, normal / normalLength);
+		}
+
+		std::vector<uint32_t> order(numClusters);
+		std::iota(order.begin(), order.end(), 0u);
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] > keys[b]; });
+
+		std::vector<uint32_t> result;
+		result.reserve(indices.size());
+		for (uint32_t c : order)
+			result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+		indices.swap(result);
+	}
+
+	// Renumbers the vertices by first use and drops those no triangle uses
+	void OptimizeVertexFetch(GpuMeshData& mesh)
+	{
+		std::vector<uint32_t> remap(mesh.vertices.size(), NO_VERTEX);
+		std::vector<MeshVertex> ordered;
+		ordered.reserve(mesh.vertices.size());
+		for (auto& index : mesh.indices)
+		{
+			if (remap[index] == NO_VERTEX)
+			{
+				remap[index] = uint32_t(ordered.size());
+				ordered.push_back(mesh.vertices[index]);
+			}
+			index = remap[index];
+		}
+		mesh.vertices.swap(ordered);
+	}
+}
+
+float AverageCacheMissRatio(const std::vector<uint32_t>& indices, size_t numVertices, int cacheSize)
+{
+	size_t numTriangles = indices.size() / 3;
+	if (numTriangles == 0)
+		return 0.0f;
+
+	FifoCache cache(numVertices, cacheSize);
+	size_t misses = 0;
+	for (size_t t = 0; t < numTriangles; t++)
+		misses += cache.Triangle(&indices[t * 3]);
+	return float(misses) / float(numTriangles);
+}
+
+void OptimizeMesh(GpuMeshData& mesh, MeshOptimizeStats* stats)
+{
+	if (stats)
+	{
+		stats->verticesBefore = mesh.vertices.size();
+		stats->acmrBefore = AverageCacheMissRatio(mesh.indices, mesh.vertices.size(), FIFO_CACHE_SIZE);
+	}
+
+	if (!mesh.indices.empty())
+	{
+		WeldVertices(mesh);
+
+		// Small meshes can come in an order the LRU-tuned pass doesn't beat, e.g. straight out of the simplifier
+		std::vector<uint32_t> original = mesh.indices;
+		OptimizeVertexCache(mesh.indices, mesh.vertices.size());
+		OptimizeOverdraw(mesh.indices, mesh.vertices);
+		if (AverageCacheMissRatio(mesh.indices, mesh.vertices.size(), FIFO_CACHE_SIZE)
+			> AverageCacheMissRatio(original, mesh.vertices.size(), FIFO_CACHE_SIZE))
+			mesh.indices.swap(original);
+
+		OptimizeVertexFetch(mesh);
+	}
+
+	if (stats)
+	{
+		stats->verticesAfter = mesh.vertices.size();
+		stats->acmrAfter = AverageCacheMissRatio(mesh.indices, mesh.vertices.size(), FIFO_CACHE_SIZE);
+	}
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "Mesh.h"
+
+// What OptimizeMesh did, for reporting
+struct MeshOptimizeStats
+{
+	size_t verticesBefore = 0;
+	size_t verticesAfter = 0;
+	float acmrBefore = 0.0f;	// Average cache miss ratio: transformed vertices per triangle, between 0.5 and 3
+	float acmrAfter = 0.0f;
+};
+
+// Prepares GPU mesh data for drawing, in place:
+//	Welds vertices with identical position and normal, undoing the de-indexing of meshes with separate normal indices
+//	Orders the triangles for the post-transform vertex cache (Forsyth's linear-speed optimisation)
+//	Reorders clusters of triangles so that the outer ones come first, reducing overdraw (Sander et al. 2007)
+//	Renumbers the vertices in the order the triangles first use them, so vertex fetch walks memory forward
+void OptimizeMesh(GpuMeshData& mesh, MeshOptimizeStats* stats = nullptr);
+
+// Average cache miss ratio of an index list through a FIFO post-transform cache
+float AverageCacheMissRatio(const std::vector<uint32_t>& indices, size_t numVertices, int cacheSize = 32);
@@ -0,0 +1,253 @@
+#include "MeshSimplify.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+#include <unordered_map>
+
+using namespace glm;
+
+namespace
+{
+	// Symmetric 4x4 matrix of the plane equations, upper triangle only
+	struct Quadric
+	{
+		double q[10] = {};
+
+		// Quadric of the plane n.x + d = 0, weighted
+		static Quadric FromPlane(const dvec3& n, double d, double weight)
+		{
+			Quadric r;
+			r.q[0] = n.x * n.x; r.q[1] = n.x * n.y; r.q[2] = n.x * n.z; r.q[3] = n.x * d;
+			r.q[4] = n.y * n.y; r.q[5] = n.y * n.z; r.q[6] = n.y * d;
+			r.q[7] = n.z * n.z; r.q[8] = n.z * d;
+			r.q[9] = d * d;
+			for (auto& v : r.q)
+				v *= weight;
+			return r;
+		}
+
+		Quadric& operator+=(const Quadric& other)
+		{
+			for (int i = 0; i < 10; i++)
+				q[i] += other.q[i];
+			return *this;
+		}
+
+		// Sum of the weighted squared distances of p to the planes
+		double Error(const dvec3& p) const
+		{
+			return q[0] * p.x * p.x + 2.0 * q[1] * p.x * p.y + 2.0 * q[2] * p.x * p.z + 2.0 * q[3] * p.x
+				+ q[4] * p.y * p.y + 2.0 * q[5] * p.y * p.z + 2.0 * q[6] * p.y
+				+ q[7] * p.z * p.z + 2.0 * q[8] * p.z
+				+ q[9];
+		}
+
+		// Point of minimal error, if the quadric is not degenerate (e.g. flat or a straight ridge)
+		bool Minimum(dvec3& p) const
+		{
+			dmat3 a(q[0], q[1], q[2], q[1], q[4], q[5], q[2], q[5], q[7]);
+			double det = determinant(a);
+			if (std::abs(det) < 1e-12)
+				return false;
+			p = inverse(a) * -dvec3(q[3], q[6], q[8]);
+			return true;
+		}
+	};
+
+	struct Collapse
+	{
+		double cost;
+		int a, b;
+		int versionA, versionB;
+		dvec3 position;
+
+		bool operator>(const Collapse& other) const { return cost > other.cost; }
+	};
+
+	// Weight of the planes that keep open borders in place, relative to the surface planes
+	const double BORDER_WEIGHT = 100.0;
+	// Collapses may not turn a triangle's normal by more than ~80 degrees
+	const double MIN_NORMAL_DOT = 0.2;
+}
+
+MeshData SimplifyMesh(const MeshData& mesh, int targetFaces)
+{
+	const auto& faces = mesh.positions.faces;
+	int numVertices = int(mesh.positions.data.size());
+	int numFaces = int(faces.size());
+
+	std::vector<dvec3> positions(numVertices);
+	for (int v = 0; v < numVertices; v++)
+		positions[v] = dvec3(mesh.positions.data[v]);
+	std::vector<ivec3> tris(faces.begin(), faces.end());
+	std::vector<bool> faceAlive(numFaces, true);
+	std::vector<bool> vertexAlive(numVertices, true);
+	std::vector<int> version(numVertices, 0);
+	std::vector<std::vector<int>> vertexFaces(numVertices);
+
+	// Surface quadrics, weighted by triangle area
+	std::vector<Quadric> quadrics(numVertices);
+	for (int f = 0; f < numFaces; f++)
+	{
+		const ivec3& t = tris[f];
+		dvec3 n = cross(positions[t.y] - positions[t.x], positions[t.z] - positions[t.x]);
+		double area2 = length(n);
+		for (int k = 0; k < 3; k++)
+			vertexFaces[t[k]].push_back(f);
+		if (area2 == 0.0)
+			continue;
+		n /= area2;
+		Quadric plane = Quadric::FromPlane(n, -dot(n, positions[t.x]), 0.5 * area2);
+		for (int k = 0; k < 3; k++)
+			quadrics[t[k]] += plane;
+	}
+
+	// Edges used by a single triangle are on a border. They get a plane through the edge, perpendicular to the triangle
+	std::unordered_map<uint64_t, int> edgeUse;
+	auto edgeKey = [](int a, int b) { return (uint64_t(std::min(a, b)) << 32) | uint32_t(std::max(a, b)); };
+	for (const auto& t : tris)
+		for (int k = 0; k < 3; k++)
+			edgeUse[edgeKey(t[k], t[(k + 1) % 3])]++;
+	for (const auto& t : tris)
+	{
+		dvec3 faceNormal = cross(positions[t.y] - positions[t.x], positions[t.z] - positions[t.x]);
+		for (int k = 0; k < 3; k++)
+		{
+			int a = t[k], b = t[(k + 1) % 3];
+			if (edgeUse[edgeKey(a, b)] != 1)
+				continue;
+			dvec3 edge = positions[b] - positions[a];
+			dvec3 n = cross(edge, faceNormal);
+			double len = length(n);
+			if (len == 0.0)
+				continue;
+			n /= len;
+			Quadric plane = Quadric::FromPlane(n, -dot(n, positions[a]), BORDER_WEIGHT * dot(edge, edge));
+			quadrics[a] += plane;
+			quadrics[b] += plane;
+		}
+	}
+
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> heap;
+	auto pushEdge = [&](int a, int b)
+	{
+		Quadric q = quadrics[a];
+		q += quadrics[b];
+		Collapse c;
+		c.a = a; c.b = b;
+		c.versionA = version[a]; c.versionB = version[b];
+		if (!q.Minimum(c.position))
+		{
+			// Fall back to the best of the endpoints and the midpoint
+			dvec3 candidates[3] = { positions[a], positions[b], 0.5 * (positions[a] + positions[b]) };
+			c.position = *std::min_element(candidates, candidates + 3, [&](const dvec3& x, const dvec3& y) { return q.Error(x) < q.Error(y); });
+		}
+		c.cost = q.Error(c.position);
+		heap.push(c);
+	};
+	for (const auto& use : edgeUse)
+		pushEdge(int(use.first >> 32), int(use.first & 0xffffffffu));
+
+	// Would moving a and b to p flip or collapse any triangle that survives?
+	auto flips = [&](int a, int b, const dvec3& p)
+	{
+		for (int v : { a, b })
+			for (int f : vertexFaces[v])
+			{
+				if (!faceAlive[f])
+					continue;
+				const ivec3& t = tris[f];
+				bool hasA = t.x == a || t.y == a || t.z == a;
+				bool hasB = t.x == b || t.y == b || t.z == b;
+				if (hasA && hasB)
+					continue; // Removed by the collapse
+				dvec3 before[3], after[3];
+				for (int k = 0; k < 3; k++)
+				{
+					before[k] = positions[t[k]];
+					after[k] = t[k] == v ? p : before[k];
+				}
+				dvec3 n0 = cross(before[1] - before[0], before[2] - before[0]);
+				dvec3 n1 = cross(after[1] - after[0], after[2] - after[0]);
+				double l0 = length(n0), l1 = length(n1);
+				if (l1 == 0.0 || (l0 > 0.0 && dot(n0, n1) < MIN_NORMAL_DOT * l0 * l1))
+					return true;
+			}
+		return false;
+	};
+
+	int liveFaces = numFaces;
+	std::vector<int> neighbours;
+	while (liveFaces > targetFaces && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+		// Entries go stale when either end moved since they were pushed
+		if (!vertexAlive[c.a] || !vertexAlive[c.b] || version[c.a] != c.versionA || version[c.b] != c.versionB)
+			continue;
+		if (flips(c.a, c.b, c.position))
+			continue;
+
+		// Merge b into a
+		int a = c.a, b = c.b;
+		positions[a] = c.position;
+		quadrics[a] += quadrics[b];
+		vertexAlive[b] = false;
+		version[a]++;
+
+		for (int f : vertexFaces[b])
+		{
+			if (!faceAlive[f])
+				continue;
+			ivec3& t = tris[f];
+			if (t.x == a || t.y == a || t.z == a)
+			{
+				faceAlive[f] = false;
+				liveFaces--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+				if (t[k] == b)
+					t[k] = a;
+			vertexFaces[a].push_back(f);
+		}
+		vertexFaces[b].clear();
+
+		auto& adjacent = vertexFaces[a];
+		adjacent.erase(std::remove_if(adjacent.begin(), adjacent.end(), [&](int f) { return !faceAlive[f]; }), adjacent.end());
+
+		// The costs of every edge around a changed
+		neighbours.clear();
+		for (int f : adjacent)
+			for (int k = 0; k < 3; k++)
+				if (tris[f][k] != a)
+					neighbours.push_back(tris[f][k]);
+		std::sort(neighbours.begin(), neighbours.end());
+		neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+		for (int n : neighbours)
+			pushEdge(a, n);
+	}
+
+	// Compact the surviving vertices and triangles
+	MeshData out;
+	std::vector<int> remap(numVertices, -1);
+	for (int f = 0; f < numFaces; f++)
+	{
+		if (!faceAlive[f])
+			continue;
+		ivec3 t;
+		for (int k = 0; k < 3; k++)
+		{
+			int v = tris[f][k];
+			if (remap[v] < 0)
+			{
+				remap[v] = int(out.positions.data.size());
+				out.positions.data.push_back(vec3(positions[v]));
+			}
+			t[k] = remap[v];
+		}
+		out.positions.faces.push_back(t);
+	}
+	return out;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "Mesh.h"
+
+// Quadric error metric simplification (Garland & Heckbert 1997).
+// Every vertex accumulates the squared distance to the planes of its triangles; edges are collapsed cheapest first,
+// moving the merged vertex to where the summed quadric is smallest. Open borders get extra planes so the outline is
+// kept, and collapses that would flip a triangle are skipped.
+// Only positions are kept: the result has no normals, so they are regenerated when it is uploaded.
+MeshData SimplifyMesh(const MeshData& mesh, int targetFaces);
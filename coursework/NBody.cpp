@@ -0,0 +1,288 @@
+#include "NBody.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+
+#include "Parallel.h"
+
+using namespace glm;
+
+const int MORTON_BITS = 10;	// Bits per axis, so a code fits in 30 bits and the tree is at most 10 levels deep
+
+// Spreads the lower 10 bits of v so that there are two zero bits between each
+static uint32_t ExpandBits(uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Interleaves x,y,z so that each octree digit is (x,y,z) from most to least significant bit
+static uint32_t MortonCode(const vec3& unitPos)
+{
+	const float cells = float(1 << MORTON_BITS);
+	uvec3 c = uvec3(clamp(unitPos * cells, vec3(0.0f), vec3(cells - 1.0f)));
+	return (ExpandBits(c.x) << 2) | (ExpandBits(c.y) << 1) | ExpandBits(c.z);
+}
+
+void BarnesHut::Build(const std::vector<vec3>& positions, const std::vector<float>& masses)
+{
+	int n = int(positions.size());
+	m_nodes.clear();
+	m_levels.clear();
+	if (n == 0)
+	{
+		// Nothing of the last build may be left for ComputeAccelerations to walk
+		m_codes.clear();
+		m_order.clear();
+		m_positions.clear();
+		m_masses.clear();
+		return;
+	}
+
+	// Bounding cube of the bodies
+	vec3 lo = positions[0], hi = positions[0];
+	for (const auto& p : positions)
+	{
+		lo = min(lo, p);
+		hi = max(hi, p);
+	}
+	vec3 extent = hi - lo;
+	m_rootSize = std::max(std::max(extent.x, std::max(extent.y, extent.z)), 1e-3f) * 1.001f;
+	m_rootMin = lo;
+
+	// Morton codes, then sort the bodies along the curve
+	std::vector<uint32_t> codes(n);
+	ParallelFor(n, [&](int i) { codes[i] = MortonCode((positions[i] - m_rootMin) / m_rootSize); });
+
+	m_order.resize(n);
+	std::iota(m_order.begin(), m_order.end(), 0);
+	std::sort(m_order.begin(), m_order.end(), [&](int a, int b) { return codes[a] < codes[b]; });
+
+	m_codes.resize(n);
+	m_positions.resize(n);
+	m_masses.resize(n);
+	ParallelFor(n, [&](int i)
+		{
+			m_codes[i] = codes[m_order[i]];
+			m_positions[i] = positions[m_order[i]];
+			m_masses[i] = masses[m_order[i]];
+		});
+
+	// Topology, top-down
+	Node root;
+	root.halfSize = 0.5f * m_rootSize;
+	root.centre = m_rootMin + vec3(root.halfSize);
+	root.begin = 0;
+	root.end = n;
+	m_nodes.push_back(root);
+	BuildNode(0);
+
+	// Mass and centre of mass, bottom-up: every node of a level only reads its children, one level below
+	for (int depth = int(m_levels.size()) - 1; depth >= 0; depth--)
+	{
+		const auto& level = m_levels[depth];
+		ParallelFor(int(level.size()), [&](int k)
+			{
+				Node& node = m_nodes[level[k]];
+				float mass = 0.0f;
+				vec3 weighted(0.0f);
+				if (node.childCount == 0)
+				{
+					for (int i = node.begin; i < node.end; i++)
+					{
+						mass += m_masses[i];
+						weighted += m_masses[i] * m_positions[i];
+					}
+				}
+				else
+				{
+					for (int c = node.firstChild; c < node.firstChild + node.childCount; c++)
+					{
+						mass += m_nodes[c].mass;
+						weighted += m_nodes[c].mass * m_nodes[c].centreOfMass;
+					}
+				}
+				node.mass = mass;
+				node.centreOfMass = mass > 0.0f ? weighted / mass : node.centre;
+			}, 64);
+	}
+}
+
+// Splits a node's range of sorted bodies by the next octree digit of their Morton codes
+void BarnesHut::BuildNode(int nodeIndex)
+{
+	int depth = m_nodes[nodeIndex].depth;
+	if (int(m_levels.size()) <= depth)
+		m_levels.resize(depth + 1);
+	m_levels[depth].push_back(nodeIndex);
+
+	int begin = m_nodes[nodeIndex].begin;
+	int end = m_nodes[nodeIndex].end;
+	if (end - begin <= m_leafSize || depth == MORTON_BITS)
+		return;
+
+	int shift = 3 * (MORTON_BITS - 1 - depth);
+	float childHalf = 0.5f * m_nodes[nodeIndex].halfSize;
+	vec3 centre = m_nodes[nodeIndex].centre;
+
+	int firstChild = int(m_nodes.size());
+	int childCount = 0;
+	int childBegin = begin;
+	for (uint32_t digit = 0; digit < 8 && childBegin < end; digit++)
+	{
+		// Codes are sorted, so the bodies with this digit form a contiguous range
+		int childEnd = int(std::partition_point(m_codes.begin() + childBegin, m_codes.begin() + end,
+			[&](uint32_t code) { return ((code >> shift) & 7u) <= digit; }) - m_codes.begin());
+		if (childEnd == childBegin)
+			continue;
+
+		Node child;
+		child.halfSize = childHalf;
+		child.centre = centre + childHalf * vec3((digit & 4) ? 1.0f : -1.0f, (digit & 2) ? 1.0f : -1.0f, (digit & 1) ? 1.0f : -1.0f);
+		child.begin = childBegin;
+		child.end = childEnd;
+		child.depth = depth + 1;
+		m_nodes.push_back(child);
+		childCount++;
+		childBegin = childEnd;
+	}
+
+	m_nodes[nodeIndex].firstChild = firstChild;
+	m_nodes[nodeIndex].childCount = childCount;
+	for (int c = firstChild; c < firstChild + childCount; c++)
+		BuildNode(c);
+}
+
+vec3 BarnesHut::AccelerationAt(int sortedIndex) const
+{
+	const vec3 pos = m_positions[sortedIndex];
+	const float eps2 = m_softening * m_softening;
+	const float theta2 = m_theta * m_theta;
+
+	vec3 accel(0.0f);
+	int stack[8 * (MORTON_BITS + 1)];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0)
+	{
+		const Node& node = m_nodes[stack[--top]];
+		vec3 d = node.centreOfMass - pos;
+		float dist2 = dot(d, d);
+		float size = 2.0f * node.halfSize;
+		bool containsBody = sortedIndex >= node.begin && sortedIndex < node.end;
+
+		if (!containsBody && size * size < theta2 * dist2)
+		{
+			// Far enough: the whole cell acts as one point mass
+			float r2 = dist2 + eps2;
+			accel += node.mass * d / (r2 * std::sqrt(r2));
+		}
+		else if (node.childCount == 0)
+		{
+			for (int i = node.begin; i < node.end; i++)
+			{
+				if (i == sortedIndex)
+					continue;
+				vec3 dj = m_positions[i] - pos;
+				float r2 = dot(dj, dj) + eps2;
+				accel += m_masses[i] * dj / (r2 * std::sqrt(r2));
+			}
+		}
+		else
+		{
+			for (int c = node.firstChild; c < node.firstChild + node.childCount; c++)
+				stack[top++] = c;
+		}
+	}
+	return m_g * accel;
+}
+
+void BarnesHut::ComputeAccelerations(std::vector<vec3>& accelerations) const
+{
+	if (m_nodes.empty())
+	{
+		accelerations.clear();
+		return;
+	}
+
+	int n = int(m_positions.size());
+	accelerations.resize(n);
+	// Walk the bodies in Morton order, so neighbouring threads traverse similar parts of the tree
+	ParallelFor(n, [&](int i) { accelerations[m_order[i]] = AccelerationAt(i); }, 64);
+}
+
+void BarnesHut::BruteForceAccelerations(const std::vector<vec3>& positions, const std::vector<float>& masses, std::vector<vec3>& accelerations) const
+{
+	int n = int(positions.size());
+	const float eps2 = m_softening * m_softening;
+	accelerations.resize(n);
+	ParallelFor(n, [&](int i)
+		{
+			vec3 accel(0.0f);
+			for (int j = 0; j < n; j++)
+			{
+				if (j == i)
+					continue;
+				vec3 d = positions[j] - positions[i];
+				float r2 = dot(d, d) + eps2;
+				accel += masses[j] * d / (r2 * std::sqrt(r2));
+			}
+			accelerations[i] = m_g * accel;
+		}, 64);
+}
+
+void BarnesHut::RunBenchmark(int numBodies)
+{
+	using Clock = std::chrono::high_resolution_clock;
+
+	// Random bodies in a unit ball, denser towards the centre
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+	std::vector<vec3> positions;
+	std::vector<float> masses(numBodies, 1.0f / numBodies);
+	while (int(positions.size()) < numBodies)
+	{
+		vec3 p(uniform(rng), uniform(rng), uniform(rng));
+		if (dot(p, p) <= 1.0f)
+			positions.push_back(p * dot(p, p));
+	}
+
+	BarnesHut tree;
+	tree.SetSoftening(0.01f);
+
+	std::vector<vec3> reference;
+	auto start = Clock::now();
+	tree.BruteForceAccelerations(positions, masses, reference);
+	double bruteMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+	std::cout << "Barnes-Hut benchmark, " << numBodies << " bodies, " << WorkerCount() << " threads" << std::endl;
+	std::cout << "brute force: " << bruteMs << " ms" << std::endl;
+
+	for (float theta : { 0.2f, 0.35f, 0.5f, 0.7f, 1.0f })
+	{
+		tree.SetTheta(theta);
+		std::vector<vec3> approx;
+		start = Clock::now();
+		tree.Build(positions, masses);
+		tree.ComputeAccelerations(approx);
+		double treeMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+		double errorSum = 0.0;
+		for (int i = 0; i < numBodies; i++)
+		{
+			vec3 diff = approx[i] - reference[i];
+			errorSum += double(dot(diff, diff)) / std::max(double(dot(reference[i], reference[i])), 1e-30);
+		}
+		double rmsError = std::sqrt(errorSum / numBodies);
+
+		std::cout << "theta " << theta << ": " << treeMs << " ms (" << bruteMs / treeMs << "x), "
+			<< tree.NodeCount() << " nodes, RMS relative error " << rmsError << std::endl;
+	}
+}
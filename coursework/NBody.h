@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Barnes-Hut approximation of the mutual gravitational attraction between N bodies.
+// The tree is a linear octree built every step from the bodies sorted by Morton code: each node covers a contiguous
+// range of the sorted bodies. Mass and centre of mass are computed bottom-up, one tree level at a time in parallel.
+// Far away nodes whose size over distance is below the opening angle theta are treated as a single point mass,
+// which brings the cost from O(n^2) down to O(n log n).
+class BarnesHut
+{
+public:
+	void SetTheta(float theta) { m_theta = theta; }
+	float Theta() const { return m_theta; }
+	void SetGravitationalConstant(float g) { m_g = g; }
+	void SetSoftening(float softening) { m_softening = softening; }
+
+	// Builds the octree over the given bodies
+	void Build(const std::vector<glm::vec3>& positions, const std::vector<float>& masses);
+
+	// Gravitational acceleration of every body, in the order the bodies were given to Build
+	void ComputeAccelerations(std::vector<glm::vec3>& accelerations) const;
+
+	// Exact O(n^2) reference, used to measure the error of the approximation
+	void BruteForceAccelerations(const std::vector<glm::vec3>& positions, const std::vector<float>& masses, std::vector<glm::vec3>& accelerations) const;
+
+	// Times Build + ComputeAccelerations for several opening angles against the brute force on a random cloud of bodies,
+	// and prints the speed-up and RMS relative error of each
+	static void RunBenchmark(int numBodies);
+
+	int NodeCount() const { return int(m_nodes.size()); }
+
+private:
+	struct Node
+	{
+		glm::vec3 centreOfMass = glm::vec3(0.0f);
+		float mass = 0.0f;
+		glm::vec3 centre = glm::vec3(0.0f);	// Geometric centre of the cell
+		float halfSize = 0.0f;
+		int firstChild = -1;				// Children are stored contiguously
+		int childCount = 0;
+		int begin = 0, end = 0;				// Range of sorted bodies inside the cell
+		int depth = 0;
+	};
+
+	void BuildNode(int nodeIndex);
+	glm::vec3 AccelerationAt(int sortedIndex) const;
+
+	float m_theta = 0.5f;
+	float m_g = 1.0f;
+	float m_softening = 0.1f;
+	int m_leafSize = 8;
+
+	std::vector<Node> m_nodes;
+	std::vector<std::vector<int>> m_levels;	// Node indices per depth
+
+	// Bodies sorted by Morton code
+	std::vector<uint32_t> m_codes;
+	std::vector<int> m_order;
+	std::vector<glm::vec3> m_positions;
+	std::vector<float> m_masses;
+	glm::vec3 m_rootMin = glm::vec3(0.0f);
+	float m_rootSize = 1.0f;
+};
@@ -1,405 +1,421 @@
 #include "OBJLoader.h"
-#include <fstream>
-#include <iostream>
 #include <algorithm>
-#include <map>
+#include <cstdint>
+#include <iostream>
 
-static bool CompareOBJIndexPtr(const OBJIndex* a, const OBJIndex* b);
-static inline unsigned int FindNextChar(unsigned int start, const char* str, unsigned int length, char token);
-static inline unsigned int ParseOBJIndexValue(const std::string& token, unsigned int start, unsigned int end);
-static inline float ParseOBJFloatValue(const std::string& token, unsigned int start, unsigned int end);
-static inline std::vector<std::string> SplitString(const std::string &s, char delim);
+#include "MappedFile.h"
+#include "Parallel.h"
 
-OBJModel::OBJModel(const std::string& fileName)
+namespace
 {
-	hasUVs = false;
-	hasNormals = false;
-	std::ifstream file;
-	file.open(fileName.c_str());
+	// Chunks smaller than this are not worth a thread
+	const size_t MIN_CHUNK_BYTES = 1 << 20;
 
-	std::string line;
-	if (file.is_open())
-	{
-		while (file.good())
-		{
-			getline(file, line);
-
-			unsigned int lineLength = line.length();
+	const unsigned int NO_INDEX = ~0u;
 
-			if (lineLength < 2)
-				continue;
+	// One line-aligned slice of the file, and how many elements of each kind it holds
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+		glm::uvec4 counts = glm::uvec4(0);	// Vertices, uvs, normals, triangle corners
+	};
 
-			const char* lineCStr = line.c_str();
+	inline bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+	inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
 
-			switch (lineCStr[0])
-			{
-			case 'v':
-				if (lineCStr[1] == 't')
-					this->uvs.push_back(ParseOBJVec2(line));
-				else if (lineCStr[1] == 'n')
-					this->normals.push_back(ParseOBJVec3(line));
-				else if (lineCStr[1] == ' ' || lineCStr[1] == '\t')
-					this->vertices.push_back(ParseOBJVec3(line));
-				break;
-			case 'f':
-				CreateOBJFace(line);
-				break;
-			default: break;
-			};
-		}
-	}
-	else
+	inline const char* SkipSpaces(const char* p, const char* end)
 	{
-		std::cerr << "Unable to load mesh: " << fileName << std::endl;
+		while (p < end && IsSpace(*p))
+			p++;
+		return p;
 	}
-}
 
-void IndexedModel::CalcNormals()
-{
-	for (unsigned int i = 0; i < indices.size(); i += 3)
+	inline const char* SkipLine(const char* p, const char* end)
 	{
-		int i0 = indices[i];
-		int i1 = indices[i + 1];
-		int i2 = indices[i + 2];
-
-		glm::vec3 v1 = positions[i1] - positions[i0];
-		glm::vec3 v2 = positions[i2] - positions[i0];
-
-		glm::vec3 normal = glm::normalize(glm::cross(v1, v2));
-
-		normals[i0] += normal;
-		normals[i1] += normal;
-		normals[i2] += normal;
+		while (p < end && *p != '\n')
+			p++;
+		return p < end ? p + 1 : end;
 	}
 
-	for (unsigned int i = 0; i < positions.size(); i++)
-		normals[i] = glm::normalize(normals[i]);
-}
-
-IndexedModel OBJModel::ToIndexedModel()
-{
-	IndexedModel result;
-	IndexedModel normalModel;
-
-	unsigned int numIndices = OBJIndices.size();
-
-	std::vector<OBJIndex*> indexLookup;
-
-	for (unsigned int i = 0; i < numIndices; i++)
-		indexLookup.push_back(&OBJIndices[i]);
-
-	std::sort(indexLookup.begin(), indexLookup.end(), CompareOBJIndexPtr);
-
-	std::map<OBJIndex, unsigned int> normalModelIndexMap;
-	std::map<unsigned int, unsigned int> indexMap;
-
-	for (unsigned int i = 0; i < numIndices; i++)
+	// Decimal float with optional sign, fraction and exponent. Much faster than strtof as it doesn't deal with locales,
+	// hex or infinities, and accurate to the last bit or so for the 6-9 significant digits OBJ exporters write
+	const char* ParseFloat(const char* p, const char* end, float& value)
 	{
-		OBJIndex* currentIndex = &OBJIndices[i];
-
-		glm::vec3 currentPosition = vertices[currentIndex->vertexIndex];
-		glm::vec2 currentTexCoord;
-		glm::vec3 currentNormal;
-
-		if (hasUVs)
-			currentTexCoord = uvs[currentIndex->uvIndex];
-		else
-			currentTexCoord = glm::vec2(0, 0);
-
-		if (hasNormals)
-			currentNormal = normals[currentIndex->normalIndex];
-		else
-			currentNormal = glm::vec3(0, 0, 0);
-
-		unsigned int normalModelIndex;
-		unsigned int resultModelIndex;
-
-		//Create model to properly generate normals on
-		std::map<OBJIndex, unsigned int>::iterator it = normalModelIndexMap.find(*currentIndex);
-		if (it == normalModelIndexMap.end())
+		static const double POWERS_OF_TEN[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+		p = SkipSpaces(p, end);
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		uint64_t mantissa = 0;
+		int exponent = 0;
+		int digits = 0;
+		for (; p < end && IsDigit(*p); p++)
 		{
-			normalModelIndex = normalModel.positions.size();
-
-			normalModelIndexMap.insert(std::pair<OBJIndex, unsigned int>(*currentIndex, normalModelIndex));
-			normalModel.positions.push_back(currentPosition);
-			normalModel.texCoords.push_back(currentTexCoord);
-			normalModel.normals.push_back(currentNormal);
+			// Past 18 digits the mantissa would overflow, and the extra digits don't matter for a float anyway
+			if (digits < 18) { mantissa = mantissa * 10 + uint64_t(*p - '0'); digits += mantissa != 0; }
+			else exponent++;
 		}
-		else
-			normalModelIndex = it->second;
+		if (p < end && *p == '.')
+			for (p++; p < end && IsDigit(*p); p++)
+				if (digits < 18) { mantissa = mantissa * 10 + uint64_t(*p - '0'); digits += mantissa != 0; exponent--; }
 
-		//Create model which properly separates texture coordinates
-		unsigned int previousVertexLocation = FindLastVertexIndex(indexLookup, currentIndex, result);
-
-		if (previousVertexLocation == (unsigned int)-1)
+		if (p < end && (*p == 'e' || *p == 'E'))
 		{
-			resultModelIndex = result.positions.size();
-
-			result.positions.push_back(currentPosition);
-			result.texCoords.push_back(currentTexCoord);
-			result.normals.push_back(currentNormal);
+			p++;
+			bool negativeExponent = false;
+			if (p < end && (*p == '-' || *p == '+'))
+				negativeExponent = *p++ == '-';
+			int e = 0;
+			for (; p < end && IsDigit(*p); p++)
+				e = std::min(e * 10 + (*p - '0'), 1000);
+			exponent += negativeExponent ? -e : e;
 		}
-		else
-			resultModelIndex = previousVertexLocation;
 
-		normalModel.indices.push_back(normalModelIndex);
-		result.indices.push_back(resultModelIndex);
-		indexMap.insert(std::pair<unsigned int, unsigned int>(resultModelIndex, normalModelIndex));
+		double result = double(mantissa);
+		int absExponent = std::abs(exponent);
+		double scale = 1.0;
+		for (; absExponent > 22; absExponent -= 22)
+			scale *= 1e22;
+		scale *= POWERS_OF_TEN[absExponent];
+		result = exponent < 0 ? result / scale : result * scale;
+		value = float(negative ? -result : result);
+		return p;
 	}
 
-	if (!hasNormals)
+	inline const char* ParseInt(const char* p, const char* end, int& value)
 	{
-		normalModel.CalcNormals();
-
-		for (unsigned int i = 0; i < result.positions.size(); i++)
-			result.normals[i] = normalModel.normals[indexMap[i]];
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		int result = 0;
+		for (; p < end && IsDigit(*p); p++)
+			result = result * 10 + (*p - '0');
+		value = negative ? -result : result;
+		return p;
 	}
 
-	return result;
-};
-
-unsigned int OBJModel::FindLastVertexIndex(const std::vector<OBJIndex*>& indexLookup, const OBJIndex* currentIndex, const IndexedModel& result)
-{
-	unsigned int start = 0;
-	unsigned int end = indexLookup.size();
-	unsigned int current = (end - start) / 2 + start;
-	unsigned int previous = start;
-
-	while (current != previous)
+	// 0-based index of an OBJ index: 1-based from the start of the file, or negative from the last element read so far.
+	// 0 (absent) becomes NO_INDEX
+	inline unsigned int ResolveIndex(int index, unsigned int count)
 	{
-		OBJIndex* testIndex = indexLookup[current];
+		if (index > 0)
+			return unsigned(index - 1);
+		return index < 0 ? unsigned(int(count) + index) : NO_INDEX;
+	}
 
-		if (testIndex->vertexIndex == currentIndex->vertexIndex)
+	// v, v/vt, v//vn or v/vt/vn. counts are the numbers of vertices, uvs and normals before this line in the file
+	inline const char* ParseCorner(const char* p, const char* end, const glm::uvec4& counts, OBJIndex& corner)
+	{
+		int v = 0, vt = 0, vn = 0;
+		p = ParseInt(p, end, v);
+		if (p < end && *p == '/')
 		{
-			unsigned int countStart = current;
-
-			for (unsigned int i = 0; i < current; i++)
-			{
-				OBJIndex* possibleIndex = indexLookup[current - i];
+			p++;
+			if (p < end && *p != '/')
+				p = ParseInt(p, end, vt);
+			if (p < end && *p == '/')
+				p = ParseInt(p + 1, end, vn);
+		}
+		corner = { ResolveIndex(v, counts.x), ResolveIndex(vt, counts.y), ResolveIndex(vn, counts.z) };
+		return p;
+	}
 
-				if (possibleIndex == currentIndex)
-					continue;
+	// True if the corner only refers to elements already read: counts are the numbers of vertices, uvs and normals
+	// before its line. Catches 0, forward references and negative indices reaching past the start of the file
+	inline bool InRange(const OBJIndex& corner, const glm::uvec4& counts)
+	{
+		return corner.vertexIndex < counts.x
+			&& (corner.uvIndex == NO_INDEX || corner.uvIndex < counts.y)
+			&& (corner.normalIndex == NO_INDEX || corner.normalIndex < counts.z);
+	}
 
-				if (possibleIndex->vertexIndex != currentIndex->vertexIndex)
-					break;
+	inline bool IsCornerStart(char c) { return IsDigit(c) || c == '-'; }
 
-				countStart--;
-			}
+	// Calls onCorner(corner) for each corner of the face record at p (just past the 'f'), and returns the end of the
+	// last one. Both passes scan faces with this, so they always agree on the number of corners
+	template<typename OnCorner>
+	inline const char* ScanFace(const char* p, const char* end, const glm::uvec4& counts, const OnCorner& onCorner)
+	{
+		// Corners must be separated by whitespace; anything else ends the face
+		while (p < end && IsSpace(*p))
+		{
+			p = SkipSpaces(p, end);
+			if (p >= end || !IsCornerStart(*p))
+				break;
+			OBJIndex corner;
+			p = ParseCorner(p, end, counts, corner);
+			onCorner(corner);
+		}
+		return p;
+	}
 
-			for (unsigned int i = countStart; i < indexLookup.size() - countStart; i++)
+	// First pass: counts the elements of each kind in a chunk, so the second pass can write them in place
+	void CountChunk(Chunk& chunk)
+	{
+		const char* p = chunk.begin;
+		const char* end = chunk.end;
+		glm::uvec4 counts(0);
+		while (p < end)
+		{
+			p = SkipSpaces(p, end);
+			if (p + 1 < end)
 			{
-				OBJIndex* possibleIndex = indexLookup[current + i];
-
-				if (possibleIndex == currentIndex)
-					continue;
-
-				if (possibleIndex->vertexIndex != currentIndex->vertexIndex)
-					break;
-				else if ((!hasUVs || possibleIndex->uvIndex == currentIndex->uvIndex)
-					&& (!hasNormals || possibleIndex->normalIndex == currentIndex->normalIndex))
+				if (p[0] == 'v' && IsSpace(p[1]))
+					counts.x++;
+				else if (p[0] == 'v' && p[1] == 't')
+					counts.y++;
+				else if (p[0] == 'v' && p[1] == 'n')
+					counts.z++;
+				else if (p[0] == 'f' && IsSpace(p[1]))
 				{
-					glm::vec3 currentPosition = vertices[currentIndex->vertexIndex];
-					glm::vec2 currentTexCoord;
-					glm::vec3 currentNormal;
+					// A polygon of n corners makes n - 2 triangles
+					unsigned numCorners = 0;
+					p = ScanFace(p + 1, end, counts, [&](const OBJIndex&) { numCorners++; });
+					if (numCorners >= 3)
+						counts.w += 3 * (numCorners - 2);
+				}
+			}
+			p = SkipLine(p, end);
+		}
+		chunk.counts = counts;
+	}
 
-					if (hasUVs)
-						currentTexCoord = uvs[currentIndex->uvIndex];
-					else
-						currentTexCoord = glm::vec2(0, 0);
+	// Second pass: parses a chunk straight into the model's arrays. counts holds where the chunk's elements start.
+	// Returns false if a face refers to an element that doesn't exist
+	bool ParseChunk(const Chunk& chunk, glm::uvec4 counts, OBJModel& model)
+	{
+		bool valid = true;
+		const char* p = chunk.begin;
+		const char* end = chunk.end;
+		OBJIndex polygon[3];
 
-					if (hasNormals)
-						currentNormal = normals[currentIndex->normalIndex];
-					else
-						currentNormal = glm::vec3(0, 0, 0);
+		while (p < end)
+		{
+			p = SkipSpaces(p, end);
+			if (p + 1 >= end)
+				break;
 
-					for (unsigned int j = 0; j < result.positions.size(); j++)
+			if (p[0] == 'v' && IsSpace(p[1]))
+			{
+				glm::vec3& v = model.vertices[counts.x++];
+				p = ParseFloat(p + 2, end, v.x);
+				p = ParseFloat(p, end, v.y);
+				p = ParseFloat(p, end, v.z);
+			}
+			else if (p[0] == 'v' && p[1] == 't')
+			{
+				glm::vec2& uv = model.uvs[counts.y++];
+				p = ParseFloat(p + 2, end, uv.x);
+				p = ParseFloat(p, end, uv.y);
+			}
+			else if (p[0] == 'v' && p[1] == 'n')
+			{
+				glm::vec3& n = model.normals[counts.z++];
+				p = ParseFloat(p + 2, end, n.x);
+				p = ParseFloat(p, end, n.y);
+				p = ParseFloat(p, end, n.z);
+			}
+			else if (p[0] == 'f' && IsSpace(p[1]))
+			{
+				// Fan triangulation: (0, 1, 2), (0, 2, 3), ...
+				int numCorners = 0;
+				p = ScanFace(p + 1, end, counts, [&](const OBJIndex& corner)
 					{
-						if (currentPosition == result.positions[j]
-							&& ((!hasUVs || currentTexCoord == result.texCoords[j])
-								&& (!hasNormals || currentNormal == result.normals[j])))
+						if (!InRange(corner, counts))
+							valid = false;
+						if (numCorners < 2)
+							polygon[numCorners] = corner;
+						else
 						{
-							return j;
+							polygon[2] = corner;
+							std::copy(polygon, polygon + 3, model.OBJIndices.begin() + counts.w);
+							counts.w += 3;
+							polygon[1] = corner;
 						}
-					}
-				}
+						numCorners++;
+					});
 			}
-
-			return -1;
-		}
-		else
-		{
-			if (testIndex->vertexIndex < currentIndex->vertexIndex)
-				start = current;
-			else
-				end = current;
+			p = SkipLine(p, end);
 		}
-
-		previous = current;
-		current = (end - start) / 2 + start;
+		return valid;
 	}
 
-	return -1;
-}
-
-void OBJModel::CreateOBJFace(const std::string& line)
-{
-	std::vector<std::string> tokens = SplitString(line, ' ');
-
-	this->OBJIndices.push_back(ParseOBJIndex(tokens[1], &this->hasUVs, &this->hasNormals));
-	this->OBJIndices.push_back(ParseOBJIndex(tokens[2], &this->hasUVs, &this->hasNormals));
-	this->OBJIndices.push_back(ParseOBJIndex(tokens[3], &this->hasUVs, &this->hasNormals));
-
-	if ((int)tokens.size() > 4)
+	// Mix of the uv and normal indices, to spread the corners sharing a position over that position's slots
+	inline uint32_t HashAttributes(const OBJIndex& c)
 	{
-		this->OBJIndices.push_back(ParseOBJIndex(tokens[1], &this->hasUVs, &this->hasNormals));
-		this->OBJIndices.push_back(ParseOBJIndex(tokens[3], &this->hasUVs, &this->hasNormals));
-		this->OBJIndices.push_back(ParseOBJIndex(tokens[4], &this->hasUVs, &this->hasNormals));
+		uint64_t h = (uint64_t(c.uvIndex) << 32 | c.normalIndex) * 0x9E3779B97F4A7C15ull;
+		return uint32_t(h >> 40);
 	}
 }
 
-OBJIndex OBJModel::ParseOBJIndex(const std::string& token, bool* hasUVs, bool* hasNormals)
-{
-	unsigned int tokenLength = token.length();
-	const char* tokenString = token.c_str();
-
-	unsigned int vertIndexStart = 0;
-	unsigned int vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, '/');
-
-	OBJIndex result;
-	result.vertexIndex = ParseOBJIndexValue(token, vertIndexStart, vertIndexEnd);
-	result.uvIndex = 0;
-	result.normalIndex = 0;
-
-	if (vertIndexEnd >= tokenLength)
-		return result;
-
-	vertIndexStart = vertIndexEnd + 1;
-	vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, '/');
-
-	result.uvIndex = ParseOBJIndexValue(token, vertIndexStart, vertIndexEnd);
-	*hasUVs = true;
-
-	if (vertIndexEnd >= tokenLength)
-		return result;
-
-	vertIndexStart = vertIndexEnd + 1;
-	vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, '/');
-
-	result.normalIndex = ParseOBJIndexValue(token, vertIndexStart, vertIndexEnd);
-	*hasNormals = true;
-
-	return result;
-}
-
-glm::vec3 OBJModel::ParseOBJVec3(const std::string& line)
+OBJModel::OBJModel(const std::string& fileName)
 {
-	unsigned int tokenLength = line.length();
-	const char* tokenString = line.c_str();
-
-	unsigned int vertIndexStart = 2;
+	hasUVs = false;
+	hasNormals = false;
 
-	while (vertIndexStart < tokenLength)
+	MappedFile file;
+	if (!file.Open(fileName))
 	{
-		if (tokenString[vertIndexStart] != ' ')
-			break;
-		vertIndexStart++;
+		std::cerr << "Unable to load mesh: " << fileName << std::endl;
+		return;
 	}
 
-	unsigned int vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, ' ');
-
-	float x = ParseOBJFloatValue(line, vertIndexStart, vertIndexEnd);
-
-	vertIndexStart = vertIndexEnd + 1;
-	vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, ' ');
-
-	float y = ParseOBJFloatValue(line, vertIndexStart, vertIndexEnd);
-
-	vertIndexStart = vertIndexEnd + 1;
-	vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, ' ');
-
-	float z = ParseOBJFloatValue(line, vertIndexStart, vertIndexEnd);
-
-	return glm::vec3(x, y, z);
-
-	//glm::vec3(atof(tokens[1].c_str()), atof(tokens[2].c_str()), atof(tokens[3].c_str()))
-}
-
-glm::vec2 OBJModel::ParseOBJVec2(const std::string& line)
-{
-	unsigned int tokenLength = line.length();
-	const char* tokenString = line.c_str();
-
-	unsigned int vertIndexStart = 3;
-
-	while (vertIndexStart < tokenLength)
+	// One chunk per worker, with boundaries moved forward to the next line start
+	const char* data = file.Data();
+	const char* dataEnd = data + file.Size();
+	size_t numChunks = std::max<size_t>(1, std::min<size_t>(WorkerCount(), file.Size() / MIN_CHUNK_BYTES));
+	std::vector<Chunk> chunks(numChunks);
+	const char* begin = data;
+	for (size_t c = 0; c < numChunks; c++)
 	{
-		if (tokenString[vertIndexStart] != ' ')
-			break;
-		vertIndexStart++;
+		const char* end = c + 1 == numChunks ? dataEnd : data + file.Size() * (c + 1) / numChunks;
+		end = std::max(end, std::max(begin, data + 1));
+		while (end < dataEnd && end[-1] != '\n')
+			end++;
+		chunks[c].begin = begin;
+		chunks[c].end = end;
+		begin = end;
 	}
 
-	unsigned int vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, ' ');
-
-	float x = ParseOBJFloatValue(line, vertIndexStart, vertIndexEnd);
+	ParallelFor(int(numChunks), [&](int c) { CountChunk(chunks[c]); }, 1);
 
-	vertIndexStart = vertIndexEnd + 1;
-	vertIndexEnd = FindNextChar(vertIndexStart, tokenString, tokenLength, ' ');
+	// Where each chunk's elements go in the arrays
+	std::vector<glm::uvec4> offsets(numChunks + 1, glm::uvec4(0));
+	for (size_t c = 0; c < numChunks; c++)
+		offsets[c + 1] = offsets[c] + chunks[c].counts;
 
-	float y = ParseOBJFloatValue(line, vertIndexStart, vertIndexEnd);
+	const glm::uvec4& total = offsets[numChunks];
+	vertices.resize(total.x);
+	uvs.resize(total.y);
+	normals.resize(total.z);
+	OBJIndices.resize(total.w);
 
-	return glm::vec2(x, y);
-}
+	std::vector<char> chunkValid(numChunks);
+	ParallelFor(int(numChunks), [&](int c) { chunkValid[c] = ParseChunk(chunks[c], offsets[c], *this); }, 1);
+	if (std::find(chunkValid.begin(), chunkValid.end(), 0) != chunkValid.end())
+	{
+		// Nothing may index the arrays with these faces, so the model is left empty
+		std::cerr << "Invalid face index in mesh: " << fileName << std::endl;
+		vertices.clear();
+		uvs.clear();
+		normals.clear();
+		OBJIndices.clear();
+		return;
+	}
 
-static bool CompareOBJIndexPtr(const OBJIndex* a, const OBJIndex* b)
-{
-	return a->vertexIndex < b->vertexIndex;
+	// A file either has uvs/normals on every corner or is treated as having none
+	hasUVs = !uvs.empty() && std::all_of(OBJIndices.begin(), OBJIndices.end(), [](const OBJIndex& i) { return i.uvIndex != NO_INDEX; });
+	hasNormals = !normals.empty() && std::all_of(OBJIndices.begin(), OBJIndices.end(), [](const OBJIndex& i) { return i.normalIndex != NO_INDEX; });
 }
 
-static inline unsigned int FindNextChar(unsigned int start, const char* str, unsigned int length, char token)
+void IndexedModel::CalcNormals()
 {
-	unsigned int result = start;
-	while (result < length)
+	for (unsigned int i = 0; i < indices.size(); i += 3)
 	{
-		result++;
-		if (str[result] == token)
-			break;
-	}
+		int i0 = indices[i];
+		int i1 = indices[i + 1];
+		int i2 = indices[i + 2];
 
-	return result;
-}
+		glm::vec3 v1 = positions[i1] - positions[i0];
+		glm::vec3 v2 = positions[i2] - positions[i0];
 
-static inline unsigned int ParseOBJIndexValue(const std::string& token, unsigned int start, unsigned int end)
-{
-	return atoi(token.substr(start, end - start).c_str()) - 1;
-}
+		glm::vec3 normal = glm::normalize(glm::cross(v1, v2));
 
-static inline float ParseOBJFloatValue(const std::string& token, unsigned int start, unsigned int end)
-{
-	return atof(token.substr(start, end - start).c_str());
+		normals[i0] += normal;
+		normals[i1] += normal;
+		normals[i2] += normal;
+	}
+
+	for (unsigned int i = 0; i < positions.size(); i++)
+		normals[i] = glm::normalize(normals[i]);
 }
 
-static inline std::vector<std::string> SplitString(const std::string &s, char delim)
+IndexedModel OBJModel::ToIndexedModel()
 {
-	std::vector<std::string> elems;
-
-	const char* cstr = s.c_str();
-	unsigned int strLength = s.length();
-	unsigned int start = 0;
-	unsigned int end = 0;
-
-	while (end <= strLength)
+	IndexedModel result;
+	size_t numIndices = OBJIndices.size();
+	result.indices.resize(numIndices);
+	result.positions.reserve(vertices.size());
+
+	// Open addressing with linear probing, kept at most half full. The table is split into one block of slots per
+	// position, in position order, and a corner hashes into its position's block. Faces that are close in the file use
+	// close positions, so unlike a fully random hash the probes stay in cache. Each slot keeps its corner next to the
+	// vertex index, so a probe costs one cache line
+	struct Slot
+	{
+		OBJIndex corner;
+		unsigned int vertex;
+	};
+	std::vector<Slot> slots;
+	std::vector<OBJIndex> uniqueCorners;
+	uniqueCorners.reserve(vertices.size());
+	int blockShift = 1;		// log2 of the slots per position
+	size_t mask = 0;
+
+	auto insert = [&](const OBJIndex& corner, unsigned int vertex)
+	{
+		size_t s = ((size_t(corner.vertexIndex) << blockShift) + (HashAttributes(corner) & ((1u << blockShift) - 1))) & mask;
+		while (slots[s].vertex != NO_INDEX && !(slots[s].corner == corner))
+			s = (s + 1) & mask;
+		if (slots[s].vertex == NO_INDEX)
+			slots[s] = { corner, vertex };
+		return slots[s].vertex;
+	};
+	auto resize = [&]()
 	{
-		while (end <= strLength)
+		size_t capacity = 16;
+		while (capacity < (vertices.size() << blockShift))
+			capacity *= 2;
+		slots.assign(capacity, Slot{ { 0, 0, 0 }, NO_INDEX });
+		mask = capacity - 1;
+		for (size_t v = 0; v < uniqueCorners.size(); v++)
+			insert(uniqueCorners[v], unsigned(v));
+	};
+	resize();
+
+	for (size_t i = 0; i < numIndices; i++)
+	{
+		OBJIndex corner = OBJIndices[i];
+		// Ignore whichever attribute the model as a whole doesn't have
+		if (!hasUVs)
+			corner.uvIndex = NO_INDEX;
+		if (!hasNormals)
+			corner.normalIndex = NO_INDEX;
+
+		unsigned int next = unsigned(uniqueCorners.size());
+		unsigned int vertex = insert(corner, next);
+		if (vertex == next)
 		{
-			if (cstr[end] == delim)
-				break;
-			end++;
+			uniqueCorners.push_back(corner);
+			if (uniqueCorners.size() * 2 > slots.size())
+			{
+				blockShift++;
+				resize();
+			}
 		}
-
-		elems.push_back(s.substr(start, end - start));
-		start = end + 1;
-		end = start;
+		result.indices[i] = vertex;
 	}
 
-	return elems;
-}
\ No newline at end of file
+	size_t numVertices = uniqueCorners.size();
+	result.positions.resize(numVertices);
+	result.texCoords.resize(numVertices, glm::vec2(0.0f));
+	result.normals.resize(numVertices, glm::vec3(0.0f));
+	ParallelFor(int(numVertices), [&](int v)
+		{
+			const OBJIndex& corner = uniqueCorners[v];
+			result.positions[v] = vertices[corner.vertexIndex];
+			if (hasUVs)
+				result.texCoords[v] = uvs[corner.uvIndex];
+			if (hasNormals)
+				result.normals[v] = normals[corner.normalIndex];
+		}, 4096);
+
+	if (!hasNormals)
+		result.CalcNormals();
+
+	return result;
+}
@@ -5,13 +5,14 @@
 #include <vector>
 #include <string>
 
+// Indices of one face corner in the file's arrays, 0-based. uvIndex/normalIndex are -1 when the corner has none
 struct OBJIndex
 {
 	unsigned int vertexIndex;
 	unsigned int uvIndex;
 	unsigned int normalIndex;
 
-	bool operator<(const OBJIndex& r) const { return vertexIndex < r.vertexIndex; }
+	bool operator==(const OBJIndex& r) const { return vertexIndex == r.vertexIndex && uvIndex == r.uvIndex && normalIndex == r.normalIndex; }
 };
 
 class IndexedModel
@@ -25,10 +26,15 @@ public:
 	void CalcNormals();
 };
 
+// Wavefront OBJ file (v, vt, vn and f records; polygons are triangulated as fans).
+// The file is memory-mapped and split at line boundaries into one chunk per worker. A first parallel pass counts the
+// elements of each chunk; a second one parses every chunk straight into its place in the arrays, with a hand-written
+// number parser. Negative (relative) indices are supported. A file whose faces refer to elements that don't exist
+// (index 0, forward references, negative indices past the start) is rejected and leaves the model empty.
 class OBJModel
 {
 public:
-	std::vector<OBJIndex> OBJIndices;
+	std::vector<OBJIndex> OBJIndices;	// Three per triangle
 	std::vector<glm::vec3> vertices;
 	std::vector<glm::vec2> uvs;
 	std::vector<glm::vec3> normals;
@@ -37,14 +43,9 @@ public:
 
 	OBJModel(const std::string& fileName);
 
+	// One vertex per distinct (v, vt, vn) triplet, found with an open-addressing hash table.
+	// Normals are generated if the file has none
 	IndexedModel ToIndexedModel();
-private:
-	unsigned int FindLastVertexIndex(const std::vector<OBJIndex*>& indexLookup, const OBJIndex* currentIndex, const IndexedModel& result);
-	void CreateOBJFace(const std::string& line);
-
-	glm::vec2 ParseOBJVec2(const std::string& line);
-	glm::vec3 ParseOBJVec3(const std::string& line);
-	OBJIndex ParseOBJIndex(const std::string& token, bool* hasUVs, bool* hasNormals);
 };
 
-#endif // OBJ_LOADER_H_INCLUDED
\ No newline at end of file
+#endif // OBJ_LOADER_H_INCLUDED
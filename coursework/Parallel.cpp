@@ -0,0 +1,84 @@
+#include "Parallel.h"
+
+WorkerPool& WorkerPool::Instance()
+{
+	static WorkerPool pool;
+	return pool;
+}
+
+WorkerPool::WorkerPool()
+{
+	for (int t = 1; t < WorkerCount(); t++)
+		m_threads.emplace_back([this]() { WorkerLoop(); });
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+void WorkerPool::Run(int numChunks, void (*call)(void*, int), void* context)
+{
+	Job job;
+	job.call = call;
+	job.context = context;
+	job.numChunks = numChunks;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(&job);
+	}
+	// The calling thread takes one chunk, the others are for whoever wakes first
+	for (int c = 1; c < numChunks; c++)
+		m_wake.notify_one();
+
+	for (int chunk; (chunk = job.next.fetch_add(1)) < numChunks; )
+	{
+		call(context, chunk);
+		job.done.fetch_add(1);
+	}
+	Finish(job);
+}
+
+void WorkerPool::Finish(Job& job)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	// Every chunk has been handed out, so once the job is off the queue no other thread can pick it up. The job lives on
+	// the caller's stack: only the chunks already running still refer to it
+	auto it = std::find(m_jobs.begin(), m_jobs.end(), &job);
+	if (it != m_jobs.end())
+		m_jobs.erase(it);
+	m_finished.wait(lock, [&job]() { return job.done.load() == job.numChunks; });
+}
+
+void WorkerPool::WorkerLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_wake.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+		if (m_stop)
+			return;
+
+		Job* job = m_jobs.front();
+		int chunk = job->next.fetch_add(1);
+		if (chunk + 1 >= job->numChunks)
+			m_jobs.pop_front();
+		if (chunk >= job->numChunks)
+			continue;
+
+		int numChunks = job->numChunks;
+		lock.unlock();
+		job->call(job->context, chunk);
+		// The job may be gone as soon as done reaches numChunks, so this is the last time it is touched
+		bool last = job->done.fetch_add(1) + 1 == numChunks;
+		lock.lock();
+		if (last)
+			m_finished.notify_all();
+	}
+}
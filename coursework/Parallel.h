@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of worker threads used by the parallel helpers below, the calling thread included. Queried once, as every
+// parallel loop asks
+inline int WorkerCount()
+{
+	static const int count = std::max(1, int(std::thread::hardware_concurrency()));
+	return count;
+}
+
+// WorkerCount() - 1 threads, started on first use and shared by every thread that runs parallel loops (physics,
+// rendering, asset loading), so a loop costs a wake-up instead of a thread creation, and loops running at the same time
+// on different threads don't add threads of their own.
+// A loop is split into a fixed number of chunks. The calling thread works through them too, and only waits for the
+// chunks other threads have already started, so loops can be nested and never wait on a queued chunk
+class WorkerPool
+{
+public:
+	static WorkerPool& Instance();
+
+	// Calls call(context, chunk) for every chunk in [0, numChunks) and returns once all have finished
+	void Run(int numChunks, void (*call)(void*, int), void* context);
+
+	~WorkerPool();
+
+private:
+	struct Job
+	{
+		void (*call)(void*, int);
+		void* context;
+		int numChunks;
+		std::atomic<int> next{ 0 };		// Next chunk to hand out
+		std::atomic<int> done{ 0 };		// Chunks finished
+	};
+
+	WorkerPool();
+	void WorkerLoop();
+	void Finish(Job& job);
+
+	std::vector<std::thread> m_threads;
+	std::deque<Job*> m_jobs;			// With chunks left to hand out
+	std::mutex m_mutex;
+	std::condition_variable m_wake;		// A job was queued, or the pool is stopping
+	std::condition_variable m_finished;	// A job's last chunk finished
+	bool m_stop = false;
+};
+
+// Splits [0, count) into one contiguous chunk per worker and calls func(begin, end) for each chunk.
+// Ranges smaller than minPerThread run inline, as handing them to the workers would cost more than the work itself.
+template<typename Func>
+void ParallelForChunks(int count, const Func& func, int minPerThread = 256)
+{
+	if (count <= 0)
+		return;
+
+	int numChunks = std::min(WorkerCount(), (count + minPerThread - 1) / minPerThread);
+	if (numChunks <= 1)
+	{
+		func(0, count);
+		return;
+	}
+
+	struct Context
+	{
+		const Func& func;
+		int count;
+		int chunkSize;
+	} context{ func, count, (count + numChunks - 1) / numChunks };
+
+	WorkerPool::Instance().Run(numChunks, [](void* data, int chunk)
+		{
+			const Context& c = *static_cast<const Context*>(data);
+			int begin = chunk * c.chunkSize;
+			int end = std::min(c.count, begin + c.chunkSize);
+			if (begin < end)
+				c.func(begin, end);
+		}, &context);
+}
+
+// Calls func(i) for every i in [0, count), spread across the workers
+template<typename Func>
+void ParallelFor(int count, const Func& func, int minPerThread = 256)
+{
+	ParallelForChunks(count, [&func](int begin, int end)
+		{
+			for (int i = begin; i < end; i++)
+				func(i);
+		}, minPerThread);
+}
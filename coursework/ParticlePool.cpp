@@ -0,0 +1,155 @@
+#include "ParticlePool.h"
+
+#include <algorithm>
+#include <initializer_list>
+
+#include "Checkpoint.h"
+#include "Parallel.h"
+#include "StateHash.h"
+
+ParticleHandle ParticlePool::Add(const Particle& particle)
+{
+	uint32_t slot;
+	if (!m_free.empty())
+	{
+		slot = m_free.back();
+		m_free.pop_back();
+	}
+	else
+	{
+		slot = uint32_t(m_slots.size());
+		m_slots.push_back({ -1, 0 });
+	}
+
+	m_slots[slot].index = int32_t(m_particles.size());
+	m_particles.push_back(particle);
+	m_particles.back().SetId(int(slot));
+	return { slot, m_slots[slot].generation };
+}
+
+Particle* ParticlePool::AddBatch(int count, const Particle& prototype, ParticleHandle* handles)
+{
+	size_t first = m_particles.size();
+	m_particles.resize(first + count, prototype);
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t slot;
+		if (!m_free.empty())
+		{
+			slot = m_free.back();
+			m_free.pop_back();
+		}
+		else
+		{
+			slot = uint32_t(m_slots.size());
+			m_slots.push_back({ -1, 0 });
+		}
+		m_slots[slot].index = int32_t(first + i);
+		m_particles[first + i].SetId(int(slot));
+		if (handles)
+			handles[i] = { slot, m_slots[slot].generation };
+	}
+	return m_particles.data() + first;
+}
+
+bool ParticlePool::Remove(ParticleHandle handle)
+{
+	if (!Alive(handle))
+		return false;
+
+	// The last particle fills the hole, so the array stays dense
+	Slot& slot = m_slots[handle.slot];
+	int32_t last = int32_t(m_particles.size()) - 1;
+	if (slot.index != last)
+	{
+		m_particles[slot.index] = m_particles[last];
+		m_slots[m_particles[slot.index].Id()].index = slot.index;
+	}
+	m_particles.pop_back();
+	m_firstAdded = std::min(m_firstAdded, int(m_particles.size()));
+
+	slot.index = -1;
+	slot.generation++;
+	m_retired.push_back(handle.slot);
+	return true;
+}
+
+void ParticlePool::Reindex()
+{
+	ParallelFor(int(m_particles.size()), [&](int i)
+		{
+			m_slots[m_particles[i].Id()].index = int32_t(i);
+		}, 4096);
+	m_firstAdded = int(m_particles.size());
+}
+
+void ParticlePool::Recycle()
+{
+	m_free.insert(m_free.end(), m_retired.begin(), m_retired.end());
+	m_retired.clear();
+}
+
+void ParticlePool::Clear()
+{
+	m_particles.clear();
+	m_slots.clear();
+	m_free.clear();
+	m_retired.clear();
+	m_firstAdded = 0;
+}
+
+void ParticlePool::Reserve(size_t count)
+{
+	m_particles.reserve(count);
+	m_slots.reserve(count);
+	m_free.reserve(count);
+	m_retired.reserve(count);
+}
+
+void ParticlePool::SaveState(CheckpointWriter& out) const
+{
+	out.WriteVector(m_slots);
+	out.WriteVector(m_free);
+	out.WriteVector(m_retired);
+	out.Write(m_firstAdded);
+}
+
+bool ParticlePool::LoadState(CheckpointReader& in)
+{
+	if (!in.ReadVector(m_slots) || !in.ReadVector(m_free) || !in.ReadVector(m_retired) || !in.Read(m_firstAdded)
+		|| m_firstAdded < 0 || m_firstAdded > int(m_particles.size()))
+		return false;
+
+	// Every particle in its own slot, and every other slot either free or retired, listed once
+	size_t numSlots = m_slots.size();
+	if (m_particles.size() + m_free.size() + m_retired.size() != numSlots)
+		return false;
+	for (size_t i = 0; i < m_particles.size(); i++)
+	{
+		int id = m_particles[i].Id();
+		if (id < 0 || size_t(id) >= numSlots || m_slots[id].index != int32_t(i))
+			return false;
+	}
+	bool valid = true;
+	for (const auto* list : { &m_free, &m_retired })
+		for (uint32_t slot : *list)
+		{
+			if (slot >= numSlots || m_slots[slot].index != -1)
+				valid = false;
+			else
+				m_slots[slot].index = -2;	// Marked while checking, to catch duplicates
+		}
+	for (const auto* list : { &m_free, &m_retired })
+		for (uint32_t slot : *list)
+			if (slot < numSlots)
+				m_slots[slot].index = -1;
+	return valid;
+}
+
+void ParticlePool::HashState(StateHash& hash) const
+{
+	hash.Add(m_slots);
+	hash.Add(m_free);
+	hash.Add(m_retired);
+	hash.Add(uint64_t(m_firstAdded));
+}
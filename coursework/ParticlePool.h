@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "PhysicsObject.h"
+
+// Fwd declaration
+class CheckpointWriter;
+class CheckpointReader;
+class StateHash;
+
+// Stable reference to a particle. Particles move around in their array (the per-step sort, removals), so anything
+// that holds on to one keeps a handle instead. The generation tells a removed particle from a later one in its slot
+struct ParticleHandle
+{
+	uint32_t slot = UINT32_MAX;
+	uint32_t generation = 0;
+
+	// Unique over the whole run, unlike the slot (the particle's id), which later particles reuse
+	uint64_t Key() const { return uint64_t(slot) << 32 | generation; }
+
+	bool operator==(const ParticleHandle& other) const { return slot == other.slot && generation == other.generation; }
+	bool operator!=(const ParticleHandle& other) const { return !(*this == other); }
+};
+
+// The particles in one dense array for the solvers to sweep, plus a table from slot to array index for the handles.
+// A particle's id is its slot, so ids stay below SlotCount() and can index per-particle arrays directly.
+// Adding takes a free slot and appends, removing moves the last particle into the hole: both are O(1), and neither
+// allocates once the arrays have grown to the peak count.
+class ParticlePool
+{
+public:
+	// Copies the particle in, sets its id and returns its handle
+	ParticleHandle Add(const Particle& particle);
+	// Adds count copies of prototype at once and returns the first, to be filled in place (positions, velocities...).
+	// Their ids are set and must be kept. The handles are written to handles, if not null
+	Particle* AddBatch(int count, const Particle& prototype, ParticleHandle* handles);
+	// False if the handle is stale, i.e. the particle was already removed
+	bool Remove(ParticleHandle handle);
+
+	bool Alive(ParticleHandle handle) const
+	{
+		return handle.slot < m_slots.size() && m_slots[handle.slot].generation == handle.generation && m_slots[handle.slot].index >= 0;
+	}
+	// nullptr for a stale handle. Only valid until the particles are next reordered
+	Particle* Get(ParticleHandle handle) { return Alive(handle) ? &m_particles[m_slots[handle.slot].index] : nullptr; }
+	// Handle of the particle at an index of the array
+	ParticleHandle Handle(int index) const
+	{
+		uint32_t slot = uint32_t(m_particles[index].Id());
+		return { slot, m_slots[slot].generation };
+	}
+
+	int SlotCount() const { return int(m_slots.size()); }
+	bool SlotAlive(int slot) const { return m_slots[slot].index >= 0; }
+	ParticleHandle SlotHandle(int slot) const { return { uint32_t(slot), m_slots[slot].generation }; }
+	// The particle with id slot, which must be alive
+	const Particle& InSlot(int slot) const { return m_particles[m_slots[slot].index]; }
+
+	// Must be called whenever the array has been reordered (sorted), to point the slots at the new indices
+	void Reindex();
+	// The particles from this index on were added since the last Reindex, in no particular order, so a sort only
+	// has to sort them and merge them in
+	int FirstAdded() const { return m_firstAdded; }
+	// Makes the slots removed since the last call available again. Called once per step, so a removed particle's id
+	// isn't given to a new one within the same step: the contact history and the render snapshot still mention it
+	void Recycle();
+	void Clear();
+	void Reserve(size_t count);
+
+	std::vector<Particle>& Particles() { return m_particles; }
+	const std::vector<Particle>& Particles() const { return m_particles; }
+
+	// The slot table, free lists and where the unsorted particles start; the particles themselves are saved by the
+	// engine. LoadState must be called after Particles() has been filled, and checks that the two agree
+	void SaveState(CheckpointWriter& out) const;
+	bool LoadState(CheckpointReader& in);
+	void HashState(StateHash& hash) const;
+
+private:
+	struct Slot
+	{
+		int32_t index;			// In m_particles, -1 while the slot is free
+		uint32_t generation;	// Incremented on every removal, so older handles no longer match
+	};
+
+	std::vector<Particle> m_particles;
+	std::vector<Slot> m_slots;
+	std::vector<uint32_t> m_free;		// Reused last in, first out
+	std::vector<uint32_t> m_retired;	// Removed since the last Recycle
+	int m_firstAdded = 0;
+};
@@ -1,12 +1,17 @@
 #include "PhysicsEngine.h"
 
+#include <algorithm>
+#include <cmath>
 #include <map>
 #include <numeric>
 #include <unordered_set>
 
 #include "Application.h"
 #include "Camera.h"
+#include "Checkpoint.h"
 #include "Force.h"
+#include "Parallel.h"
+#include "StateHash.h"
 
 #include <glm/gtx/matrix_cross_product.hpp>
 #include <glm/gtx/orthonormalize.hpp>
@@ -18,14 +23,85 @@ int sortAxis = 0;
 MeshDb* tempMeshDb;
 ShaderDb* tempShaderDb;
 const float COEFF_OF_RESTITUTION = 0.85f;
+// Projected radius (fraction of half the screen height) at and above which spheres are drawn at full detail
+const float LOD_FULL_DETAIL_SIZE = 0.25f;
+const float AIR_DENSITY = 1.225f;
+const char* const TRAJECTORY_PATH = "trajectory.traj";
+const char* const CHECKPOINT_PATH = "checkpoint.pbc";
+// Spheres per block of the broadphase sweep. Fixed, so the blocks are the same for any number of threads
+const int SWEEP_BLOCK = 256;
+// Shifts per sphere the coherent re-sort may make before it falls back to a full sort. Past about 10 the insertion
+// sort is slower than std::sort
+const int SORT_MAX_SHIFTS_PER_PARTICLE = 8;
+// Seed of both random number generators, so every run starts the same
+const uint64_t RANDOM_SEED = 1;
+// Brownian motion: friction rate (1/s) and temperature (J), about 4 m/s of jiggling for a red sphere
+const float BROWNIAN_DAMPING = 0.5f;
+const float BROWNIAN_TEMPERATURE = 16.0f;
+
+// Everything a sphere carries, in a form that can be written and mapped as is. The mesh and shader are not saved:
+// they belong to this process, and restored spheres get the same ones Init gives them
+struct ParticleState
+{
+	mat4 orientation;
+	vec4 color;
+	vec3 position;
+	float mass;
+	vec3 scale;
+	float coefficientOfRestitution;
+	vec3 velocity;
+	int id;
+	vec3 accumulatedForce;
+	vec3 accumulatedImpulse;
+	vec3 minEndPoints;		// Saved rather than recomputed: they are only updated by SetPosition
+	vec3 maxEndPoints;
+};
+
+
+// Picks the sort axis for the next step as the one along which the particles are most spread out
+void PickSortAxis(const vec3& s, const vec3& s2, size_t count)
+{
+	vec3 v;
+	for (int c = 0; c < 3; c++)
+		v[c] = s2[c] - s[c] * s[c] / count;
 
+	sortAxis = 0;
+	if (v[1] > v[0]) sortAxis = 1;
+	if (v[2] > v[sortAxis]) sortAxis = 2;
+}
 
 // Helper function for comparing Particles
-bool compareParticles(Particle& p1, Particle& p2)
+bool compareParticles(const Particle& p1, const Particle& p2)
 {
 	return p1.minEndPoints[sortAxis] < p2.minEndPoints[sortAxis];
 }
 
+// Insertion sort, close to linear on a range that is already nearly sorted, as the particles are from one step to the
+// next: they only move a little, and a removal only moves one sphere into a hole. Gives up and returns false once it
+// has shifted maxShifts spheres (the sort axis changed, a large jump), leaving the range partly sorted
+template<typename Less>
+bool InsertionSort(std::vector<Particle>::iterator begin, std::vector<Particle>::iterator end, const Less& less, size_t maxShifts)
+{
+	size_t shifts = 0;
+	for (auto i = begin; i != end; ++i)
+	{
+		if (i == begin || !less(*i, *(i - 1)))
+			continue;
+		Particle p = std::move(*i);
+		auto j = i;
+		do
+		{
+			*j = std::move(*(j - 1));
+			--j;
+			shifts++;
+		} while (j != begin && less(p, *(j - 1)));
+		*j = std::move(p);
+		if (shifts > maxShifts)
+			return false;
+	}
+	return true;
+}
+
 // Symplectic integration
 void SymplecticEuler(vec3& pos, vec3& vel, float mass, const vec3& accel, const vec3& impulse, float dt)
 {
@@ -137,41 +213,136 @@ void CalculateImpulseBetweenSpheres(Particle& p1, Particle& p2)
 	p2.SetVelocity(p2.Velocity() + dVel2);
 }
 
+// Gives new spheres a random type (red, green or blue, each with its own size and mass), position and velocity.
+// Positions and velocities are whole numbers, as they always were. The numbers are drawn for each sphere's id and the
+// current step, a few at a time for all the spheres together, so they don't depend on the number of threads
+void PhysicsEngine::RandomizeSpheres(Particle* spheres, int count, float minY, float maxY)
+{
+	randomIds.resize(count);
+	for (int i = 0; i < count; i++)
+		randomIds[i] = uint32_t(spheres[i].Id());
+
+	// Three draws per sphere, one after the other in randomBits
+	randomBits.resize(3 * size_t(count));
+	random.Generate(randomIds.data(), count, stepCount, RandomPurpose::SpawnType, 0, randomBits.data());
+	random.Generate(randomIds.data(), count, stepCount, RandomPurpose::SpawnPosition, 0, randomBits.data() + count);
+	random.Generate(randomIds.data(), count, stepCount, RandomPurpose::SpawnVelocity, 0, randomBits.data() + 2 * count);
+
+	// Integer in [low, high]
+	auto wholeNumber = [](float u, float low, float high) { return low + std::floor(u * (high - low + 1.0f)); };
+
+	ParallelFor(count, [&](int i)
+		{
+			Particle& p = spheres[i];
+			vec4 type = Philox::ToUniform(randomBits[i]);
+			vec4 position = Philox::ToUniform(randomBits[count + i]);
+			vec4 velocity = Philox::ToUniform(randomBits[2 * count + i]);
+
+			// Red spheres have radius 1 and mass 1, green radius 2 and mass 2, blue radius 3 and mass 3
+			int whichRGB = std::min(int(type.x * 3.0f), 2);
+			vec4 color = vec4(0, 0, 0, 1);
+			color[whichRGB] = 1;
+			p.SetColor(color);
+			p.SetMass(float(whichRGB + 1));
+			p.SetScale(vec3(float(whichRGB + 1)));
+
+			p.SetPosition(vec3(wholeNumber(position.x, -30.0f, 28.0f), wholeNumber(position.y, minY, maxY), wholeNumber(position.z, -30.0f, 28.0f)));
+			p.SetVelocity(vec3(wholeNumber(velocity.x, -20.0f, 18.0f), wholeNumber(velocity.y, -20.0f, 18.0f), wholeNumber(velocity.z, -20.0f, 18.0f)));
+		}, 1024);
+}
+
 // Function that adds a random sphere in a random position.
-void PhysicsEngine::AddRandomSphere()
+ParticleHandle PhysicsEngine::AddRandomSphere()
 {
-	Particle randPart;
-	randPart.SetMesh(tempMeshDb->Get("sphere"));
-	randPart.SetShader(tempShaderDb->Get("default"));
+	ParticleHandle handle;
+	Particle* sphere = pool.AddBatch(1, spherePrototype, &handle);
+	RandomizeSpheres(sphere, 1, -15.0f, 13.0f);
+	// The id may have belonged to a removed sphere
+	granular.ResetParticle(int(handle.slot));
+	return handle;
+}
 
-	int whichRGB = rand() % 3;
-	vec4 color = vec4(0, 0, 0, 1);
-	color[whichRGB] = 1;
+ParticleHandle PhysicsEngine::AddSphere(const Particle& sphere)
+{
+	ParticleHandle handle = pool.Add(sphere);
+	// The id may have belonged to a removed sphere
+	granular.ResetParticle(int(handle.slot));
+	return handle;
+}
 
-	if (whichRGB == 0)
-	{
-		randPart.SetMass(1);
-		randPart.SetScale(vec3(1.0f));
-	}
-	if (whichRGB == 1)
-	{
-		randPart.SetMass(2);
-		randPart.SetScale(vec3(2.0f));
-	}
+bool PhysicsEngine::RemoveSphere(ParticleHandle handle)
+{
+	return pool.Remove(handle);
+}
+
+void PhysicsEngine::RemoveRandomSphere()
+{
+	if (!particles.empty())
+		RemoveSphere(pool.Handle(rng.Below(int(particles.size()))));
+}
 
-	if (whichRGB == 2)
+void PhysicsEngine::ToggleDemoEmitters()
+{
+	if (emitters.Emitting() > 0)
 	{
-		randPart.SetMass(3);
-		randPart.SetScale(vec3(3.0f));
+		emitters.Stop();
+		return;
 	}
 
-	randPart.SetColor(color);
-
-	randPart.SetPosition(vec3(-30 + (rand() % 59), -15 + (rand() % 29), -30 + (rand() % 59)));
+	// Not too small or light: the soft granular contacts are only stable while sqrt(stiffness / mass) times the
+	// substep stays well below 2
+	// Fountain from a point on the floor
+	EmitterSettings fountain;
+	fountain.position = vec3(-15.0f, -28.0f, 0.0f);
+	fountain.velocity = vec3(0.0f, 35.0f, 0.0f);
+	fountain.velocitySpread = 10.0f;
+	fountain.rate = 1000.0f;
+	fountain.lifetime = 3.0f;
+	fountain.radius = 0.5f;
+	fountain.mass = 1.0f;
+	fountain.color = vec4(0.2f, 0.8f, 1.0f, 1.0f);
+	emitters.Add(fountain);
+
+	// Shower from a box under the ceiling
+	EmitterSettings shower;
+	shower.shape = EmitterShape::Box;
+	shower.position = vec3(10.0f, 27.0f, 10.0f);
+	shower.halfExtents = vec3(8.0f, 1.0f, 8.0f);
+	shower.velocitySpread = 1.0f;
+	shower.rate = 1000.0f;
+	shower.lifetime = 4.0f;
+	shower.radius = 0.5f;
+	shower.mass = 1.0f;
+	shower.color = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+	emitters.Add(shower);
+
+	// Jet across the box from a disc in the wall
+	EmitterSettings jet;
+	jet.shape = EmitterShape::Disc;
+	jet.position = vec3(-28.0f, 0.0f, -15.0f);
+	jet.normal = vec3(1.0f, 0.0f, 0.0f);
+	jet.discRadius = 3.0f;
+	jet.velocity = vec3(30.0f, 5.0f, 0.0f);
+	jet.velocitySpread = 2.0f;
+	jet.rate = 1000.0f;
+	jet.lifetime = 2.5f;
+	jet.radius = 0.5f;
+	jet.mass = 1.0f;
+	jet.color = vec4(1.0f, 0.5f, 0.1f, 1.0f);
+	emitters.Add(jet);
+}
 
-	randPart.SetVelocity(vec3(-20 + rand() % 39, -20 + rand() % 39, -20 + rand() % 39));
-	particles.push_back(randPart);
+// Drops a block of water in the middle of the box
+void PhysicsEngine::AddFluidBlock()
+{
+	fluid.AddBlock(vec3(-5.0f, 0.0f, -5.0f), vec3(5.0f, 10.0f, 5.0f));
+}
 
+// Hangs a long rope from a random point under the ceiling
+void PhysicsEngine::AddRope()
+{
+	vec3 anchor = vec3(-20 + rng.Below(41), 28.0f, -20 + rng.Below(41));
+	ropes.AddRope(anchor, anchor + vec3(25.0f, 0.0f, 0.0f), 500, 5.0f, 0.0f, 1e-4f, true);
 }
 
 // This is called once
@@ -181,12 +352,11 @@ void PhysicsEngine::Init(Camera& camera, MeshDb& meshDb, ShaderDb& shaderDb)
 	auto defaultShader = shaderDb.Get("default");
 	auto groundMesh = meshDb.Get("plane");
 
-	meshDb.Add("cube", Mesh(MeshDataFromWavefrontObj("resources/models/cube.obj")));
-	meshDb.Add("sphere", Mesh(MeshDataFromWavefrontObj("resources/models/sphere.obj")));
-	meshDb.Add("cone", Mesh(MeshDataFromWavefrontObj("resources/models/cone.obj")));
-
 	tempMeshDb = &meshDb;
 	tempShaderDb = &shaderDb;
+	sphereMesh = meshDb.Get("sphere");
+	spherePrototype.SetMesh(sphereMesh);
+	spherePrototype.SetShader(defaultShader);
 
 
 
@@ -198,78 +368,460 @@ void PhysicsEngine::Init(Camera& camera, MeshDb& meshDb, ShaderDb& shaderDb)
 
 
 
-	srand(1);
-	for (int i = 0; i < 200; i++)
-	{
-		Particle p;
-		p.SetMesh(meshDb.Get("sphere"));
-		p.SetShader(defaultShader);
+	rng.Seed(RANDOM_SEED);
+	random = Philox(RANDOM_SEED);
+	RandomizeSpheres(pool.AddBatch(200, spherePrototype, nullptr), 200, -30.0f, 28.0f);
+
+	// Fluid shares the box with the spheres
+	fluid.Init(vec3(0.0f), 30.0f);
+
+	// Scaled so the spheres visibly pull on each other at the size of the box
+	nbody.SetGravitationalConstant(2.0f);
+	nbody.SetSoftening(1.0f);
+	mutualForces.Get<ForceTerm::AccelerationField>().accelerations = &gravityAccelerations;
+	SetAir(false);
+	SetBrownian(false);
 
-		// Getting a random value between 0 and 3
-		int whichRGB = rand() % 3;
-		vec4 color = vec4(0, 0, 0, 1);
+	ropes.SetBox(vec3(0.0f), 30.0f);
 
-		// That random value will be either red, green or blue
-		color[whichRGB] = 1;
+	sphereLods = meshDb.GetLods("sphere");
+	instancedRenderer.Init(shaderDb.Get("instanced"));
+	impostorMesh = meshDb.Get("impostor");
+	impostorRenderer.Init(shaderDb.Get("impostor"));
+	perFrameUniforms.Create(sizeof(PerFrameUniforms), PER_FRAME_BINDING);
+
+	camera = Camera(vec3(0, 5, 30));
+}
+
+// Switches between impulse-based and granular contacts
+void PhysicsEngine::SetCollisionMode(CollisionMode mode)
+{
+	if (mode == collisionMode)
+		return;
+	collisionMode = mode;
+	granular.Reset();
+}
 
-		// If sphere is red, radius is 1 and mass is 1; if sphere is blue, radius is 2 and mass is 1; if sphere is green, radius is 3 and mass is 3.
-		if(whichRGB == 0)
+// Sorts the particles along the sort axis. In deterministic mode ties are broken by id, so the order only depends on
+// the state and not on the order before the sort
+void PhysicsEngine::SortParticles()
+{
+	// The spheres already there were sorted last step, so an insertion sort puts them back in order in about linear
+	// time. The spheres added since are sorted on their own and merged in
+	auto sortAndMerge = [&](const auto& less)
+	{
+		auto added = particles.begin() + pool.FirstAdded();
+		size_t maxShifts = size_t(SORT_MAX_SHIFTS_PER_PARTICLE) * pool.FirstAdded();
+		if (!InsertionSort(particles.begin(), added, less, maxShifts))
+			std::sort(particles.begin(), added, less);
+		if (added != particles.end())
 		{
-			p.SetMass(1);
-			p.SetScale(vec3(1.0f));
+			std::sort(added, particles.end(), less);
+			std::inplace_merge(particles.begin(), added, particles.end(), less);
 		}
-		if (whichRGB == 1)
+	};
+
+	if (!deterministic)
+		sortAndMerge(compareParticles);
+	else
+	{
+		int axis = sortAxis;
+		sortAndMerge([axis](const Particle& p1, const Particle& p2)
+			{
+				float a = p1.minEndPoints[axis], b = p2.minEndPoints[axis];
+				return a < b || (a == b && p1.Id() < p2.Id());
+			});
+	}
+
+	// Points the handles at the new positions
+	pool.Reindex();
+}
+
+// Sorts the particles along the sort axis and collects every pair whose bounding boxes overlap, in sweep order
+void PhysicsEngine::FindPotentialPairs(std::vector<std::pair<int, int>>& pairs)
+{
+	pairs.clear();
+	if (particles.empty())
+		return;
+
+	SortParticles();
+
+	int count = int(particles.size());
+	int numBlocks = (count + SWEEP_BLOCK - 1) / SWEEP_BLOCK;
+	sweepBlocks.resize(numBlocks);
+	ParallelFor(numBlocks, [&](int b)
 		{
-			p.SetMass(2);
-			p.SetScale(vec3(2.0f));
-		}
-		if (whichRGB == 2)
+			SweepBlock& block = sweepBlocks[b];
+			block.pairs.clear();
+			block.sum = dvec3(0.0);
+			block.sumSquares = dvec3(0.0);
+
+			int end = std::min(count, (b + 1) * SWEEP_BLOCK);
+			for (int i = b * SWEEP_BLOCK; i < end; i++)
+			{
+				const auto& p1 = particles[i];
+				block.sum += dvec3(p1.Position());
+				block.sumSquares += dvec3(p1.Position()) * dvec3(p1.Position());
+
+				for (int j = i + 1; j < count; j++)
+				{
+					const auto& p2 = particles[j];
+					if (p2.minEndPoints[sortAxis] > p1.maxEndPoints[sortAxis])
+						break;
+
+					// The sort axis overlaps, check the two other axes too
+					if (p1.maxEndPoints.x >= p2.minEndPoints.x && p2.maxEndPoints.x >= p1.minEndPoints.x &&
+						p1.maxEndPoints.y >= p2.minEndPoints.y && p2.maxEndPoints.y >= p1.minEndPoints.y &&
+						p1.maxEndPoints.z >= p2.minEndPoints.z && p2.maxEndPoints.z >= p1.minEndPoints.z)
+						block.pairs.emplace_back(i, j);
+				}
+			}
+		}, 1);
+
+	dvec3 s = dvec3(0.0), s2 = dvec3(0.0);
+	for (const auto& block : sweepBlocks)
+	{
+		pairs.insert(pairs.end(), block.pairs.begin(), block.pairs.end());
+		s += block.sum;
+		s2 += block.sumSquares;
+	}
+
+	PickSortAxis(vec3(s), vec3(s2), particles.size());
+}
+
+// Deterministic impulse contacts: every overlapping pair is found first, then resolved one after the other in sweep
+// order. The pushes of earlier pairs are seen by the later ones, as in the interleaved sweep
+void PhysicsEngine::ResolveContactsInOrder()
+{
+	FindPotentialPairs(potentialPairs);
+	for (const auto& pair : potentialPairs)
+	{
+		Particle& p1 = particles[pair.first];
+		Particle& p2 = particles[pair.second];
+		if (DetectCollisionBetweenSpheres(p1, p2))
 		{
-			p.SetMass(3);
-			p.SetScale(vec3(3.0f));
+			ResolveStaticCollision(p1, p2);
+			CalculateImpulseBetweenSpheres(p1, p2);
 		}
+	}
+}
 
+// Barnes-Hut attraction between all the spheres, for the current order of the particles
+void PhysicsEngine::ComputeMutualGravity()
+{
+	if (gravityMode != GravityMode::Mutual)
+		return;
 
-		p.SetColor(color);
-		
-		p.SetPosition(vec3( -30 + (rand() % 59), -30 + (rand() % 59), -30 + (rand() % 59)));
-
-		p.SetVelocity(vec3(-20 + rand() % 39, -20 + rand() % 39, -20 + rand() % 39));
-		particles.push_back(p);
+	gravityPositions.resize(particles.size());
+	gravityMasses.resize(particles.size());
+	for (size_t i = 0; i < particles.size(); i++)
+	{
+		gravityPositions[i] = particles[i].Position();
+		gravityMasses[i] = particles[i].Mass();
 	}
+	nbody.Build(gravityPositions, gravityMasses);
+	nbody.ComputeAccelerations(gravityAccelerations);
+}
 
+// Turns drag and a light breeze along x on or off
+void PhysicsEngine::SetAir(bool enabled)
+{
+	airEnabled = enabled;
+	float density = enabled ? AIR_DENSITY : 0.0f;
+	vec3 wind = enabled ? vec3(4.0f, 0.0f, 0.0f) : vec3(0.0f);
+	auto setAir = [&](auto& forces)
+	{
+		forces.template Get<ForceTerm::QuadraticDrag>().airDensity = density;
+		forces.template Get<ForceTerm::Wind>().drag.airDensity = density;
+		forces.template Get<ForceTerm::Wind>().velocity = wind;
+	};
+	setAir(uniformForces);
+	setAir(mutualForces);
+}
 
-	camera = Camera(vec3(0, 5, 30));
+// Turns the Langevin thermostat on or off
+void PhysicsEngine::SetBrownian(bool enabled)
+{
+	brownianEnabled = enabled;
+	auto setBrownian = [&](auto& forces)
+	{
+		auto& langevin = forces.template Get<ForceTerm::Langevin>();
+		langevin.damping = enabled ? BROWNIAN_DAMPING : 0.0f;
+		langevin.temperature = BROWNIAN_TEMPERATURE;
+		langevin.random = random;
+	};
+	setBrownian(uniformForces);
+	setBrownian(mutualForces);
+}
+
+void PhysicsEngine::SetLangevinStep(float dt, uint32_t substep)
+{
+	auto setStep = [&](auto& forces)
+	{
+		auto& langevin = forces.template Get<ForceTerm::Langevin>();
+		langevin.dt = dt;
+		langevin.step = stepCount;
+		langevin.substep = substep;
+	};
+	setStep(uniformForces);
+	setStep(mutualForces);
 }
 
 // This is called every frame
 void PhysicsEngine::Update(float deltaTime, float totalTime)
 {
-	for (int i = 0; i < particles.size(); i++)
+	if (!emitters.Idle())
+	{
+		emitters.Step(deltaTime, stepCount, pool, random, spherePrototype);
+		// Their ids may have belonged to removed spheres
+		for (const auto& handle : emitters.Spawned())
+			granular.ResetParticle(int(handle.slot));
+	}
+
+	if (collisionMode == CollisionMode::Granular)
+		UpdateGranular(deltaTime);
+	else
+		UpdateImpulse(deltaTime);
+
+	fluid.Step(deltaTime, particles);
+	ropes.Step(deltaTime, particles);
+
+	if (recorder.Recording())
+		RecordFrame(double(totalTime) + deltaTime);
+
+	pool.Recycle();
+	stepCount++;
+	if (hashLog.is_open())
 	{
-		particles[i].ClearForcesImpulses();
+		char line[48];
+		std::snprintf(line, sizeof(line), "%llu %016llx\n", static_cast<unsigned long long>(stepCount), static_cast<unsigned long long>(ComputeStateHash()));
+		hashLog << line;
+	}
+}
 
+uint64_t PhysicsEngine::ComputeStateHash() const
+{
+	StateHash hash;
+	// Spheres in their current order, which is part of the state: it decides the order of the next step's contacts
+	hash.Add(HashItems(int(particles.size()), [&](StateHash& h, int i)
+		{
+			const Particle& p = particles[i];
+			h.Add(uint64_t(p.Id()));
+			h.Add(p.Position());
+			h.Add(p.Velocity());
+			h.Add(p.Scale());
+			h.Add(p.Mass());
+		}));
+	pool.HashState(hash);
+	emitters.HashState(hash);
+	hash.Add(uint64_t(sortAxis));
+	hash.Add(rng.State());
+	granular.HashState(hash);
+	fluid.HashState(hash);
+	ropes.HashState(hash);
+	return hash.Value();
+}
 
-		Force::Gravity(particles[i]);
+bool PhysicsEngine::LogStateHashes(const std::string& path)
+{
+	hashLog.open(path, std::ios::trunc);
+	return hashLog.is_open();
+}
 
-		vec3 acceleration = particles[i].AccumulatedForce() / particles[i].Mass();
+void PhysicsEngine::ToggleRecording()
+{
+	if (recorder.Recording())
+		recorder.Stop();
+	else if (!recorder.Start(TRAJECTORY_PATH))
+		std::cout << "ERROR::TRAJECTORY::CANNOT_CREATE " << TRAJECTORY_PATH << std::endl;
+}
 
-		vec3 position = particles[i].Position();
-		vec3 velocity = particles[i].Velocity();
-		SymplecticEuler(position, velocity, particles[i].Mass(), acceleration, particles[i].AccumulatedImpulse(), deltaTime);
+bool PhysicsEngine::SaveCheckpoint(const std::string& path) const
+{
+	CheckpointWriter out;
 
-		particles[i].SetPosition(position);
-		particles[i].SetVelocity(velocity);
+	// Spheres, in their current order: it decides the order of the next sort and so of the collisions
+	ParticleState* states = out.AppendArray<ParticleState>(particles.size());
+	ParallelFor(int(particles.size()), [&](int i)
+		{
+			const Particle& p = particles[i];
+			states[i] = { p.Orientation(), p.Color(), p.Position(), p.Mass(), p.Scale(), p.CoefficientOfRestitution(),
+				p.Velocity(), p.Id(), p.AccumulatedForce(), p.AccumulatedImpulse(), p.minEndPoints, p.maxEndPoints };
+		}, 4096);
+
+	out.Write(sortAxis);
+	out.Write(rng.State());
+	out.WriteEnum(collisionMode);
+	out.WriteEnum(gravityMode);
+	out.WriteBool(airEnabled);
+	out.WriteBool(brownianEnabled);
+	out.WriteBool(deterministic);
+	out.Write(stepCount);
+
+	pool.SaveState(out);
+	emitters.SaveState(out);
+	granular.SaveState(out);
+	fluid.SaveState(out);
+	ropes.SaveState(out);
+	return out.Save(path);
+}
 
-		
-		CollisionImpulse(particles[i], vec3(0.0f), 30.0f, COEFF_OF_RESTITUTION);
+bool PhysicsEngine::LoadCheckpoint(const std::string& path)
+{
+	CheckpointReader in;
+	if (!in.Open(path))
+		return false;
+
+	size_t count = 0;
+	const ParticleState* states = in.ReadArray<ParticleState>(count);
+	int savedSortAxis;
+	uint64_t rngState;
+	CollisionMode savedCollisionMode;
+	GravityMode savedGravityMode;
+	bool savedAirEnabled, savedBrownianEnabled, savedDeterministic;
+	uint64_t savedStepCount;
+	if (!states || !in.Read(savedSortAxis) || !in.Read(rngState)
+		|| !in.ReadEnum(savedCollisionMode, CollisionMode::Granular) || !in.ReadEnum(savedGravityMode, GravityMode::Mutual)
+		|| !in.ReadBool(savedAirEnabled) || !in.ReadBool(savedBrownianEnabled) || !in.ReadBool(savedDeterministic)
+		|| !in.Read(savedStepCount)
+		|| savedSortAxis < 0 || savedSortAxis > 2)
+		return false;
+
+	// Nothing is replaced until the whole file has been read successfully
+	ParticlePool loadedPool;
+	std::vector<Particle>& loadedParticles = loadedPool.Particles();
+	loadedParticles.assign(count, spherePrototype);
+	ParallelFor(int(count), [&](int i)
+		{
+			const ParticleState& s = states[i];
+			Particle& p = loadedParticles[i];
+			p.SetOrientation(s.orientation);
+			p.SetColor(s.color);
+			p.SetScale(s.scale);
+			p.SetPosition(s.position);
+			p.minEndPoints = s.minEndPoints;
+			p.maxEndPoints = s.maxEndPoints;
+			p.SetMass(s.mass);
+			p.SetCoefficientOfRestitution(s.coefficientOfRestitution);
+			p.SetVelocity(s.velocity);
+			p.SetId(s.id);
+			p.ClearForcesImpulses();
+			p.ApplyForce(s.accumulatedForce);
+			p.ApplyImpulse(s.accumulatedImpulse);
+		}, 4096);
+
+	GranularSolver loadedGranular;
+	FluidSolver loadedFluid;
+	ConstraintSolver loadedRopes;
+	EmitterSystem loadedEmitters;
+	if (!loadedPool.LoadState(in) || !loadedEmitters.LoadState(in) || !loadedGranular.LoadState(in) || !loadedFluid.LoadState(in) || !loadedRopes.LoadState(in))
+		return false;
+
+	pool = std::move(loadedPool);
+	emitters = std::move(loadedEmitters);
+	sortAxis = savedSortAxis;
+	rng.SetState(rngState);
+	collisionMode = savedCollisionMode;
+	gravityMode = savedGravityMode;
+	SetAir(savedAirEnabled);
+	SetBrownian(savedBrownianEnabled);
+	deterministic = savedDeterministic;
+	stepCount = savedStepCount;
+	granular = std::move(loadedGranular);
+	fluid = std::move(loadedFluid);
+	ropes = std::move(loadedRopes);
+
+	// The previous state of the next snapshot would belong to the old simulation
+	lastInstances.clear();
+	return true;
+}
 
+// Copies the spheres' ids, positions and velocities into the next frame for the recorder, in id order
+void PhysicsEngine::RecordFrame(double time)
+{
+	// Walking the slots gives the id order without a sort; the ids of removed spheres are skipped. A slot is reused by
+	// later spheres, so the recorded id is the handle's key: a new sphere never continues an expired one's history
+	recordedFrame.time = time;
+	recordedFrame.Resize(particles.size());
+	int n = 0;
+	for (int slot = 0; slot < pool.SlotCount(); slot++)
+	{
+		if (!pool.SlotAlive(slot))
+			continue;
+		const Particle& p = pool.InSlot(slot);
+		recordedFrame.ids[n] = pool.SlotHandle(slot).Key();
+		recordedFrame.positions[n] = p.Position();
+		recordedFrame.velocities[n] = p.Velocity();
+		n++;
 	}
+	recorder.Submit(recordedFrame);
+}
 
-	vec3 s = vec3(0.0f), s2 = vec3(0.0f), v;
+// Granular mode: several substeps of soft contact forces per step
+void PhysicsEngine::UpdateGranular(float deltaTime)
+{
+	int substeps = std::max(1, granular.Material().substeps);
+	float dt = deltaTime / substeps;
+
+	for (int step = 0; step < substeps; step++)
+	{
+		FindPotentialPairs(potentialPairs);
+		ComputeMutualGravity();
+		SetLangevinStep(dt, uint32_t(step));
+
+		WithForces([&](const auto& forces)
+			{
+				ParallelFor(int(particles.size()), [&](int i)
+					{
+						particles[i].ClearForcesImpulses();
+						particles[i].ApplyForce(forces.Sum(particles[i], i));
+					});
+			});
+
+		granular.ApplyContactForces(particles, potentialPairs, dt);
+		granular.IntegrateRotation(particles, dt);
+
+		ParallelFor(int(particles.size()), [&](int i)
+			{
+				vec3 acceleration = particles[i].AccumulatedForce() / particles[i].Mass();
+
+				vec3 position = particles[i].Position();
+				vec3 velocity = particles[i].Velocity();
+				SymplecticEuler(position, velocity, particles[i].Mass(), acceleration, particles[i].AccumulatedImpulse(), dt);
+
+				particles[i].SetPosition(position);
+				particles[i].SetVelocity(velocity);
+
+				CollisionImpulse(particles[i], vec3(0.0f), 30.0f, granular.Material().restitution);
+			});
+	}
+}
+
+// Impulse mode: integrate, then push apart and bounce every pair of overlapping spheres
+void PhysicsEngine::UpdateImpulse(float deltaTime)
+{
+	ComputeMutualGravity();
+	SetLangevinStep(deltaTime, 0);
+
+	// Forces, integration and collisions with the walls in a single pass over the particles
+	WithForces([&](const auto& forces)
+		{
+			forces.Integrate(particles, deltaTime, [](Particle& p)
+				{
+					CollisionImpulse(p, vec3(0.0f), 30.0f, COEFF_OF_RESTITUTION);
+				});
+		});
+
+	if (deterministic)
+	{
+		ResolveContactsInOrder();
+		return;
+	}
+
+	vec3 s = vec3(0.0f), s2 = vec3(0.0f);
 
 	// Sorting spheres
-	std::sort(particles.begin(), particles.end(), compareParticles);
+	SortParticles();
 
 	for (int i = 0; i < particles.size(); i++)
 	{
@@ -298,24 +850,112 @@ void PhysicsEngine::Update(float deltaTime, float totalTime)
 		}
 	}
 
-	// Variance calculations
-	for (int c = 0; c < 3; c++)
-		v[c] = s2[c] - s[c] * s[c] / particles.size();
+	// Picking one axis based on the variance
+	PickSortAxis(s, s2, particles.size());
+}
 
+// This is called by the simulation after every step, possibly on another thread than Display
+void PhysicsEngine::WriteSnapshot(RenderSnapshot& snapshot, double time)
+{
+	// Particle ids are the pool's slots, so they index the instances directly
+	int numParticles = pool.SlotCount();
+	int numFluid = fluid.Count();
+	int numRope = ropes.Count();
 
-	// Picking one axis based on the variance
-	sortAxis = 0;
-	if (v[1] > v[0]) sortAxis = 1;
-	if (v[2] > v[sortAxis]) sortAxis = 2;
+	snapshot.time = time;
+	snapshot.previous = lastInstances;
+	lastInstances.resize(numParticles + numFluid + numRope);
+
+	ParallelFor(numParticles, [&](int slot)
+		{
+			if (!pool.SlotAlive(slot))
+				lastInstances[slot] = { vec4(0.0f, 0.0f, 0.0f, -INFINITY), vec4(0.0f) };
+		}, 4096);
+	ParallelFor(int(particles.size()), [&](int i)
+		{
+			const auto& p = particles[i];
+			lastInstances[p.Id()] = { vec4(p.Position(), p.Scale().x), p.Color() };
+		}, 1024);
+
+	// Fluid particles as small translucent spheres
+	float fluidRadius = 0.5f * fluid.Settings().particleSpacing;
+	ParallelFor(numFluid, [&](int i)
+		{
+			lastInstances[numParticles + fluid.Id(i)] = { vec4(fluid.Position(i), fluidRadius), vec4(0.2f, 0.5f, 1.0f, 0.6f) };
+		}, 1024);
+
+	ParallelFor(numRope, [&](int i)
+		{
+			lastInstances[numParticles + numFluid + i] = { vec4(ropes.Position(i), ropes.NodeRadius()), vec4(1.0f, 0.8f, 0.2f, 1.0f) };
+		}, 1024);
 
+	snapshot.current = lastInstances;
 }
 
-// This is called every frame, after Update
-void PhysicsEngine::Display(const mat4& viewMatrix, const mat4& projMatrix)
+// This is called every frame, on the render thread
+void PhysicsEngine::Display(const mat4& viewMatrix, const mat4& projMatrix, const RenderSnapshot& snapshot, float alpha)
 {
-	ground.Draw(viewMatrix, projMatrix);
-	for (auto& p : particles)
-		p.Draw(viewMatrix, projMatrix);
+	perFrameUniforms.Update(PerFrameUniforms{ viewMatrix, projMatrix });
+
+	ground.Draw();
+
+	// Only the objects inside the view frustum are submitted
+	const auto& previous = snapshot.previous;
+	const auto& current = snapshot.current;
+	culler.SetViewProjection(projMatrix * viewMatrix);
+	int count = culler.Cull(current, &previous, visibleInstances);
+	drawStats.drawn = count;
+	drawStats.culled = int(current.size()) - count;
+
+	// Interpolated state of a visible object
+	auto blended = [&](int v)
+	{
+		int i = visibleInstances[v];
+		SphereInstance instance = current[i];
+		// Objects that did not exist in the previous state are shown where they are now
+		if (i < int(previous.size()) && previous[i].positionRadius.w >= 0.0f)
+			instance.positionRadius = mix(previous[i].positionRadius, current[i].positionRadius, alpha);
+		return instance;
+	};
+
+	// Impostors are flat quads, so they have no levels of detail. The blended state is written straight into the instance stream.
+	// They also stand in for the sphere mesh while it is loading
+	if (useImpostors || sphereLods->empty())
+	{
+		SphereInstance* instances = impostorRenderer.Map(impostorMesh, count);
+		ParallelFor(count, [&](int v) { instances[v] = blended(v); }, 1024);
+		impostorRenderer.Draw();
+		return;
+	}
+
+	// Level of detail from the radius on screen, as a fraction of half the screen height. Each level has half the
+	// triangles of the previous one, so dropping a level every time the size shrinks by sqrt(2) keeps the number of
+	// triangles per pixel roughly constant
+	int numLods = int(sphereLods->size());
+	instanceLod.resize(count);
+	ParallelFor(count, [&](int v)
+		{
+			const vec4& s = current[visibleInstances[v]].positionRadius;
+			float depth = std::max(-(viewMatrix * vec4(vec3(s), 1.0f)).z, 1e-3f);
+			float size = s.w * projMatrix[1][1] / depth;
+			float level = 2.0f * std::log2(LOD_FULL_DETAIL_SIZE / size);
+			instanceLod[v] = uint8_t(clamp(int(level), 0, numLods - 1));
+		}, 1024);
+
+	// Bucket the instances per level: one instanced batch per level, filled in parallel
+	std::vector<int> lodCount(numLods, 0);
+	instanceLodSlot.resize(count);
+	for (int v = 0; v < count; v++)
+		instanceLodSlot[v] = lodCount[instanceLod[v]]++;
+
+	std::vector<SphereInstance*> lodInstances(numLods, nullptr);
+	for (int lod = 0; lod < numLods; lod++)
+		if (lodCount[lod] > 0)
+			lodInstances[lod] = instancedRenderer.Map((*sphereLods)[lod], lodCount[lod]);
+
+	ParallelFor(count, [&](int v) { lodInstances[instanceLod[v]][instanceLodSlot[v]] = blended(v); }, 1024);
+
+	instancedRenderer.Draw();
 }
 
 void PhysicsEngine::HandleInputKey(int keyCode, bool pressed)
@@ -325,6 +965,63 @@ void PhysicsEngine::HandleInputKey(int keyCode, bool pressed)
 	case GLFW_KEY_SPACE:
 		if (pressed)
 			AddRandomSphere();
+		break;
+	case GLFW_KEY_B:
+		if (pressed)
+			SetBrownian(!brownianEnabled);
+		break;
+	case GLFW_KEY_E:
+		if (pressed)
+			ToggleDemoEmitters();
+		break;
+	case GLFW_KEY_BACKSPACE:
+		if (pressed)
+			RemoveRandomSphere();
+		break;
+	case GLFW_KEY_F:
+		if (pressed)
+			AddFluidBlock();
+		break;
+	case GLFW_KEY_R:
+		if (pressed)
+			AddRope();
+		break;
+	case GLFW_KEY_J:
+		if (pressed)
+			ropes.SetMethod(ropes.GetMethod() == ConstraintSolver::Method::Jacobi ? ConstraintSolver::Method::GaussSeidel : ConstraintSolver::Method::Jacobi);
+		break;
+	case GLFW_KEY_N:
+		if (pressed)
+			gravityMode = gravityMode == GravityMode::Mutual ? GravityMode::Uniform : GravityMode::Mutual;
+		break;
+	case GLFW_KEY_V:
+		if (pressed)
+			SetAir(!airEnabled);
+		break;
+	case GLFW_KEY_I:
+		if (pressed)
+			useImpostors = !useImpostors;
+		break;
+	case GLFW_KEY_T:
+		if (pressed)
+			ToggleRecording();
+		break;
+	case GLFW_KEY_F5:
+		if (pressed && !SaveCheckpoint(CHECKPOINT_PATH))
+			std::cout << "ERROR::CHECKPOINT::SAVE_FAILED " << CHECKPOINT_PATH << std::endl;
+		break;
+	case GLFW_KEY_F9:
+		if (pressed && !LoadCheckpoint(CHECKPOINT_PATH))
+			std::cout << "ERROR::CHECKPOINT::LOAD_FAILED " << CHECKPOINT_PATH << std::endl;
+		break;
+	case GLFW_KEY_K:
+		if (pressed)
+			SetDeterministic(!deterministic);
+		break;
+	case GLFW_KEY_G:
+		if (pressed)
+			SetCollisionMode(collisionMode == CollisionMode::Granular ? CollisionMode::Impulse : CollisionMode::Granular);
+		break;
 	default:
 		break;
 	}
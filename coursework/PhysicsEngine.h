@@ -1,9 +1,34 @@
 #pragma once
 
 
+#include <atomic>
+#include <fstream>
+
 #include <glm/glm.hpp>
 
 #include "PhysicsObject.h"
+#include "ParticlePool.h"
+#include "Emitter.h"
+#include "Granular.h"
+#include "Fluid.h"
+#include "Constraints.h"
+#include "NBody.h"
+#include "ForceSet.h"
+#include "InstancedRenderer.h"
+#include "Culling.h"
+#include "Random.h"
+#include "Shader.h"
+#include "Trajectory.h"
+
+// Everything the renderer needs from one simulation step, so drawing never touches the live simulation state.
+// Instances are ordered by particle id, then fluid id, then rope node, so the same index is the same object in both states.
+// Particle ids not in use have a radius of -infinity, so they are never drawn
+struct RenderSnapshot
+{
+	double time = 0.0;						// Simulation time of the current state
+	std::vector<SphereInstance> previous;	// State one step earlier, may be shorter if objects were added since
+	std::vector<SphereInstance> current;
+};
 
 // Fwd declaration
 class MeshDb;
@@ -13,13 +38,168 @@ class Camera;
 class PhysicsEngine
 {
 public:
+	// How sphere-sphere contacts are resolved
+	enum class CollisionMode
+	{
+		Impulse,	// Instantaneous impulse exchange, one collision per step
+		Granular	// Hertz-Mindlin soft contacts (DEM), with friction and rolling
+	};
+
+	// How gravity acts on the spheres
+	enum class GravityMode
+	{
+		Uniform,	// Constant downward pull
+		Mutual		// Spheres attract each other (Barnes-Hut N-body)
+	};
+
 	void Init(Camera& camera, MeshDb& meshDb, ShaderDb& shaderDb);
 	void Update(float deltaTime, float totalTime);
-	void Display(const glm::mat4& viewMatrix, const glm::mat4& projMatrix);
+	// Draws a snapshot, blending its previous and current state by alpha (0 = previous, 1 = current)
+	void Display(const glm::mat4& viewMatrix, const glm::mat4& projMatrix, const RenderSnapshot& snapshot, float alpha);
+	// Copies the state to draw into a snapshot. Called by the simulation after every step
+	void WriteSnapshot(RenderSnapshot& snapshot, double time);
+
+	// Objects submitted and culled by the last Display
+	struct DrawStats
+	{
+		int drawn = 0;
+		int culled = 0;
+	};
+	const DrawStats& LastDrawStats() const { return drawStats; }
 	void HandleInputKey(int keyCode, bool pressed);
-	void AddRandomSphere();
+	ParticleHandle AddRandomSphere();
+	ParticleHandle AddSphere(const Particle& sphere);
+	// False if the sphere was already removed. O(1); must be called between steps
+	bool RemoveSphere(ParticleHandle handle);
+	void RemoveRandomSphere();
+	// Emitters add their spheres at the start of each step. Stopped emitters still remove their spheres as they expire
+	void AddEmitter(const EmitterSettings& settings) { emitters.Add(settings); }
+	void StopEmitters() { emitters.Stop(); }
+	// Adds a fountain, a shower and a jet, one of each emitter shape, or stops the emitters if any are running
+	void ToggleDemoEmitters();
+	// nullptr once the sphere has been removed. Valid until the next step
+	Particle* Sphere(ParticleHandle handle) { return pool.Get(handle); }
+	void AddFluidBlock();
+	void AddRope();
+	void SetCollisionMode(CollisionMode mode);
+	// Starts or stops recording the spheres' trajectories to TRAJECTORY_PATH
+	void ToggleRecording();
+	bool Recording() const { return recorder.Recording(); }
+
+	// Saves the complete simulation state, random number generator included, so that a run resumed from it carries
+	// on exactly as the original. Loading replaces the state; both must be called between steps
+	bool SaveCheckpoint(const std::string& path) const;
+	bool LoadCheckpoint(const std::string& path);
+
+	// Deterministic mode: the spheres are sorted into one canonical order (ties broken by id), every contact is found
+	// before any is resolved, and the contacts are then resolved one by one in the order of that sort. The results
+	// only depend on the state, not on the number of threads or the order the spheres happened to be in
+	void SetDeterministic(bool enabled) { deterministic = enabled; }
+	bool Deterministic() const { return deterministic; }
+
+	// 64-bit hash of the complete simulation state, to compare two runs without comparing the states
+	uint64_t ComputeStateHash() const;
+	// Hashes the state after every step and writes one "step hash" line per step to path, so that the first step at
+	// which two runs differ can be found with diff
+	bool LogStateHashes(const std::string& path);
 private:
+	void UpdateImpulse(float deltaTime);
+	void UpdateGranular(float deltaTime);
+	void SortParticles();
+	void FindPotentialPairs(std::vector<std::pair<int, int>>& pairs);
+	void ResolveContactsInOrder();
+	void ComputeMutualGravity();
+	void RandomizeSpheres(Particle* spheres, int count, float minY, float maxY);
+	void RecordFrame(double time);
+
+	// Calls func with the force pipeline matching the gravity mode
+	template<typename Func>
+	void WithForces(const Func& func)
+	{
+		if (gravityMode == GravityMode::Mutual)
+			func(mutualForces);
+		else
+			func(uniformForces);
+	}
 
 	PhysicsBody ground;
-	std::vector<Particle> particles;
+	// The spheres. particles is the pool's dense array, which the solvers sweep and the sort reorders
+	ParticlePool pool;
+	std::vector<Particle>& particles = pool.Particles();
+	// Looked up once, as the emitters copy it for every sphere they add
+	Particle spherePrototype;
+	EmitterSystem emitters;
+	// rng for the choices made one at a time (which sphere to remove, where to hang a rope); random for everything
+	// drawn per sphere, keyed by its id and the step
+	Random rng;
+	Philox random;
+
+	CollisionMode collisionMode = CollisionMode::Impulse;
+	GranularSolver granular;
+	std::vector<std::pair<int, int>> potentialPairs;
+
+	// The broadphase sweeps fixed blocks of sorted spheres in parallel. Each block collects its own pairs and partial
+	// sums, which are joined in block order, so the result doesn't depend on the number of threads
+	struct SweepBlock
+	{
+		std::vector<std::pair<int, int>> pairs;
+		glm::dvec3 sum;
+		glm::dvec3 sumSquares;
+	};
+	std::vector<SweepBlock> sweepBlocks;
+
+	// Ids and random bits of the spheres being randomized
+	std::vector<uint32_t> randomIds;
+	std::vector<glm::uvec4> randomBits;
+
+	std::atomic<bool> deterministic{ false };
+	uint64_t stepCount = 0;
+	std::ofstream hashLog;
+
+	GravityMode gravityMode = GravityMode::Uniform;
+	BarnesHut nbody;
+	std::vector<glm::vec3> gravityAccelerations;	// In the current particle order
+	// Bodies handed to the tree, kept so the substeps don't allocate
+	std::vector<glm::vec3> gravityPositions;
+	std::vector<float> gravityMasses;
+
+	// Forces on the spheres. Air (drag and wind) is off until toggled
+	using UniformForces = ForceSet<ForceTerm::Gravity, ForceTerm::QuadraticDrag, ForceTerm::Wind, ForceTerm::Langevin>;
+	using MutualForces = ForceSet<ForceTerm::AccelerationField, ForceTerm::QuadraticDrag, ForceTerm::Wind, ForceTerm::Langevin>;
+	UniformForces uniformForces;
+	MutualForces mutualForces;
+	bool airEnabled = false;
+	void SetAir(bool enabled);
+	bool brownianEnabled = false;
+	void SetBrownian(bool enabled);
+	// Points the Langevin kicks at this step's random numbers
+	void SetLangevinStep(float dt, uint32_t substep);
+
+	FluidSolver fluid;
+
+	ConstraintSolver ropes;
+
+	// Trajectory recording. Each step's frame is filled here and handed to the recorder's writer thread
+	TrajectoryRecorder recorder;
+	TrajectoryFrame recordedFrame;
+
+	// Spheres, fluid particles and rope nodes are all drawn as instances, either of the sphere mesh or of a ray-traced
+	// impostor quad. The flag is toggled on the physics thread and read on the render thread
+	InstancedRenderer instancedRenderer;
+	InstancedRenderer impostorRenderer;
+	std::atomic<bool> useImpostors{ true };
+	const Mesh* impostorMesh = nullptr;
+
+	// Camera matrices, uploaded once per frame for all shaders
+	UniformBuffer perFrameUniforms;
+	const Mesh* sphereMesh = nullptr;
+	// Levels of detail of the sphere mesh, picked per instance from its size on screen. Owned by the mesh database,
+	// and empty until the sphere has loaded
+	const std::vector<const Mesh*>* sphereLods = nullptr;
+	std::vector<uint8_t> instanceLod;
+	std::vector<int> instanceLodSlot;
+	FrustumCuller culler;
+	std::vector<int> visibleInstances;
+	DrawStats drawStats;
+	std::vector<SphereInstance> lastInstances;	// Instances of the last snapshot, becoming the next one's previous state
 };
\ No newline at end of file
@@ -7,17 +7,12 @@
 #include "Shader.h"
 
 
-void PhysicsBody::Draw(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix) const
+// View and projection come from the per-frame uniform block, so only the model matrix and color are set here
+void PhysicsBody::Draw() const
 {
 	m_shader->Use();
-	//m_shader->SetUniform("model", ModelMatrix());
-	//m_shader->SetUniform("view", viewMatrix);
-	//m_shader->SetUniform("projection", projectionMatrix);
+	m_shader->SetUniform("model", ModelMatrix());
 	m_shader->SetUniform("color", m_color);
-
-	auto mvp = projectionMatrix * viewMatrix * ModelMatrix();
-	m_shader->SetUniform("modelViewProjectionMatrix", mvp);
-	m_shader->SetUniform("normalMatrix", transpose(inverse(viewMatrix * ModelMatrix())));
 	m_mesh->DrawVertexArray();
 }
 
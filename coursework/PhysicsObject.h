@@ -20,7 +20,8 @@ public:
 	// If we're going to derive from this class, create a virtual destructor that does nothing
 	virtual ~PhysicsBody() {}
 
-	void Draw(const glm::mat4& viewMatrix, const glm::mat4& projectionMatrix) const;
+	// Draws the body. The per-frame uniform block must have been updated for this frame
+	void Draw() const;
 
 	// gets the position
 	const glm::vec3& Position() const
@@ -43,6 +44,11 @@ public:
 		return m_mesh;
 	}
 
+	const glm::vec4& Color() const
+	{
+		return m_color;
+	}
+
 	// we must initialise it with a mesh and a shader
 	void SetMesh(const Mesh* mesh)
 	{
@@ -128,6 +134,7 @@ public:
 	void SetCoefficientOfRestitution(float cor) { m_cor = cor; }
 	virtual void SetMass(float mass) { m_mass = mass; }
 	void SetVelocity(const glm::vec3& velocity) { m_velocity = velocity; }
+	void SetId(int id) { m_id = id; }
 	
 	// Call this at the beginning of a simulation step
 	void ClearForcesImpulses() { m_accumulatedForce = glm::vec3(0.0f);  m_accumulatedImpulse = glm::vec3(0.0f); }
@@ -150,13 +157,15 @@ public:
 	
 	float Mass() const { return m_mass; }
 	const glm::vec3& Velocity() const { return m_velocity; }
-	const glm::vec3& AccumulatedForce() { return m_accumulatedForce; }
-	const glm::vec3& AccumulatedImpulse() { return m_accumulatedImpulse; }
-	float CoefficientOfRestitution() { return m_cor; }
+	const glm::vec3& AccumulatedForce() const { return m_accumulatedForce; }
+	const glm::vec3& AccumulatedImpulse() const { return m_accumulatedImpulse; }
+	float CoefficientOfRestitution() const { return m_cor; }
+	int Id() const { return m_id; }
 
 	glm::vec3 minEndPoints;
 	glm::vec3 maxEndPoints;
 private:
+	int m_id = -1;										// Unique identifier, unlike the index it survives the per-step sort
 	float m_cor = 0.9f;									// Coefficient of restitution
 	float m_mass = 1.0f;								// Particle mass, in kg
 	glm::vec3 m_velocity = glm::vec3(0.0f);				// Velocity, in m/s. Important! Must initialise (like this here), otherwise starting value would be undefined
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "Mesh.h"
+
+// Vertex and index arrays of a mesh generated at compile time, in the GPU-ready layout Mesh::Init takes
+template<size_t NumVertices, size_t NumIndices>
+struct StaticMesh
+{
+	std::array<MeshVertex, NumVertices> vertices{};
+	std::array<uint32_t, NumIndices> indices{};
+};
+
+// The standard library's math functions aren't constexpr, so the generators use these
+namespace ProceduralMath
+{
+	constexpr double PI = 3.14159265358979323846;
+
+	constexpr double Sqrt(double x)
+	{
+		if (x <= 0.0)
+			return 0.0;
+		// Newton's iteration, from above so it decreases monotonically until it stops moving
+		double r = x > 1.0 ? x : 1.0;
+		for (int i = 0; i < 100; i++)
+		{
+			double next = 0.5 * (r + x / r);
+			if (next >= r)
+				break;
+			r = next;
+		}
+		return r;
+	}
+
+	constexpr double Sin(double x)
+	{
+		while (x > PI)
+			x -= 2.0 * PI;
+		while (x < -PI)
+			x += 2.0 * PI;
+		// Taylor series, converged to double precision over [-pi, pi]
+		double term = x, sum = x;
+		for (int n = 1; n < 15; n++)
+		{
+			term *= -x * x / double((2 * n) * (2 * n + 1));
+			sum += term;
+		}
+		return sum;
+	}
+
+	constexpr double Cos(double x)
+	{
+		return Sin(x + 0.5 * PI);
+	}
+
+	constexpr glm::vec3 Normalize(double x, double y, double z)
+	{
+		double invLength = 1.0 / Sqrt(x * x + y * y + z * z);
+		return glm::vec3(float(x * invLength), float(y * invLength), float(z * invLength));
+	}
+}
+
+// Unit sphere made by splitting every triangle of an icosahedron in four, Subdivisions times, and pushing the new
+// vertices out to the sphere. Triangles are much more even than a UV sphere's, and there are no poles
+template<int Subdivisions>
+constexpr auto IcosphereMesh()
+{
+	constexpr size_t numVertices = 10 * (size_t(1) << (2 * Subdivisions)) + 2;
+	constexpr size_t numFaces = 20 * (size_t(1) << (2 * Subdivisions));
+	StaticMesh<numVertices, numFaces * 3> mesh;
+	using namespace ProceduralMath;
+
+	const double t = (1.0 + Sqrt(5.0)) / 2.0;
+	const double corners[12][3] = {
+		{ -1, t, 0 }, { 1, t, 0 }, { -1, -t, 0 }, { 1, -t, 0 },
+		{ 0, -1, t }, { 0, 1, t }, { 0, -1, -t }, { 0, 1, -t },
+		{ t, 0, -1 }, { t, 0, 1 }, { -t, 0, -1 }, { -t, 0, 1 }
+	};
+	const uint32_t icosahedron[20][3] = {
+		{ 0, 11, 5 }, { 0, 5, 1 }, { 0, 1, 7 }, { 0, 7, 10 }, { 0, 10, 11 },
+		{ 1, 5, 9 }, { 5, 11, 4 }, { 11, 10, 2 }, { 10, 7, 6 }, { 7, 1, 8 },
+		{ 3, 9, 4 }, { 3, 4, 2 }, { 3, 2, 6 }, { 3, 6, 8 }, { 3, 8, 9 },
+		{ 4, 9, 5 }, { 2, 4, 11 }, { 6, 2, 10 }, { 8, 6, 7 }, { 9, 8, 1 }
+	};
+
+	size_t vertexCount = 0;
+	for (const auto& c : corners)
+		mesh.vertices[vertexCount++].position = Normalize(c[0], c[1], c[2]);
+	size_t faceCount = 0;
+	for (const auto& face : icosahedron)
+	{
+		for (int j = 0; j < 3; j++)
+			mesh.indices[faceCount * 3 + j] = face[j];
+		faceCount++;
+	}
+
+	// Every vertex of an icosphere has 5 or 6 neighbours, so an edge's midpoint is found among the few edges recorded
+	// at its lower vertex
+	std::array<uint32_t, numVertices * 6> edgeOther{};
+	std::array<uint32_t, numVertices * 6> edgeMidpoint{};
+	std::array<uint8_t, numVertices> edgeCount{};
+	std::array<uint32_t, numFaces * 3> next{};
+
+	for (int level = 0; level < Subdivisions; level++)
+	{
+		for (auto& count : edgeCount)
+			count = 0;
+
+		auto midpoint = [&](uint32_t a, uint32_t b)
+		{
+			uint32_t lo = a < b ? a : b, hi = a < b ? b : a;
+			for (int k = 0; k < edgeCount[lo]; k++)
+				if (edgeOther[lo * 6 + k] == hi)
+					return edgeMidpoint[lo * 6 + k];
+
+			const glm::vec3& p = mesh.vertices[lo].position;
+			const glm::vec3& q = mesh.vertices[hi].position;
+			uint32_t m = uint32_t(vertexCount++);
+			mesh.vertices[m].position = Normalize(double(p.x) + q.x, double(p.y) + q.y, double(p.z) + q.z);
+			edgeOther[lo * 6 + edgeCount[lo]] = hi;
+			edgeMidpoint[lo * 6 + edgeCount[lo]] = m;
+			edgeCount[lo]++;
+			return m;
+		};
+
+		for (size_t f = 0; f < faceCount; f++)
+		{
+			uint32_t a = mesh.indices[f * 3], b = mesh.indices[f * 3 + 1], c = mesh.indices[f * 3 + 2];
+			uint32_t ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+			const uint32_t split[4][3] = { { a, ab, ca }, { b, bc, ab }, { c, ca, bc }, { ab, bc, ca } };
+			for (int s = 0; s < 4; s++)
+				for (int j = 0; j < 3; j++)
+					next[(f * 4 + s) * 3 + j] = split[s][j];
+		}
+		faceCount *= 4;
+		for (size_t i = 0; i < faceCount * 3; i++)
+			mesh.indices[i] = next[i];
+	}
+
+	// On a unit sphere the normal is the position
+	for (auto& vertex : mesh.vertices)
+		vertex.normal = vertex.position;
+	return mesh;
+}
+
+// Box with corners at +-1, flat shaded: each face has its own four vertices
+constexpr StaticMesh<24, 36> BoxMesh()
+{
+	StaticMesh<24, 36> mesh;
+
+	// Per face: the normal, and two tangents u and v with u x v = normal, so the corners below wind outwards
+	const float axes[6][3][3] = {
+		{ { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } },
+		{ { -1, 0, 0 }, { 0, 0, 1 }, { 0, 1, 0 } },
+		{ { 0, 1, 0 }, { 0, 0, 1 }, { 1, 0, 0 } },
+		{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },
+		{ { 0, 0, 1 }, { 1, 0, 0 }, { 0, 1, 0 } },
+		{ { 0, 0, -1 }, { 0, 1, 0 }, { 1, 0, 0 } }
+	};
+	const float corners[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+
+	for (int f = 0; f < 6; f++)
+	{
+		const auto& n = axes[f][0];
+		const auto& u = axes[f][1];
+		const auto& v = axes[f][2];
+		for (int c = 0; c < 4; c++)
+		{
+			MeshVertex& vertex = mesh.vertices[f * 4 + c];
+			vertex.position = glm::vec3(n[0] + corners[c][0] * u[0] + corners[c][1] * v[0],
+				n[1] + corners[c][0] * u[1] + corners[c][1] * v[1],
+				n[2] + corners[c][0] * u[2] + corners[c][1] * v[2]);
+			vertex.normal = glm::vec3(n[0], n[1], n[2]);
+		}
+		const uint32_t quad[6] = { 0, 1, 2, 0, 2, 3 };
+		for (int i = 0; i < 6; i++)
+			mesh.indices[f * 6 + i] = uint32_t(f * 4) + quad[i];
+	}
+	return mesh;
+}
+
+// Cone with its apex at y = 1 and a base of radius 1 at y = -1. The side is smooth shaded, so the apex is repeated per
+// segment with the normal half way across it; the base is a flat disc
+template<int Segments>
+constexpr auto ConeMesh()
+{
+	// Side ring, apexes, base centre, base ring
+	StaticMesh<3 * Segments + 1, 6 * Segments> mesh;
+	using namespace ProceduralMath;
+
+	const double radius = 1.0, height = 2.0;
+	const uint32_t ring = 0, apex = Segments, centre = 2 * Segments, baseRing = 2 * Segments + 1;
+
+	for (int i = 0; i < Segments; i++)
+	{
+		double angle = 2.0 * PI * i / Segments;
+		double middle = 2.0 * PI * (i + 0.5) / Segments;
+		glm::vec3 rim(float(radius * Cos(angle)), -1.0f, float(radius * Sin(angle)));
+
+		mesh.vertices[ring + i] = { rim, Normalize(height * Cos(angle), radius, height * Sin(angle)) };
+		mesh.vertices[apex + i] = { glm::vec3(0.0f, 1.0f, 0.0f), Normalize(height * Cos(middle), radius, height * Sin(middle)) };
+		mesh.vertices[baseRing + i] = { rim, glm::vec3(0.0f, -1.0f, 0.0f) };
+	}
+	mesh.vertices[centre] = { glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f) };
+
+	for (uint32_t i = 0; i < uint32_t(Segments); i++)
+	{
+		uint32_t next = (i + 1) % Segments;
+		const uint32_t side[3] = { apex + i, ring + next, ring + i };
+		const uint32_t base[3] = { centre, baseRing + i, baseRing + next };
+		for (int j = 0; j < 3; j++)
+		{
+			mesh.indices[i * 3 + j] = side[j];
+			mesh.indices[(Segments + i) * 3 + j] = base[j];
+		}
+	}
+	return mesh;
+}
+
+// The shapes the engine draws, generated into static storage when the program is compiled
+inline constexpr auto SPHERE_MESH = IcosphereMesh<3>();
+inline constexpr auto CUBE_MESH = BoxMesh();
+inline constexpr auto CONE_MESH = ConeMesh<32>();
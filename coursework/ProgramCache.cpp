@@ -0,0 +1,157 @@
+#include "ProgramCache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "MappedFile.h"
+
+namespace
+{
+	const char PROGRAM_MAGIC[4] = { 'P', 'B', 'P', 'G' };
+	// Bump when the layout of the file changes
+	const uint32_t PROGRAM_VERSION = 1;
+
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t binaryFormat;	// As returned by glGetProgramBinary
+		uint32_t binaryLength;
+		uint64_t key;			// Repeated from the file name, to catch renamed or mixed up files
+	};
+
+	// 64-bit FNV-1a, continued from hash
+	uint64_t Hash(uint64_t hash, std::string_view bytes)
+	{
+		for (unsigned char c : bytes)
+		{
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		// Separate the fields, so moving text from one to the next changes the hash
+		hash ^= 0xff;
+		hash *= 1099511628211ull;
+		return hash;
+	}
+
+	std::string_view GlString(GLenum name)
+	{
+		const char* value = reinterpret_cast<const char*>(glGetString(name));
+		return value ? std::string_view(value) : std::string_view();
+	}
+
+	std::string CachePath(const std::string& key)
+	{
+		return std::string(PROGRAM_CACHE_DIR) + "/" + key + ".bin";
+	}
+}
+
+bool ProgramBinarySupported()
+{
+	// Asked once: the answer doesn't change for the lifetime of the context
+	static const bool supported = []()
+	{
+		if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary)
+			return false;
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}();
+	return supported;
+}
+
+std::string ProgramCacheKey(std::string_view vertexSource, std::string_view fragmentSource)
+{
+	uint64_t hash = 14695981039346656037ull;
+	hash = Hash(hash, GlString(GL_VENDOR));
+	hash = Hash(hash, GlString(GL_RENDERER));
+	hash = Hash(hash, GlString(GL_VERSION));
+	hash = Hash(hash, GlString(GL_SHADING_LANGUAGE_VERSION));
+	hash = Hash(hash, vertexSource);
+	hash = Hash(hash, fragmentSource);
+
+	char key[17];
+	std::snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(hash));
+	return key;
+}
+
+bool LoadProgramBinary(GLuint program, const std::string& key)
+{
+	if (!ProgramBinarySupported())
+		return false;
+
+	std::string path = CachePath(key);
+	FileHeader header;
+	{
+		MappedFile file;
+		if (!file.Open(path))
+			return false;
+
+		bool valid = file.Size() >= sizeof(FileHeader);
+		if (valid)
+		{
+			std::memcpy(&header, file.Data(), sizeof(header));
+			valid = std::memcmp(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC)) == 0
+				&& header.version == PROGRAM_VERSION
+				&& header.key == std::stoull(key, nullptr, 16)
+				&& sizeof(FileHeader) + header.binaryLength <= file.Size();
+		}
+		if (valid)
+		{
+			glProgramBinary(program, GLenum(header.binaryFormat), file.Data() + sizeof(FileHeader), GLsizei(header.binaryLength));
+			GLint success = GL_FALSE;
+			glGetProgramiv(program, GL_LINK_STATUS, &success);
+			valid = success == GL_TRUE;
+		}
+		if (valid)
+			return true;
+	}
+
+	// Damaged, or built by a driver that no longer accepts it: it would only fail again
+	std::error_code error;
+	std::filesystem::remove(path, error);
+	return false;
+}
+
+void SaveProgramBinary(GLuint program, const std::string& key)
+{
+	if (!ProgramBinarySupported())
+		return;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	std::vector<char> bytes(sizeof(FileHeader) + size_t(length));
+	GLenum format = 0;
+	GLsizei written = 0;
+	glGetProgramBinary(program, length, &written, &format, bytes.data() + sizeof(FileHeader));
+	if (written <= 0)
+		return;
+
+	FileHeader header;
+	std::memcpy(header.magic, PROGRAM_MAGIC, sizeof(PROGRAM_MAGIC));
+	header.version = PROGRAM_VERSION;
+	header.binaryFormat = uint32_t(format);
+	header.binaryLength = uint32_t(written);
+	header.key = std::stoull(key, nullptr, 16);
+	std::memcpy(bytes.data(), &header, sizeof(header));
+	bytes.resize(sizeof(FileHeader) + size_t(written));
+
+	// Written to a temporary file and renamed, as for cooked meshes, so a crash never leaves half a binary behind
+	std::error_code error;
+	std::filesystem::create_directories(PROGRAM_CACHE_DIR, error);
+	std::string path = CachePath(key);
+	std::string tempPath = path + ".tmp";
+	{
+		std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+		if (!file.write(bytes.data(), std::streamsize(bytes.size())))
+			return;
+	}
+	std::filesystem::rename(tempPath, path, error);
+}
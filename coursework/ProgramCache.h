@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+#include <GL/glew.h>
+
+// Cache of linked shader programs, saved with glGetProgramBinary into PROGRAM_CACHE_DIR and reloaded with
+// glProgramBinary on later starts, so the GLSL is only compiled the first time. A program's key hashes its sources
+// together with the vendor, renderer and version strings, so a driver update or a different GPU misses the cache
+// instead of feeding the driver a binary it can't use. The driver may still reject a binary, in which case the
+// caller compiles from source as if the cache were empty.
+
+const char* const PROGRAM_CACHE_DIR = "shadercache";
+
+// True if the context can save and load program binaries (GL 4.1 or ARB_get_program_binary, and at least one format)
+bool ProgramBinarySupported();
+
+// Cache key of the program linked from these sources on the current driver
+std::string ProgramCacheKey(std::string_view vertexSource, std::string_view fragmentSource);
+
+// Loads the cached binary for key into program. False if there is none, or it is damaged or the driver rejects it;
+// a rejected binary is deleted so it isn't tried again
+bool LoadProgramBinary(GLuint program, const std::string& key);
+
+// Saves the binary of a successfully linked program under key. The program must have been linked with
+// GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+void SaveProgramBinary(GLuint program, const std::string& key);
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// Small random number generator (PCG32, O'Neill 2014) whose whole state is one integer, so it can be saved in a
+// checkpoint and restored to continue the exact same sequence. rand() can't do that: its state is hidden in the C library
+class Random
+{
+public:
+	explicit Random(uint64_t seed = 1) { Seed(seed); }
+
+	void Seed(uint64_t seed)
+	{
+		m_state = 0;
+		Next();
+		m_state += seed;
+		Next();
+	}
+
+	uint32_t Next()
+	{
+		uint64_t old = m_state;
+		m_state = old * 6364136223846793005ull + INCREMENT;
+		uint32_t xorShifted = uint32_t(((old >> 18) ^ old) >> 27);
+		uint32_t rotation = uint32_t(old >> 59);
+		return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+	}
+
+	// Uniform integer in [0, n), for n > 0
+	int Below(int n)
+	{
+		// Rejection keeps it unbiased: the values above the last multiple of n are drawn again
+		uint32_t bound = uint32_t(n);
+		uint32_t threshold = (0u - bound) % bound;
+		for (;;)
+		{
+			uint32_t r = Next();
+			if (r >= threshold)
+				return int(r % bound);
+		}
+	}
+
+	uint64_t State() const { return m_state; }
+	void SetState(uint64_t state) { m_state = state; }
+
+private:
+	static const uint64_t INCREMENT = 1442695040888963407ull;
+
+	uint64_t m_state = 0;
+};
+
+// What a counter-based draw is for, so that the draws for one particle in one step are independent of each other
+enum class RandomPurpose : uint32_t
+{
+	SpawnType,
+	SpawnPosition,
+	SpawnVelocity,
+	Brownian
+};
+
+// Counter of a draw: the particle, the step, and what the numbers are for. index tells apart several draws for the
+// same purpose, e.g. the substeps
+inline glm::uvec4 RandomCounter(uint32_t id, uint64_t step, RandomPurpose purpose, uint32_t index = 0)
+{
+	return glm::uvec4(id, uint32_t(step), uint32_t(step >> 32), uint32_t(purpose) << 24 | index);
+}
+
+// Counter-based generator (Philox4x32-10, Salmon et al. 2011). Its output is a pure function of a 128-bit counter and
+// a 64-bit key with no state in between, so any particle's numbers for any step can be drawn on any thread and in any
+// order, and always come out the same: unlike Random, it doesn't have to be shared, locked or drawn from in sequence
+class Philox
+{
+public:
+	explicit Philox(uint64_t key = 0) : m_key(uint32_t(key), uint32_t(key >> 32)) {}
+
+	glm::uvec4 operator()(const glm::uvec4& counter) const
+	{
+		uint32_t c0 = counter.x, c1 = counter.y, c2 = counter.z, c3 = counter.w;
+		uint32_t k0 = m_key.x, k1 = m_key.y;
+		for (int round = 0; round < ROUNDS; round++)
+		{
+			Round(c0, c1, c2, c3, k0, k1);
+			k0 += WEYL0;
+			k1 += WEYL1;
+		}
+		return glm::uvec4(c0, c1, c2, c3);
+	}
+
+	// Draws for count particles at once: out[i] = (*this)(RandomCounter(ids[i], step, purpose, index)). The particles
+	// go through the rounds in blocks of eight lanes, which the compiler turns into vector instructions
+	void Generate(const uint32_t* ids, int count, uint64_t step, RandomPurpose purpose, uint32_t index, glm::uvec4* out) const
+	{
+		const int LANES = 8;
+		glm::uvec4 base = RandomCounter(0, step, purpose, index);
+		for (int first = 0; first < count; first += LANES)
+		{
+			uint32_t c0[LANES], c1[LANES], c2[LANES], c3[LANES];
+			for (int k = 0; k < LANES; k++)
+			{
+				c0[k] = first + k < count ? ids[first + k] : 0;
+				c1[k] = base.y;
+				c2[k] = base.z;
+				c3[k] = base.w;
+			}
+
+			uint32_t k0 = m_key.x, k1 = m_key.y;
+			for (int round = 0; round < ROUNDS; round++)
+			{
+				for (int k = 0; k < LANES; k++)
+					Round(c0[k], c1[k], c2[k], c3[k], k0, k1);
+				k0 += WEYL0;
+				k1 += WEYL1;
+			}
+
+			for (int k = 0; k < LANES && first + k < count; k++)
+				out[first + k] = glm::uvec4(c0[k], c1[k], c2[k], c3[k]);
+		}
+	}
+
+	// Uniform floats in [0, 1), from the top 24 bits so every value is exactly representable
+	static float ToUniform(uint32_t bits) { return float(bits >> 8) * (1.0f / 16777216.0f); }
+	static glm::vec4 ToUniform(const glm::uvec4& bits)
+	{
+		return glm::vec4(ToUniform(bits.x), ToUniform(bits.y), ToUniform(bits.z), ToUniform(bits.w));
+	}
+
+	// Four independent standard normal values (Box-Muller, two from each pair of uniforms)
+	static glm::vec4 ToNormal(const glm::uvec4& bits)
+	{
+		glm::vec4 u = ToUniform(bits);
+		// 1 - u is in (0, 1], so the logarithms are finite
+		float r0 = std::sqrt(-2.0f * std::log(1.0f - u.x)), r1 = std::sqrt(-2.0f * std::log(1.0f - u.z));
+		float a0 = 6.28318531f * u.y, a1 = 6.28318531f * u.w;
+		return glm::vec4(r0 * std::cos(a0), r0 * std::sin(a0), r1 * std::cos(a1), r1 * std::sin(a1));
+	}
+
+private:
+	static const int ROUNDS = 10;
+	static const uint32_t MULTIPLIER0 = 0xD2511F53u;
+	static const uint32_t MULTIPLIER1 = 0xCD9E8D57u;
+	static const uint32_t WEYL0 = 0x9E3779B9u;
+	static const uint32_t WEYL1 = 0xBB67AE85u;
+
+	static void Round(uint32_t& c0, uint32_t& c1, uint32_t& c2, uint32_t& c3, uint32_t k0, uint32_t k1)
+	{
+		uint64_t p0 = uint64_t(MULTIPLIER0) * c0;
+		uint64_t p1 = uint64_t(MULTIPLIER1) * c2;
+		uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+		uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+		c1 = uint32_t(p1);
+		c3 = uint32_t(p0);
+		c0 = n0;
+		c2 = n2;
+	}
+
+	glm::uvec2 m_key;
+};
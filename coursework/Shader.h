@@ -5,10 +5,15 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 
 #include <GL/glew.h>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+
+#include "ProgramCache.h"
 
 // Helper function -- reads a text file to a string
 inline std::string ReadAllText(const char * filepath)
@@ -19,6 +24,41 @@ inline std::string ReadAllText(const char * filepath)
 	return buffer.str();
 }
 
+// Binding point of the "PerFrame" uniform block, shared by every shader
+const GLuint PER_FRAME_BINDING = 0;
+
+// Per-frame uniforms, mirroring the std140 "PerFrame" block declared in the shaders. mat4s need no std140 padding
+struct PerFrameUniforms
+{
+	glm::mat4 view;
+	glm::mat4 projection;
+};
+
+// Uniform buffer object, holding data that many shaders read (e.g. the camera) so it is uploaded once per frame
+class UniformBuffer
+{
+public:
+	void Create(GLsizeiptr size, GLuint bindingPoint)
+	{
+		glGenBuffers(1, &m_buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+		glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, m_buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	template<typename T>
+	void Update(const T& data) const
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, m_buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+private:
+	GLuint m_buffer = 0;
+};
+
 // Shader helper class, only stores the OpenGL "program" which is a set of linked vertex and fragment shaders
 class Shader
 {
@@ -31,8 +71,24 @@ public:
 		CreateFromSource(vertexSource, fragmentSource);
 	}
 
+	// Loads the program from the binary cache if an earlier run linked the same sources on the same driver, otherwise
+	// compiles and links it and adds it to the cache
 	void CreateFromSource(const std::string_view vertexSource, const std::string_view fragmentSource)
 	{
+		if (m_program != 0)
+			glDeleteProgram(m_program);
+		m_program = glCreateProgram();
+
+		std::string cacheKey = ProgramCacheKey(vertexSource, fragmentSource);
+		if (LoadProgramBinary(m_program, cacheKey))
+		{
+			Reflect();
+			return;
+		}
+		// Start again from a fresh program rather than one a rejected binary was loaded into
+		glDeleteProgram(m_program);
+		m_program = glCreateProgram();
+
 		const GLchar* vShaderCode = vertexSource.data();
 		const GLchar* fShaderCode = fragmentSource.data();
 		// 2. Compile shaders
@@ -62,11 +118,10 @@ public:
 			std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
 		}
 		// Shader Program
-		if (m_program != 0)
-			glDeleteProgram(m_program);
-		m_program = glCreateProgram();
 		glAttachShader(m_program, vertex);
 		glAttachShader(m_program, fragment);
+		if (ProgramBinarySupported())
+			glProgramParameteri(m_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(m_program);
 		// Print linking errors if any
 		glGetProgramiv(m_program, GL_LINK_STATUS, &success);
@@ -75,9 +130,13 @@ public:
 			glGetProgramInfoLog(m_program, 512, NULL, infoLog);
 			std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 		}
+		else
+			SaveProgramBinary(m_program, cacheKey);
 		// Delete the shaders as they're linked into our program now and no longer necessery
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
+
+		Reflect();
 	}
 	
 	// Set current shader as active
@@ -86,29 +145,82 @@ public:
 		glUseProgram(m_program);
 	}
 
+	// Location of a uniform, from the table filled at link time. -1 if the program doesn't use it
+	GLint UniformLocation(const char* uniformName) const
+	{
+		for (const auto& uniform : m_uniforms)
+			if (uniform.name == uniformName)
+				return uniform.location;
+		return -1;
+	}
+
 	// Helper to set a matrix uniform
 	void SetUniform(const char* uniformName, const glm::mat4& uniformValue) const
 	{
-		GLint loc = glGetUniformLocation(m_program, uniformName);
+		GLint loc = UniformLocation(uniformName);
 		glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(uniformValue));
 	}
 
 	// Helper to set a vec4 uniform
 	void SetUniform(const char* uniformName, const glm::vec4& uniformValue) const
 	{
-		GLint loc = glGetUniformLocation(m_program, uniformName);
+		GLint loc = UniformLocation(uniformName);
 		glUniform4fv(loc, 1, glm::value_ptr(uniformValue));
 	}
 
 	// Helper to set a float uniform
 	void SetUniform(const char* uniformName, const float uniformValue) const
 	{
-		GLint loc = glGetUniformLocation(m_program, uniformName);
+		GLint loc = UniformLocation(uniformName);
 		glUniform1fv(loc, 1, &uniformValue);
 	}
 
 private:
+	// Queries the active uniforms once after linking, so setting a uniform never asks the driver for its location.
+	// Also connects the "PerFrame" block, if the program declares it, to its binding point
+	void Reflect()
+	{
+		m_uniforms.clear();
+
+		GLint count = 0, maxLength = 0;
+		glGetProgramiv(m_program, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(m_program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::string name(std::max(maxLength, 1), '\0');
+		for (GLint i = 0; i < count; i++)
+		{
+			GLsizei length = 0;
+			GLint size = 0;
+			GLenum type = 0;
+			glGetActiveUniform(m_program, GLuint(i), GLsizei(name.size()), &length, &size, &type, &name[0]);
+			std::string uniformName(name.data(), length);
+
+			// Members of uniform blocks have no location
+			GLint location = glGetUniformLocation(m_program, uniformName.c_str());
+			if (location < 0)
+				continue;
+
+			// Arrays are reported as "name[0]", but set by their plain name
+			auto bracket = uniformName.find('[');
+			if (bracket != std::string::npos)
+				uniformName.resize(bracket);
+			m_uniforms.push_back({ uniformName, location });
+		}
+
+		GLuint blockIndex = glGetUniformBlockIndex(m_program, "PerFrame");
+		if (blockIndex != GL_INVALID_INDEX)
+			glUniformBlockBinding(m_program, blockIndex, PER_FRAME_BINDING);
+	}
+
+	struct UniformInfo
+	{
+		std::string name;
+		GLint location;
+	};
+
 	GLuint m_program = 0;
+
+	// A program has only a few uniforms, so a flat array is faster to search than a map
+	std::vector<UniformInfo> m_uniforms;
 };
 
 // Create a default shader for our objects
@@ -119,15 +231,33 @@ inline Shader CreateDefaultShader()
 		#version 330 core
 		layout (location = 0) in vec3 position_in;
 		layout (location = 1) in vec3 normal_in;
+		layout (location = 4) in vec2 octahedralNormal_in;
 
-		uniform mat4 modelViewProjectionMatrix;
+		layout (std140) uniform PerFrame
+		{
+			mat4 view;
+			mat4 projection;
+		};
+		uniform mat4 model;
 
 		out vec3 normal;
 
+		// Compact meshes provide octahedral normals instead, leaving normal_in at its default of zero
+		vec3 MeshNormal()
+		{
+			if (normal_in != vec3(0.0))
+				return normal_in;
+			vec3 n = vec3(octahedralNormal_in, 1.0 - abs(octahedralNormal_in.x) - abs(octahedralNormal_in.y));
+			float fold = max(-n.z, 0.0);
+			n.xy += vec2(n.x >= 0.0 ? -fold : fold, n.y >= 0.0 ? -fold : fold);
+			return normalize(n);
+		}
+
 		void main()
 		{
-			normal = normal_in;
-			gl_Position = modelViewProjectionMatrix * vec4(position_in, 1.0f);
+			mat4 modelView = view * model;
+			normal = transpose(inverse(mat3(modelView))) * MeshNormal();
+			gl_Position = projection * modelView * vec4(position_in, 1.0f);
 		}
 	)";
 
@@ -136,13 +266,12 @@ inline Shader CreateDefaultShader()
 		out vec4 fragmentColor;
 
 		uniform vec4 color = vec4(0.5,0.5,0.5,1.0);
-		uniform mat4 normalMatrix;
 
 		in vec3 normal;
 
 		void main()
 		{
-			vec3 n = normalize((normalMatrix * vec4(normalize(normal),0)).xyz);
+			vec3 n = normalize(normal);
 			float NdotL = abs(dot(n, vec3(0,0,1))); // abs for double-sided lighting
 			fragmentColor = vec4( color.xyz * (0.2 + 0.8*NdotL), color.a);
 		}
@@ -151,3 +280,144 @@ inline Shader CreateDefaultShader()
 	shader.CreateFromSource(vertexSource, fragmentSource);
 	return shader;
 }
+
+// Shader for instanced spheres: each instance brings its own position, radius and color,
+// and the normal matrix is derived in the vertex shader rather than uploaded per object
+inline Shader CreateInstancedShader()
+{
+	const char* vertexSource = R"(
+		#version 330 core
+		layout (location = 0) in vec3 position_in;
+		layout (location = 1) in vec3 normal_in;
+		layout (location = 2) in vec4 instancePositionRadius;
+		layout (location = 3) in vec4 instanceColor;
+		layout (location = 4) in vec2 octahedralNormal_in;
+
+		layout (std140) uniform PerFrame
+		{
+			mat4 view;
+			mat4 projection;
+		};
+
+		out vec3 normal;
+		out vec4 color;
+
+		// Compact meshes provide octahedral normals instead, leaving normal_in at its default of zero
+		vec3 MeshNormal()
+		{
+			if (normal_in != vec3(0.0))
+				return normal_in;
+			vec3 n = vec3(octahedralNormal_in, 1.0 - abs(octahedralNormal_in.x) - abs(octahedralNormal_in.y));
+			float fold = max(-n.z, 0.0);
+			n.xy += vec2(n.x >= 0.0 ? -fold : fold, n.y >= 0.0 ? -fold : fold);
+			return normalize(n);
+		}
+
+		void main()
+		{
+			vec3 worldPos = instancePositionRadius.xyz + instancePositionRadius.w * position_in;
+			// The model matrix is a translation and a uniform scale, so the normal matrix reduces to the view rotation
+			normal = mat3(view) * MeshNormal();
+			color = instanceColor;
+			gl_Position = projection * view * vec4(worldPos, 1.0f);
+		}
+	)";
+
+	const char* fragmentSource = R"(
+		#version 330 core
+		out vec4 fragmentColor;
+
+		in vec3 normal;
+		in vec4 color;
+
+		void main()
+		{
+			vec3 n = normalize(normal);
+			float NdotL = abs(dot(n, vec3(0,0,1))); // abs for double-sided lighting
+			fragmentColor = vec4( color.xyz * (0.2 + 0.8*NdotL), color.a);
+		}
+	)";
+	Shader shader;
+	shader.CreateFromSource(vertexSource, fragmentSource);
+	return shader;
+}
+
+// Shader for sphere impostors: each instance is a camera-facing quad, and the fragment shader intersects the view ray
+// with the exact sphere to get its normal and depth. Four vertices per sphere instead of the mesh's thousands, and the
+// silhouette is pixel-perfect at any distance. Plain GLSL 3.30, so it runs on software GL too
+inline Shader CreateImpostorShader()
+{
+	const char* vertexSource = R"(
+		#version 330 core
+		layout (location = 0) in vec3 position_in;
+		layout (location = 2) in vec4 instancePositionRadius;
+		layout (location = 3) in vec4 instanceColor;
+
+		layout (std140) uniform PerFrame
+		{
+			mat4 view;
+			mat4 projection;
+		};
+
+		out vec3 viewPos;
+		flat out vec4 sphere;
+		flat out vec4 color;
+
+		void main()
+		{
+			vec3 centre = (view * vec4(instancePositionRadius.xyz, 1.0f)).xyz;
+			float radius = instancePositionRadius.w;
+
+			// The quad lies through the centre, facing the camera. Under perspective the silhouette is wider than the
+			// radius: the tangent cone cuts the quad's plane in a circle of radius r*d/sqrt(d^2-r^2)
+			float d = length(centre);
+			vec3 toCamera = -centre / max(d, 1e-6f);
+			vec3 helper = abs(toCamera.y) < 0.99f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+			vec3 right = normalize(cross(helper, toCamera));
+			vec3 up = cross(toCamera, right);
+			float halfSize = radius * d / sqrt(max(d * d - radius * radius, 1e-6f));
+
+			viewPos = centre + halfSize * (position_in.x * right + position_in.y * up);
+			sphere = vec4(centre, radius);
+			color = instanceColor;
+			gl_Position = projection * vec4(viewPos, 1.0f);
+		}
+	)";
+
+	const char* fragmentSource = R"(
+		#version 330 core
+		out vec4 fragmentColor;
+
+		layout (std140) uniform PerFrame
+		{
+			mat4 view;
+			mat4 projection;
+		};
+
+		in vec3 viewPos;
+		flat in vec4 sphere;
+		flat in vec4 color;
+
+		void main()
+		{
+			// Ray from the eye through this fragment against the sphere: |t*dir - centre|^2 = r^2
+			vec3 dir = normalize(viewPos);
+			float b = dot(dir, sphere.xyz);
+			float h = b * b - dot(sphere.xyz, sphere.xyz) + sphere.w * sphere.w;
+			if (h < 0.0f)
+				discard;
+
+			vec3 hit = dir * (b - sqrt(h));
+			vec3 n = (hit - sphere.xyz) / sphere.w;
+
+			vec4 clipPos = projection * vec4(hit, 1.0f);
+			gl_FragDepth = 0.5f * (clipPos.z / clipPos.w) * (gl_DepthRange.far - gl_DepthRange.near) + 0.5f * (gl_DepthRange.far + gl_DepthRange.near);
+
+			float NdotL = abs(dot(n, vec3(0,0,1))); // same lighting as the mesh
+			fragmentColor = vec4( color.xyz * (0.2 + 0.8*NdotL), color.a);
+		}
+	)";
+	Shader shader;
+	shader.CreateFromSource(vertexSource, fragmentSource);
+	return shader;
+}
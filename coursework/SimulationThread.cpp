@@ -0,0 +1,81 @@
+#include "SimulationThread.h"
+
+#include <algorithm>
+
+void SimulationThread::Start(PhysicsEngine& engine, double dt)
+{
+	m_engine = &engine;
+	m_dt = dt;
+	m_start = std::chrono::steady_clock::now();
+
+	// Publish the initial state, so there is something to draw straight away
+	m_engine->WriteSnapshot(m_snapshots.WriteBuffer(), 0.0);
+	m_snapshots.Publish();
+
+	m_running = true;
+	m_thread = std::thread(&SimulationThread::Run, this);
+}
+
+void SimulationThread::Stop()
+{
+	m_running = false;
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void SimulationThread::PostKey(int keyCode, bool pressed)
+{
+	std::lock_guard<std::mutex> lock(m_inputMutex);
+	m_input.push_back({ keyCode, pressed });
+}
+
+double SimulationThread::Elapsed() const
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+float SimulationThread::InterpolationAlpha(const RenderSnapshot& snapshot) const
+{
+	// The snapshot's state belongs to snapshot.time; the clock is usually a fraction of a step ahead of it
+	double alpha = (Elapsed() - snapshot.time) / m_dt;
+	return float(std::clamp(alpha, 0.0, 1.0));
+}
+
+void SimulationThread::Run()
+{
+	double t = 0.0;
+	std::vector<KeyEvent> input;
+
+	while (m_running)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_inputMutex);
+			input.swap(m_input);
+		}
+		for (const auto& evt : input)
+			m_engine->HandleInputKey(evt.keyCode, evt.pressed);
+		input.clear();
+
+		int steps = 0;
+		while (t + m_dt <= Elapsed() && steps < MAX_CATCH_UP_STEPS)
+		{
+			m_engine->Update(float(m_dt), float(t));
+			t += m_dt;
+			steps++;
+
+			m_engine->WriteSnapshot(m_snapshots.WriteBuffer(), t);
+			m_snapshots.Publish();
+		}
+
+		// Too far behind: let the simulation run slower than real time rather than spiral
+		if (steps == MAX_CATCH_UP_STEPS)
+			t = std::max(t, Elapsed() - m_dt);
+
+		if (steps == 0)
+		{
+			double wait = t + m_dt - Elapsed();
+			if (wait > 0.0)
+				std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+		}
+	}
+}
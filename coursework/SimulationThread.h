@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PhysicsEngine.h"
+#include "TripleBuffer.h"
+
+// Runs the physics engine at a fixed timestep on its own thread, so a slow step never delays the swap buffers and a
+// slow frame never makes the physics catch up. Every step publishes a render snapshot through a lock-free triple
+// buffer; the render thread interpolates between the two states a snapshot carries.
+class SimulationThread
+{
+public:
+	~SimulationThread() { Stop(); }
+
+	void Start(PhysicsEngine& engine, double dt);
+	void Stop();
+
+	// Input events are handed to the physics thread, which applies them between two steps
+	void PostKey(int keyCode, bool pressed);
+
+	// Latest snapshot, or nullptr before the first step
+	const RenderSnapshot* LatestSnapshot() { return m_snapshots.Read(); }
+
+	// How far the clock has moved past the snapshot's current state, in steps: 0 shows the previous state, 1 the current
+	float InterpolationAlpha(const RenderSnapshot& snapshot) const;
+
+private:
+	struct KeyEvent
+	{
+		int keyCode;
+		bool pressed;
+	};
+
+	void Run();
+	double Elapsed() const;
+
+	// If the physics falls further behind than this many steps, the extra time is dropped
+	static const int MAX_CATCH_UP_STEPS = 5;
+
+	PhysicsEngine* m_engine = nullptr;
+	double m_dt = 1.0 / 60.0;
+	std::chrono::steady_clock::time_point m_start;
+
+	std::thread m_thread;
+	std::atomic<bool> m_running{ false };
+
+	TripleBuffer<RenderSnapshot> m_snapshots;
+
+	std::mutex m_inputMutex;
+	std::vector<KeyEvent> m_input;
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Parallel.h"
+
+// 64-bit hash of the exact bits of some simulation state, for checking cheaply that two runs are identical. Not
+// cryptographic: it only has to make an accidental match between two different states vanishingly unlikely
+class StateHash
+{
+public:
+	void Add(uint64_t word)
+	{
+		m_hash = Mix(m_hash ^ word);
+	}
+
+	void Add(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		Add(uint64_t(bits));
+	}
+
+	void Add(double value)
+	{
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		Add(bits);
+	}
+
+	void Add(const glm::vec3& v)
+	{
+		Add(v.x);
+		Add(v.y);
+		Add(v.z);
+	}
+
+	template<typename T>
+	void Add(const std::vector<T>& values)
+	{
+		Add(uint64_t(values.size()));
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(values.data());
+		size_t size = values.size() * sizeof(T);
+		size_t i = 0;
+		for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+		{
+			uint64_t word;
+			std::memcpy(&word, bytes + i, sizeof(word));
+			Add(word);
+		}
+		if (i < size)
+		{
+			uint64_t tail = 0;
+			std::memcpy(&tail, bytes + i, size - i);
+			Add(tail);
+		}
+	}
+
+	uint64_t Value() const { return m_hash; }
+
+private:
+	// Finaliser of MurmurHash3: every input bit affects every output bit
+	static uint64_t Mix(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	uint64_t m_hash = 0x9e3779b97f4a7c15ull;
+};
+
+// Hash of count items, each added to a StateHash by addItem(hash, i). Items are hashed in fixed blocks in parallel
+// and the block hashes combined in order, so the value doesn't depend on the number of threads
+template<typename AddItem>
+uint64_t HashItems(int count, const AddItem& addItem)
+{
+	const int blockSize = 1024;
+	int numBlocks = (count + blockSize - 1) / blockSize;
+	std::vector<uint64_t> blockHashes(numBlocks);
+	ParallelFor(numBlocks, [&](int b)
+		{
+			StateHash hash;
+			int end = std::min(count, (b + 1) * blockSize);
+			for (int i = b * blockSize; i < end; i++)
+				addItem(hash, i);
+			blockHashes[b] = hash.Value();
+		}, 1);
+
+	StateHash hash;
+	hash.Add(uint64_t(count));
+	for (uint64_t blockHash : blockHashes)
+		hash.Add(blockHash);
+	return hash.Value();
+}
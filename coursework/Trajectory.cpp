@@ -0,0 +1,528 @@
+#include "Trajectory.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "Compression.h"
+
+namespace
+{
+	const char FILE_MAGIC[4] = { 'P', 'B', 'T', 'R' };
+	const char CHUNK_MAGIC[4] = { 'T', 'C', 'H', 'K' };
+	const char INDEX_MAGIC[4] = { 'T', 'I', 'D', 'X' };
+	// Bump when the layout of the file or the encoding of the frames changes
+	const uint32_t TRAJECTORY_VERSION = 2;
+
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		float positionPrecision;
+		uint32_t keyframeInterval;
+	};
+
+	// Followed by the frames' times (frameCount doubles), then the compressed frames
+	struct ChunkHeader
+	{
+		char magic[4];
+		uint32_t firstFrame;
+		uint32_t frameCount;
+		uint32_t rawSize;
+		uint32_t compressedSize;
+	};
+
+	struct IndexEntry
+	{
+		uint64_t offset;	// Of the chunk header, from the start of the file
+		uint32_t firstFrame;
+		uint32_t frameCount;
+	};
+
+	// Last bytes of the file, after the index entries
+	struct IndexFooter
+	{
+		uint64_t indexOffset;
+		uint32_t chunkCount;
+		char magic[4];
+	};
+
+	// Signed values are zigzag mapped (0, -1, 1, -2, ...) so small magnitudes of either sign make short varints
+	uint64_t ZigZag(int64_t value)
+	{
+		return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+	}
+
+	int64_t UnZigZag(uint64_t value)
+	{
+		return int64_t(value >> 1) ^ -int64_t(value & 1);
+	}
+
+	// 7 bits per byte, low bits first, high bit set on all but the last byte
+	void WriteVarint(std::vector<uint8_t>& out, uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			out.push_back(uint8_t(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(uint8_t(value));
+	}
+
+	bool ReadVarint(const std::vector<uint8_t>& in, size_t& cursor, uint64_t& value)
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			if (cursor >= in.size())
+				return false;
+			uint8_t byte = in[cursor++];
+			value |= uint64_t(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	int32_t Quantise(float value, float precision)
+	{
+		double q = std::round(double(value) / precision);
+		return int32_t(std::clamp(q, double(INT32_MIN), double(INT32_MAX)));
+	}
+
+	// Where a particle would be, in quanta, had it moved from its previous position at its current velocity. That is
+	// exactly what symplectic Euler does, so for most particles only the quantisation error is left to store.
+	// Evaluated the same way when reading, so both sides predict the same value
+	int64_t PredictPosition(int32_t previous, float velocity, double dt, float precision)
+	{
+		return int64_t(previous) + Quantise(float(double(velocity) * dt), precision);
+	}
+
+	glm::uvec3 Bits(const glm::vec3& v)
+	{
+		glm::uvec3 bits;
+		std::memcpy(&bits, &v, sizeof(bits));
+		return bits;
+	}
+
+	// For each id, the index of the same id in the previous frame, or -1. Both lists are ordered, so one merge pass
+	// finds them all
+	void MatchPrevious(const std::vector<uint64_t>& ids, const std::vector<uint64_t>& previousIds, std::vector<int>& match)
+	{
+		match.resize(ids.size());
+		size_t j = 0;
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			while (j < previousIds.size() && previousIds[j] < ids[i])
+				j++;
+			match[i] = j < previousIds.size() && previousIds[j] == ids[i] ? int(j) : -1;
+		}
+	}
+}
+
+// Recorder
+
+TrajectoryRecorder::~TrajectoryRecorder()
+{
+	Stop();
+	Join();
+}
+
+bool TrajectoryRecorder::Start(const std::string& path, const Settings& settings)
+{
+	Stop();
+	Join();
+
+	m_file.open(path, std::ios::binary | std::ios::trunc);
+	if (!m_file)
+		return false;
+
+	m_settings = settings;
+	m_settings.keyframeInterval = std::max(1, m_settings.keyframeInterval);
+
+	FileHeader header;
+	std::memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+	header.version = TRAJECTORY_VERSION;
+	header.positionPrecision = m_settings.positionPrecision;
+	header.keyframeInterval = uint32_t(m_settings.keyframeInterval);
+	m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	m_fileOffset = sizeof(header);
+	m_chunks.clear();
+	m_frameCount = 0;
+	m_chunkFirstFrame = 0;
+	m_chunkTimes.clear();
+	m_chunkData.clear();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = false;
+		m_recorded = 0;
+		m_dropped = 0;
+	}
+	m_recording = true;
+	m_thread = std::thread(&TrajectoryRecorder::WriterLoop, this);
+	return true;
+}
+
+void TrajectoryRecorder::Stop()
+{
+	if (!m_recording)
+		return;
+	m_recording = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wake.notify_one();
+}
+
+void TrajectoryRecorder::Join()
+{
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void TrajectoryRecorder::Submit(TrajectoryFrame& frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_recording)
+			return;
+		if (int(m_queue.size()) >= MAX_QUEUED_FRAMES)
+		{
+			m_dropped++;
+			return;
+		}
+
+		m_queue.push_back(std::move(frame));
+		if (!m_free.empty())
+		{
+			frame = std::move(m_free.back());
+			m_free.pop_back();
+		}
+		else
+			frame = TrajectoryFrame();
+	}
+	m_wake.notify_one();
+}
+
+int TrajectoryRecorder::RecordedFrames() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_recorded;
+}
+
+int TrajectoryRecorder::DroppedFrames() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_dropped;
+}
+
+void TrajectoryRecorder::WriterLoop()
+{
+	for (;;)
+	{
+		TrajectoryFrame frame;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+			// Stopping only ends the loop once every queued frame is written
+			if (m_queue.empty())
+				break;
+			frame = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		EncodeFrame(frame);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_recorded++;
+		m_free.push_back(std::move(frame));
+	}
+
+	FlushChunk();
+	WriteIndex();
+	m_file.close();
+}
+
+void TrajectoryRecorder::EncodeFrame(const TrajectoryFrame& frame)
+{
+	// A keyframe is encoded against nothing, so decoding can start there
+	if (m_chunkTimes.empty())
+	{
+		m_previousIds.clear();
+		m_previousPositions.clear();
+		m_previousVelocities.clear();
+	}
+
+	std::vector<int> match;
+	MatchPrevious(frame.ids, m_previousIds, match);
+
+	size_t count = frame.ids.size();
+	auto& out = m_chunkData;
+	WriteVarint(out, count);
+
+	// The engine's ids are slot << 32 | generation, so the upper halves mostly step by one and the lower ones are small
+	int64_t lastHigh = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		int64_t high = int64_t(frame.ids[i] >> 32);
+		WriteVarint(out, ZigZag(high - lastHigh));
+		WriteVarint(out, frame.ids[i] & 0xFFFFFFFFu);
+		lastHigh = high;
+	}
+
+	std::vector<glm::ivec3> positions(count);
+	for (size_t i = 0; i < count; i++)
+		for (int c = 0; c < 3; c++)
+			positions[i][c] = Quantise(frame.positions[i][c], m_settings.positionPrecision);
+
+	std::vector<glm::uvec3> velocities(count);
+	for (size_t i = 0; i < count; i++)
+		velocities[i] = Bits(frame.velocities[i]);
+
+	// One column per component: neighbouring bytes are then alike, which the compression makes use of
+	for (int c = 0; c < 3; c++)
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t reference = match[i] >= 0 ? m_previousVelocities[match[i]][c] : 0u;
+			WriteVarint(out, velocities[i][c] ^ reference);
+		}
+	double dt = m_chunkTimes.empty() ? 0.0 : frame.time - m_chunkTimes.back();
+	for (int c = 0; c < 3; c++)
+		for (size_t i = 0; i < count; i++)
+		{
+			int64_t predicted = match[i] >= 0 ? PredictPosition(m_previousPositions[match[i]][c], frame.velocities[i][c], dt, m_settings.positionPrecision) : 0;
+			WriteVarint(out, ZigZag(int64_t(positions[i][c]) - predicted));
+		}
+
+	m_previousIds = frame.ids;
+	m_previousPositions.swap(positions);
+	m_previousVelocities.swap(velocities);
+
+	m_chunkTimes.push_back(frame.time);
+	m_frameCount++;
+	if (int(m_chunkTimes.size()) >= m_settings.keyframeInterval)
+		FlushChunk();
+}
+
+void TrajectoryRecorder::FlushChunk()
+{
+	if (m_chunkTimes.empty())
+		return;
+
+	ChunkHeader header;
+	std::memcpy(header.magic, CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+	header.firstFrame = m_chunkFirstFrame;
+	header.frameCount = uint32_t(m_chunkTimes.size());
+	header.rawSize = uint32_t(m_chunkData.size());
+
+	// Header, times and compressed frames go out in one write
+	m_compressed.resize(sizeof(ChunkHeader) + m_chunkTimes.size() * sizeof(double));
+	std::memcpy(m_compressed.data() + sizeof(ChunkHeader), m_chunkTimes.data(), m_chunkTimes.size() * sizeof(double));
+	LzCompress(m_chunkData.data(), m_chunkData.size(), m_compressed);
+	header.compressedSize = uint32_t(m_compressed.size() - sizeof(ChunkHeader) - m_chunkTimes.size() * sizeof(double));
+	std::memcpy(m_compressed.data(), &header, sizeof(header));
+
+	m_file.write(reinterpret_cast<const char*>(m_compressed.data()), std::streamsize(m_compressed.size()));
+	m_chunks.push_back({ m_fileOffset, header.firstFrame, header.frameCount });
+	m_fileOffset += m_compressed.size();
+
+	m_chunkFirstFrame = m_frameCount;
+	m_chunkTimes.clear();
+	m_chunkData.clear();
+}
+
+void TrajectoryRecorder::WriteIndex()
+{
+	std::vector<IndexEntry> entries;
+	for (const auto& chunk : m_chunks)
+		entries.push_back({ chunk.offset, chunk.firstFrame, chunk.frameCount });
+
+	IndexFooter footer;
+	footer.indexOffset = m_fileOffset;
+	footer.chunkCount = uint32_t(entries.size());
+	std::memcpy(footer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+
+	m_file.write(reinterpret_cast<const char*>(entries.data()), std::streamsize(entries.size() * sizeof(IndexEntry)));
+	m_file.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+}
+
+// Reader
+
+bool TrajectoryReader::Open(const std::string& path)
+{
+	m_chunks.clear();
+	m_frameTimes.clear();
+	m_chunk = -1;
+
+	if (!m_file.Open(path) || m_file.Size() < sizeof(FileHeader))
+		return false;
+
+	FileHeader header;
+	std::memcpy(&header, m_file.Data(), sizeof(header));
+	if (std::memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header.version != TRAJECTORY_VERSION)
+	{
+		m_file.Close();
+		return false;
+	}
+	m_settings.positionPrecision = header.positionPrecision;
+	m_settings.keyframeInterval = int(header.keyframeInterval);
+
+	// Use the index if the recording was finished properly
+	bool indexed = false;
+	size_t size = m_file.Size();
+	if (size >= sizeof(FileHeader) + sizeof(IndexFooter))
+	{
+		IndexFooter footer;
+		std::memcpy(&footer, m_file.Data() + size - sizeof(footer), sizeof(footer));
+		indexed = std::memcmp(footer.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0
+			&& footer.indexOffset + uint64_t(footer.chunkCount) * sizeof(IndexEntry) + sizeof(IndexFooter) == size;
+		for (uint32_t i = 0; indexed && i < footer.chunkCount; i++)
+		{
+			IndexEntry entry;
+			std::memcpy(&entry, m_file.Data() + footer.indexOffset + i * sizeof(IndexEntry), sizeof(entry));
+			Chunk chunk;
+			uint64_t next;
+			indexed = ReadChunkHeader(entry.offset, chunk, next) && chunk.firstFrame == entry.firstFrame;
+		}
+		if (!indexed)
+		{
+			m_chunks.clear();
+			m_frameTimes.clear();
+		}
+	}
+
+	// Otherwise walk the chunks, up to the first incomplete one
+	if (!indexed)
+	{
+		uint64_t offset = sizeof(FileHeader);
+		Chunk chunk;
+		uint64_t next;
+		while (ReadChunkHeader(offset, chunk, next))
+			offset = next;
+	}
+	return true;
+}
+
+bool TrajectoryReader::ReadChunkHeader(uint64_t offset, Chunk& chunk, uint64_t& next)
+{
+	size_t size = m_file.Size();
+	if (offset + sizeof(ChunkHeader) > size)
+		return false;
+
+	ChunkHeader header;
+	std::memcpy(&header, m_file.Data() + offset, sizeof(header));
+	uint64_t timesOffset = offset + sizeof(ChunkHeader);
+	uint64_t payloadOffset = timesOffset + uint64_t(header.frameCount) * sizeof(double);
+	if (std::memcmp(header.magic, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) != 0
+		|| header.firstFrame != m_frameTimes.size()
+		|| header.frameCount == 0
+		|| payloadOffset + header.compressedSize > size)
+		return false;
+
+	chunk = { payloadOffset, header.compressedSize, header.rawSize, header.firstFrame, header.frameCount };
+	m_chunks.push_back(chunk);
+	size_t first = m_frameTimes.size();
+	m_frameTimes.resize(first + header.frameCount);
+	std::memcpy(m_frameTimes.data() + first, m_file.Data() + timesOffset, header.frameCount * sizeof(double));
+	next = payloadOffset + header.compressedSize;
+	return true;
+}
+
+int TrajectoryReader::FindFrame(double time) const
+{
+	auto it = std::upper_bound(m_frameTimes.begin(), m_frameTimes.end(), time);
+	return std::max(0, int(it - m_frameTimes.begin()) - 1);
+}
+
+bool TrajectoryReader::ReadFrame(int frame, TrajectoryFrame& out)
+{
+	if (frame < 0 || frame >= FrameCount())
+		return false;
+
+	// Chunk holding the frame: the last one starting at or before it
+	auto it = std::upper_bound(m_chunks.begin(), m_chunks.end(), uint32_t(frame),
+		[](uint32_t f, const Chunk& chunk) { return f < chunk.firstFrame; });
+	int chunkIndex = int(it - m_chunks.begin()) - 1;
+
+	// Carry on from the last frame read if it is earlier in the same chunk, otherwise start again at the keyframe
+	if (chunkIndex != m_chunk || frame < m_nextFrame)
+	{
+		const Chunk& chunk = m_chunks[chunkIndex];
+		m_chunkData.resize(chunk.rawSize);
+		m_chunk = -1;
+		if (!LzDecompress(reinterpret_cast<const uint8_t*>(m_file.Data()) + chunk.payloadOffset, chunk.compressedSize, m_chunkData.data(), m_chunkData.size()))
+			return false;
+		m_chunk = chunkIndex;
+		m_cursor = 0;
+		m_nextFrame = int(chunk.firstFrame);
+		m_previousIds.clear();
+		m_previousPositions.clear();
+		m_previousVelocities.clear();
+	}
+
+	while (m_nextFrame <= frame)
+		if (!DecodeNextFrame(out))
+		{
+			m_chunk = -1;
+			return false;
+		}
+	out.time = m_frameTimes[frame];
+	return true;
+}
+
+bool TrajectoryReader::DecodeNextFrame(TrajectoryFrame& out)
+{
+	uint64_t count;
+	if (!ReadVarint(m_chunkData, m_cursor, count) || count > m_chunkData.size() - m_cursor)
+		return false;
+	out.Resize(size_t(count));
+
+	int64_t lastHigh = 0;
+	for (auto& id : out.ids)
+	{
+		uint64_t delta, low;
+		if (!ReadVarint(m_chunkData, m_cursor, delta) || !ReadVarint(m_chunkData, m_cursor, low))
+			return false;
+		lastHigh += UnZigZag(delta);
+		id = uint64_t(lastHigh) << 32 | (low & 0xFFFFFFFFu);
+	}
+
+	std::vector<int> match;
+	MatchPrevious(out.ids, m_previousIds, match);
+
+	std::vector<glm::uvec3> velocities(out.ids.size());
+	for (int c = 0; c < 3; c++)
+		for (size_t i = 0; i < velocities.size(); i++)
+		{
+			uint64_t bits;
+			if (!ReadVarint(m_chunkData, m_cursor, bits))
+				return false;
+			uint32_t reference = match[i] >= 0 ? m_previousVelocities[match[i]][c] : 0u;
+			velocities[i][c] = uint32_t(bits) ^ reference;
+		}
+	for (size_t i = 0; i < velocities.size(); i++)
+		std::memcpy(&out.velocities[i], &velocities[i], sizeof(glm::vec3));
+
+	const Chunk& chunk = m_chunks[m_chunk];
+	double dt = m_nextFrame > int(chunk.firstFrame) ? m_frameTimes[m_nextFrame] - m_frameTimes[m_nextFrame - 1] : 0.0;
+	std::vector<glm::ivec3> positions(out.ids.size());
+	for (int c = 0; c < 3; c++)
+		for (size_t i = 0; i < positions.size(); i++)
+		{
+			uint64_t delta;
+			if (!ReadVarint(m_chunkData, m_cursor, delta))
+				return false;
+			int64_t predicted = match[i] >= 0 ? PredictPosition(m_previousPositions[match[i]][c], out.velocities[i][c], dt, m_settings.positionPrecision) : 0;
+			positions[i][c] = int32_t(predicted + UnZigZag(delta));
+			out.positions[i][c] = float(double(positions[i][c]) * m_settings.positionPrecision);
+		}
+
+	m_previousIds = out.ids;
+	m_previousPositions.swap(positions);
+	m_previousVelocities.swap(velocities);
+	m_nextFrame++;
+	return true;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "MappedFile.h"
+
+// State of the particles at one step, in columns, ordered by id
+struct TrajectoryFrame
+{
+	double time = 0.0;
+	std::vector<uint64_t> ids;		// Never reused within a recording
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> velocities;
+
+	void Resize(size_t count)
+	{
+		ids.resize(count);
+		positions.resize(count);
+		velocities.resize(count);
+	}
+};
+
+// Trajectory files hold every recorded step in chunks. A chunk starts with a keyframe, encoded on its own, and the
+// frames after it are encoded against the frame before: velocities as the XOR of their bits with the previous ones
+// (lossless), positions quantised and stored as the difference to the previous position moved on by the velocity. Ids
+// are 64 bits, stored as the difference of their upper halves to the previous id's plus their lower half. The id, x, y
+// and z columns are stored one after the other and varint coded, so the near-zero differences turn into runs of small
+// bytes that the LZ compression of the whole chunk then squeezes. An index of the chunks at the end of the file lets
+// the reader jump to any frame by decoding at most one chunk.
+namespace TrajectoryFormat
+{
+	struct Settings
+	{
+		float positionPrecision = 1e-4f;	// Quantum of the stored positions, in m
+		int keyframeInterval = 64;			// Frames per chunk: more compress better, fewer seek faster
+	};
+}
+
+// Records frames to a trajectory file. The engine hands each frame over with Submit, which only swaps buffers; the
+// encoding, compression and writing all happen on the recorder's thread, so the simulation never waits for the disk
+class TrajectoryRecorder
+{
+public:
+	using Settings = TrajectoryFormat::Settings;
+
+	~TrajectoryRecorder();
+
+	// Starts a new recording, replacing the file. False if it can't be created
+	bool Start(const std::string& path, const Settings& settings = Settings());
+	// Stops accepting frames. The writer thread finishes the queued ones and the index in the background
+	void Stop();
+	bool Recording() const { return m_recording; }
+
+	// Queues a frame, taking its contents and leaving frame with a recycled buffer to fill next time. If the writer has
+	// fallen more than MAX_QUEUED_FRAMES behind, the frame is dropped instead of waiting
+	void Submit(TrajectoryFrame& frame);
+
+	int RecordedFrames() const;
+	int DroppedFrames() const;
+
+	static const int MAX_QUEUED_FRAMES = 256;
+
+private:
+	struct ChunkInfo
+	{
+		uint64_t offset;
+		uint32_t firstFrame;
+		uint32_t frameCount;
+	};
+
+	void WriterLoop();
+	void EncodeFrame(const TrajectoryFrame& frame);
+	void FlushChunk();
+	void WriteIndex();
+	// Waits for the writer of a previous recording to finish
+	void Join();
+
+	Settings m_settings;
+	std::atomic<bool> m_recording{ false };
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::deque<TrajectoryFrame> m_queue;
+	std::vector<TrajectoryFrame> m_free;	// Emptied frames, handed back by Submit so steady recording doesn't allocate
+	bool m_stopping = false;
+	int m_recorded = 0;
+	int m_dropped = 0;
+	std::thread m_thread;
+
+	// Writer thread only
+	std::ofstream m_file;
+	uint64_t m_fileOffset = 0;
+	std::vector<ChunkInfo> m_chunks;
+	uint32_t m_frameCount = 0;
+	uint32_t m_chunkFirstFrame = 0;
+	std::vector<double> m_chunkTimes;
+	std::vector<uint8_t> m_chunkData;		// Encoded frames of the current chunk, before compression
+	std::vector<uint8_t> m_compressed;
+	std::vector<uint64_t> m_previousIds;	// Last encoded frame, which the next one is encoded against
+	std::vector<glm::ivec3> m_previousPositions;
+	std::vector<glm::uvec3> m_previousVelocities;
+};
+
+// Reads trajectory files. The file is mapped, so opening is instant and only the chunks that are read are loaded
+class TrajectoryReader
+{
+public:
+	// False if the file doesn't exist or isn't a trajectory. A recording that was cut short (e.g. by a crash) has no
+	// index; its chunks are found by walking the file instead
+	bool Open(const std::string& path);
+
+	int FrameCount() const { return int(m_frameTimes.size()); }
+	double FrameTime(int frame) const { return m_frameTimes[frame]; }
+	// Last frame at or before time, 0 if time is before the first frame
+	int FindFrame(double time) const;
+
+	// Decodes a frame. Reading the frames in order decodes each once; any other frame costs at most a chunk's worth of
+	// decoding from its keyframe. False if the file is damaged
+	bool ReadFrame(int frame, TrajectoryFrame& out);
+
+private:
+	struct Chunk
+	{
+		uint64_t payloadOffset;
+		uint32_t compressedSize;
+		uint32_t rawSize;
+		uint32_t firstFrame;
+		uint32_t frameCount;
+	};
+
+	bool ReadChunkHeader(uint64_t offset, Chunk& chunk, uint64_t& next);
+	bool DecodeNextFrame(TrajectoryFrame& out);
+
+	MappedFile m_file;
+	TrajectoryFormat::Settings m_settings;
+	std::vector<Chunk> m_chunks;
+	std::vector<double> m_frameTimes;
+
+	// Decoding position: the decompressed chunk, where the next frame starts in it, and the frame decoded last
+	int m_chunk = -1;
+	std::vector<uint8_t> m_chunkData;
+	size_t m_cursor = 0;
+	int m_nextFrame = 0;
+	std::vector<uint64_t> m_previousIds;
+	std::vector<glm::ivec3> m_previousPositions;
+	std::vector<glm::uvec3> m_previousVelocities;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free triple buffer for one writer thread and one reader thread.
+// The writer fills its back slot and publishes it by swapping it with the middle slot; the reader swaps its front slot
+// with the middle one whenever something new was published. Neither side ever waits for the other, and the reader
+// always sees the most recent complete value.
+template<typename T>
+class TripleBuffer
+{
+public:
+	// Writer: the slot to fill before calling Publish
+	T& WriteBuffer() { return m_slots[m_back]; }
+
+	// Writer: makes the filled slot visible to the reader
+	void Publish()
+	{
+		m_back = m_middle.exchange(m_back | FRESH_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+	}
+
+	// Reader: the latest published value, or nullptr if nothing was published yet
+	const T* Read()
+	{
+		if (m_middle.load(std::memory_order_acquire) & FRESH_BIT)
+		{
+			m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX_MASK;
+			m_hasData = true;
+		}
+		return m_hasData ? &m_slots[m_front] : nullptr;
+	}
+
+private:
+	static const int FRESH_BIT = 4;
+	static const int INDEX_MASK = 3;
+
+	T m_slots[3];
+	int m_back = 0;						// Owned by the writer
+	std::atomic<int> m_middle{ 1 };		// Shared, with FRESH_BIT set when it holds an unread value
+	int m_front = 2;					// Owned by the reader
+	bool m_hasData = false;
+};